@@ -0,0 +1,83 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+enum admission_result
+{
+    ADMISSION_ADMIT,
+    ADMISSION_RATE_LIMITED,    // client IP is out of tokens, 429
+    ADMISSION_OVERLOADED       // too many in flight or queued too long, 503
+};
+
+/**
+ * Map the shared bucket table, call before forking the workers
+ *
+ * @return 0 on success, -1 on failure
+ */
+int admission_init(void);
+
+/**
+ * Coarse monotonic clock in milliseconds
+ *
+ * @return ms
+ */
+uint64_t admission_now_ms(void);
+
+/**
+ * Decide whether to serve a freshly accepted connection, lock free
+ *
+ * Admitted connections count against the global limit until admission_done.
+ *
+ * @param addr   Client address from accept
+ * @param now_ms admission_now_ms
+ *
+ * @return admission_result
+ */
+int admission_check(const struct sockaddr *addr, uint64_t now_ms);
+
+/**
+ * Record how long an admitted connection waited for a pool thread
+ *
+ * @param delay_ms Time from accept until a thread picked it up
+ * @param now_ms   admission_now_ms
+ */
+void admission_queue_delay(uint64_t delay_ms, uint64_t now_ms);
+
+/**
+ * An admitted connection is finished
+ */
+void admission_done(void);
+
+/**
+ * Count the admissions of this process against a worker, call in the worker
+ * after forking
+ *
+ * @param worker_id Worker index
+ */
+void admission_set_worker(int worker_id);
+
+/**
+ * Give back what a dead worker had admitted and not finished, call in the
+ * master before forking its replacement
+ *
+ * @param worker_id Worker index
+ */
+void admission_worker_exited(int worker_id);
+
+/**
+ * Send the precomputed rejection for a result and leave the socket to the
+ * caller to close
+ *
+ * @param client_fd Client socket
+ * @param result    ADMISSION_RATE_LIMITED or ADMISSION_OVERLOADED
+ */
+void admission_reject(int client_fd, int result);
+
+/**
+ * Unmap the shared bucket table
+ */
+void admission_cleanup(void);
+
+#endif    // ADMISSION_H
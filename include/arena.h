@@ -0,0 +1,116 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+struct arena_slab
+{
+    struct arena_slab *next;
+    size_t             size;
+    size_t             used;
+    // slab memory follows the header
+};
+
+struct arena
+{
+    struct arena_slab *first;
+    struct arena_slab *current;
+    size_t             used;    // bytes handed out since the last reset
+    size_t             peak;
+    size_t             capacity;
+    size_t             slab_allocs;    // since last handed back to a pool
+    struct arena      *next_free;      // arena_pool free list
+};
+
+struct arena_stats
+{
+    size_t peak;           // largest use of a single arena
+    size_t capacity;       // memory held by idle pooled arenas
+    size_t arenas;         // arenas alive, idle or in use
+    size_t slab_allocs;    // slabs that had to come from malloc
+};
+
+struct arena_pool
+{
+    pthread_mutex_t    lock;
+    struct arena      *free;
+    size_t             free_count;
+    struct arena_stats stats;
+};
+
+/**
+ * Initialize an arena with one slab
+ *
+ * @param arena Arena
+ * @param size  Size of the first slab
+ *
+ * @return 0 on success, -1 on failure
+ */
+int arena_init(struct arena *arena, size_t size);
+
+/**
+ * Bump allocate from the arena, adding a slab if the current one is full
+ *
+ * @param arena Arena
+ * @param size  Bytes to allocate
+ *
+ * @return aligned memory on success, NULL on failure
+ */
+void *arena_alloc(struct arena *arena, size_t size);
+
+/**
+ * Release everything allocated from the arena, the slabs are kept for reuse
+ * up to ARENA_RETAIN_SIZE
+ *
+ * @param arena Arena
+ */
+void arena_reset(struct arena *arena);
+
+/**
+ * Free all slabs of the arena
+ *
+ * @param arena Arena
+ */
+void arena_destroy(struct arena *arena);
+
+/**
+ * Initialize a pool of reusable arenas
+ *
+ * @param pool Pool
+ */
+void arena_pool_init(struct arena_pool *pool);
+
+/**
+ * Take an arena from the pool, creating one if the pool is empty
+ *
+ * @param pool Pool
+ *
+ * @return arena on success, NULL on failure
+ */
+struct arena *arena_pool_acquire(struct arena_pool *pool);
+
+/**
+ * Reset an arena and hand it back to the pool
+ *
+ * @param pool  Pool
+ * @param arena Arena from arena_pool_acquire
+ */
+void arena_pool_release(struct arena_pool *pool, struct arena *arena);
+
+/**
+ * Copy the pool statistics
+ *
+ * @param pool  Pool
+ * @param stats Output
+ */
+void arena_pool_stats(struct arena_pool *pool, struct arena_stats *stats);
+
+/**
+ * Free every pooled arena
+ *
+ * @param pool Pool
+ */
+void arena_pool_destroy(struct arena_pool *pool);
+
+#endif    // ARENA_H
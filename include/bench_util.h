@@ -0,0 +1,79 @@
+#ifndef BENCH_UTIL_H
+#define BENCH_UTIL_H
+
+#include <netdb.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define BENCH_READ_SIZE 16384
+
+/**
+ * CLOCK_MONOTONIC in nanoseconds
+ *
+ * @return now
+ */
+uint64_t bench_now_ns(void);
+
+/**
+ * Send all of buf, retrying on EINTR and without SIGPIPE
+ *
+ * @param fd  Connected socket
+ * @param buf Data
+ * @param len Bytes in buf
+ *
+ * @return 0 on success, -1 on failure
+ */
+int bench_send_all(int fd, const char *buf, size_t len);
+
+/**
+ * Read a response until the server closes, keeping only its status line
+ *
+ * @param fd Connected socket, left open
+ *
+ * @return the status code, 0 when there is no valid status line, -1 when a read failed
+ */
+int bench_read_status(int fd);
+
+/**
+ * qsort comparator for uint32_t
+ *
+ * @param a First value
+ * @param b Second value
+ *
+ * @return <0, 0 or >0
+ */
+int bench_compare_u32(const void *a, const void *b);
+
+/**
+ * Nearest-rank percentile of sorted samples
+ *
+ * @param sorted Samples in ascending order
+ * @param count  Number of samples
+ * @param p      Between 0 and 1
+ *
+ * @return the sample, 0 when there are none
+ */
+uint32_t bench_percentile(const uint32_t *sorted, size_t count, double p);
+
+/**
+ * Relative change between two measurements
+ *
+ * @param before Baseline
+ * @param after  New value
+ *
+ * @return percent, 0 when before is 0
+ */
+double bench_change(uint32_t before, uint32_t after);
+
+/**
+ * Resolve host:port, the host may be a bracketed IPv6 address
+ *
+ * @param tool   Prefix of the error messages
+ * @param target host:port
+ * @param addr   Result, freed with freeaddrinfo
+ *
+ * @return 0 on success, -1 on failure
+ */
+int bench_resolve(const char *tool, const char *target, struct addrinfo **addr);
+
+#endif    // BENCH_UTIL_H
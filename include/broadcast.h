@@ -0,0 +1,79 @@
+#ifndef BROADCAST_H
+#define BROADCAST_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum broadcast_result
+{
+    BROADCAST_OK,
+    BROADCAST_PENDING,    // not published yet
+    BROADCAST_GONE,       // overwritten, the reader fell more than a ring behind
+};
+
+/**
+ * Map the shared message ring and create one eventfd per worker, call
+ * before forking the workers
+ *
+ * @return 0 on success, -1 on failure
+ */
+int broadcast_init(void);
+
+/**
+ * Append a message to the ring and wake the subscriber thread of every worker
+ *
+ * @param data Message, cut at BROADCAST_MESSAGE_MAX
+ * @param len  Length
+ *
+ * @return 0 on success, -1 when the ring is not set up
+ */
+int broadcast_publish(const void *data, size_t len);
+
+/**
+ * Sequence number the next message will get
+ *
+ * @return messages published so far
+ */
+uint64_t broadcast_head(void);
+
+/**
+ * Copy a message out of the ring
+ *
+ * @param seq Sequence number
+ * @param buf At least BROADCAST_MESSAGE_MAX bytes
+ * @param len Output, message length
+ *
+ * @return broadcast_result
+ */
+int broadcast_read(uint64_t seq, char *buf, size_t *len);
+
+/**
+ * Eventfd that becomes readable when messages were published
+ *
+ * @param worker_id Worker index
+ *
+ * @return eventfd, -1 when the ring is not set up
+ */
+int broadcast_fd(int worker_id);
+
+/**
+ * Clear the eventfd of a worker before reading what was published, later
+ * publishes signal it again
+ *
+ * @param worker_id Worker index
+ */
+void broadcast_rearm(int worker_id);
+
+/**
+ * Signal the eventfd of a worker without publishing
+ *
+ * @param worker_id Worker index
+ */
+void broadcast_wake(int worker_id);
+
+/**
+ * Unmap the ring and close the eventfds
+ */
+void broadcast_cleanup(void);
+
+#endif    // BROADCAST_H
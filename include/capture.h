@@ -0,0 +1,69 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include "arena.h"
+#include "http.h"
+#include <stdint.h>
+
+#define CAPTURE_MAGIC 0x50434843U    // "CHCP"
+#define CAPTURE_VERSION 1
+
+#define CAPTURE_TRUNCATED 0x1U    // body not captured in full, replayed with what was kept
+
+// start of a capture file, records follow back to back
+struct capture_file_header
+{
+    uint32_t magic;
+    uint32_t version;
+};
+
+// one request, followed by length bytes: the head as it can be resent, then the body
+struct capture_record
+{
+    uint32_t length;
+    uint32_t head_len;
+    uint64_t time_ns;    // CLOCK_REALTIME when the head was parsed
+    uint32_t flags;
+    uint32_t reserved;
+};
+
+// state of a request between capture_begin and capture_commit
+struct capture
+{
+    int           sampled;
+    uint64_t      time_ns;
+    struct arena *arena;
+};
+
+/**
+ * Open the capture file for appending, call before forking the workers
+ *
+ * @return 0 on success, -1 on failure
+ */
+int capture_init(void);
+
+/**
+ * Decide whether to capture a request, sampled every CAPTURE_SAMPLE_RATE
+ * calls per thread, and start copying its body
+ *
+ * @param cap   State
+ * @param body  Body reader of the request
+ * @param arena Request arena
+ */
+void capture_begin(struct capture *cap, struct http_body *body, struct arena *arena);
+
+/**
+ * Append a sampled request to the capture file, after it has been served
+ *
+ * @param cap  State
+ * @param req  Request
+ * @param body Body reader of the request
+ */
+void capture_commit(const struct capture *cap, const struct http_request *req, const struct http_body *body);
+
+/**
+ * Close the capture file
+ */
+void capture_cleanup(void);
+
+#endif    // CAPTURE_H
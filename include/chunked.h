@@ -0,0 +1,61 @@
+#ifndef CHUNKED_H
+#define CHUNKED_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+enum chunked_state
+{
+    CHUNKED_SIZE,
+    CHUNKED_EXT,
+    CHUNKED_SIZE_LF,
+    CHUNKED_DATA,
+    CHUNKED_DATA_CR,
+    CHUNKED_DATA_LF,
+    CHUNKED_TRAILER,
+    CHUNKED_TRAILER_LINE,
+    CHUNKED_TRAILER_LF,
+    CHUNKED_DONE
+};
+
+// incremental Transfer-Encoding: chunked decoder, needs no buffering
+struct chunked
+{
+    int    state;
+    size_t remaining;    // payload bytes left in the current chunk
+    int    digits;
+};
+
+/**
+ * Reset a decoder for a new body
+ *
+ * @param c Decoder
+ */
+void chunked_init(struct chunked *c);
+
+/**
+ * Consume framing up to the next run of payload bytes
+ *
+ * Call again with the rest of the buffer until it is used up. The payload
+ * found, if any, is returned in place through data and data_len.
+ *
+ * @param c        Decoder
+ * @param buf      Wire bytes
+ * @param len      Number of wire bytes
+ * @param data     Start of payload in buf, set when data_len is non-zero
+ * @param data_len Number of payload bytes
+ *
+ * @return bytes of buf consumed, -1 on malformed framing
+ */
+ssize_t chunked_parse(struct chunked *c, const char *buf, size_t len, const char **data, size_t *data_len);
+
+/**
+ * Whether the terminating chunk and trailers have been seen
+ *
+ * @param c Decoder
+ *
+ * @return non-zero when done
+ */
+int chunked_done(const struct chunked *c);
+
+#endif    // CHUNKED_H
@@ -2,8 +2,85 @@
 #define CONFIG_H
 
 #define PORT 8080
-#define WORKER_COUNT 3
+#define SERVER_BACKLOG 4096          // capped by net.core.somaxconn
+#define SERVER_DEFER_ACCEPT 5        // seconds a connection may sit without data before accept sees it
+#define SERVER_FASTOPEN_QUEUE 256    // pending TCP Fast Open requests, 0 disables
+#define WORKER_ACCEPT_BATCH 64       // accepts per wakeup before the timer wheel gets a turn
+#define WORKER_COUNT 3               // processes
+#define WORKER_THREADS 4             // pool threads per process
+#define POOL_DEQUE_SIZE 256
+#define WORKER_MAX_CONNS (WORKER_THREADS * (POOL_DEQUE_SIZE + 1))
+#define ARENA_SLAB_SIZE 16384        // first slab of a connection arena
+#define ARENA_RETAIN_SIZE 1048576    // slabs kept across resets
+#define ARENA_POOL_SIZE WORKER_THREADS
 #define HANDLER_LIBRARY "./lib_handler.so"
+#define HTTP_HEAD_MAX 8192        // request line and headers, larger heads get 431
+#define HTTP_BODY_MAX 16777216    // larger bodies get 413
+#define HTTP_BODY_CHUNK 16384     // piece size when a body is copied through user space
+#define HTTP_SPILL_DIR "/tmp"     // unlinked temp files for spilled bodies
+#define LIBRARY_MAX 16
+#define LIBRARY_CHECK_MS 1000    // how often a worker looks for updated handler libraries
+
+// handler routes by longest prefix, method "*" matches any, e.g. {"GET", "/static/", "./lib_static.so"}
+#define HANDLER_ROUTES {{"*", "/", HANDLER_LIBRARY}, {NULL, NULL, NULL}}
+
+// read by the handler when it is loaded, in the master before the workers fork
+#define HANDLER_DOCROOT "."                 // request paths resolve under it
+#define HANDLER_PRELOAD_DIR "public"        // files kept in memory shared by all workers, relative to the docroot
+#define HANDLER_PRELOAD_FILE_MAX 1048576    // larger files are served with sendfile
+#define HANDLER_PRELOAD_MAX 33554432        // bytes in total, 0 disables preloading
+#define HANDLER_PRELOAD_FILES 1024
+#define HANDLER_ARCHIVE NULL             // archive from make pack, e.g. "public.pack", serves GET and HEAD instead of the docroot
+#define HANDLER_ARCHIVE_CHECK_MS 1000    // how often a worker looks for a new archive renamed over it
+
+// per-worker cache of open docroot files for the handler, entries are dropped on inotify events
+#define FILE_CACHE_ENTRIES 1024    // open files and known missing paths, 0 disables
+#define FILE_CACHE_TTL_MS 30000    // an entry is looked up again after this even without an event
+#define FILE_CACHE_WATCHES 256     // docroot directories watched, files in others only expire
+
+#define TIMER_TICK_MS 10
+#define TIMEOUT_HEADER_MS 10000    // accept until the request head is read
+#define TIMEOUT_BODY_MS 30000      // between body reads
+#define TIMEOUT_WRITE_MS 30000     // between response writes
+
+#define ADMISSION_TABLE_SIZE 65536      // per client IP token buckets shared by all workers
+#define ADMISSION_PROBES 8
+#define ADMISSION_RATE 50               // tokens per second per client IP
+#define ADMISSION_BURST 100
+#define ADMISSION_IDLE_MS 60000         // a bucket this quiet can be reused by another IP
+#define ADMISSION_MAX_IN_FLIGHT (WORKER_COUNT * WORKER_MAX_CONNS / 2)
+#define ADMISSION_QUEUE_DELAY_MS 200    // shed while the average wait for a thread is above this
+#define ADMISSION_DELAY_WINDOW_MS 1000
+#define ADMISSION_RETRY_AFTER 1         // seconds
+
+// proxy routes, e.g. {{"/api/", PROXY_LB_ROUND_ROBIN, "127.0.0.1:9001,unix:/tmp/api.sock"}, {NULL, 0, NULL}}
+#define PROXY_ROUTES {{NULL, 0, NULL}}
+#define PROXY_MAX_UPSTREAMS 16
+#define PROXY_POOL_SIZE 32        // idle keep-alive connections per upstream per worker
+#define PROXY_VNODES 64           // consistent hash ring points per upstream
+#define PROXY_MAX_FAILS 3         // consecutive failures before an upstream is marked down
+#define PROXY_FAIL_TIMEOUT_MS 10000
+#define PROXY_TIMEOUT_MS 30000    // connect, read and write on upstream sockets
+#define PROXY_HEAD_MAX 8192
+#define PROXY_BUFFER_SIZE 16384
+
+#define TRACE_SAMPLE_RATE 100                      // trace one request in this many per accept thread, 0 disables
+#define TRACE_RING_SIZE 4096                       // sampled requests kept per worker
+#define TRACE_SHM_PATH "/dev/shm/c-http-trace"    // read by trace dump
+
+#define CAPTURE_SAMPLE_RATE 0         // capture one request in this many per pool thread, 0 disables
+#define CAPTURE_PATH "capture.bin"    // appended to, read by replay
+#define CAPTURE_BODY_MAX 65536        // body bytes kept per request, longer bodies are marked truncated
+
+// push of stored posts over SSE or WebSocket on GET of this prefix, NULL disables
+#define SUBSCRIBE_ROUTE "/subscribe"
+#define SUBSCRIBE_MAX 4096                 // subscribers per worker
+#define SUBSCRIBE_LAG_MAX 256              // messages a subscriber may fall behind
+#define SUBSCRIBE_ON_LAG SUBSCRIBE_SKIP    // then skip it to the newest, or SUBSCRIBE_CLOSE
+#define SUBSCRIBE_STALL_MS 30000           // a subscriber that takes no data for this long is closed
+#define SUBSCRIBE_HEARTBEAT_MS 15000       // SSE comment or WebSocket ping to idle subscribers
+#define BROADCAST_RING_SIZE 1024           // messages shared by all workers, at least SUBSCRIBE_LAG_MAX
+#define BROADCAST_MESSAGE_MAX 1024
 
 #define WORKER_SIGTERM_TIMEOUT 5
 #define WORKER_SLEEP 100000000    // 100ms in nanosecs
@@ -0,0 +1,65 @@
+#ifndef CONN_H
+#define CONN_H
+
+#include "timer.h"
+#include "trace.h"
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// state of an accepted connection while it is queued or being served
+struct conn
+{
+    int                 fd;
+    uint64_t            accepted_ms;    // admission_now_ms at accept
+    struct timer        timer;
+    struct trace_record trace;
+    struct conn        *next_free;
+};
+
+// fixed table so accepting a connection does not allocate
+struct conn_table
+{
+    pthread_mutex_t lock;
+    struct conn    *conns;
+    struct conn    *free;
+    size_t          count;
+    size_t          in_use;
+};
+
+/**
+ * Allocate the connection table
+ *
+ * @param table Table
+ * @param count Maximum number of connections
+ *
+ * @return 0 on success, -1 on failure
+ */
+int conn_table_init(struct conn_table *table, size_t count);
+
+/**
+ * Take a free connection slot
+ *
+ * @param table Table
+ * @param fd    Client socket
+ *
+ * @return connection on success, NULL if the table is full
+ */
+struct conn *conn_acquire(struct conn_table *table, int fd);
+
+/**
+ * Give a connection slot back, the socket must already be closed
+ *
+ * @param table Table
+ * @param conn  Connection
+ */
+void conn_release(struct conn_table *table, struct conn *conn);
+
+/**
+ * Free the connection table
+ *
+ * @param table Table
+ */
+void conn_table_destroy(struct conn_table *table);
+
+#endif    // CONN_H
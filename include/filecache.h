@@ -0,0 +1,53 @@
+#ifndef FILECACHE_H
+#define FILECACHE_H
+
+#include "handler.h"
+
+/**
+ * Open the docroot and the inotify watch of the worker's file cache, call in
+ * the worker after forking
+ *
+ * @param worker_id Worker index, selects the stats slot
+ *
+ * @return 0 on success, -1 when the cache is off and every lookup opens the file
+ */
+int file_cache_init(int worker_id);
+
+/**
+ * Look up a request path under HANDLER_DOCROOT, from the cache or by opening
+ * it, the file_open hook of the handler
+ *
+ * @param path Request path, . and .. segments are resolved and may not leave the docroot
+ * @param file Filled in on success
+ *
+ * @return 0 on success, ENOENT for a missing path, EACCES for an unreadable
+ *         one or EIO when the file could not be opened now
+ */
+int file_cache_open(const char *path, struct handler_file *file);
+
+/**
+ * Give back a file from file_cache_open, its fd is closed once it is no
+ * longer cached or used
+ *
+ * @param file File
+ */
+void file_cache_release(struct handler_file *file);
+
+/**
+ * inotify descriptor to wait on, readable when the docroot changed
+ *
+ * @return fd, -1 without inotify
+ */
+int file_cache_fd(void);
+
+/**
+ * Drop the entries of changed paths, call when file_cache_fd is readable
+ */
+void file_cache_poll(void);
+
+/**
+ * Close every cached file and the inotify descriptor
+ */
+void file_cache_cleanup(void);
+
+#endif    // FILECACHE_H
@@ -1,7 +1,9 @@
 #ifndef HANDLER_H
 #define HANDLER_H
 
+#include "http.h"
 #include <stdlib.h>
+#include <time.h>
 
 #ifdef __APPLE__
 typedef size_t datum_size;
@@ -13,21 +15,46 @@ typedef int datum_size;
 
 #define MAKE_CONST_DATUM(str) ((const_datum){(str), (datum_size)strlen(str) + 1})
 
-struct req_info
-{
-    char *method;
-    char *path;
-    char *protocol;
-};
-
 typedef struct
 {
     const void *dptr;
     datum_size  dsize;
 } const_datum;
 
+// Bumped whenever the handler entry points change, libraries built for another one are refused
+#define HANDLER_ABI_VERSION 2
+
+// a docroot file handed out by the worker, the fd is shared so it is only read at an offset
+struct handler_file
+{
+    int             fd;
+    size_t          size;
+    struct timespec mtime;
+    const char     *mime;
+    void           *ref;    // cache entry, NULL when the caller owns fd
+};
+
+// Services the worker hands to the handler, set before init_handler
+struct handler_hooks
+{
+    // client_fd enters a timer_phase, re-arms its deadline
+    void (*phase)(int client_fd, int phase);
+    // timestamp a trace_point of the request on the calling thread
+    void (*trace)(int point);
+    // hand a message to the subscribers of every worker
+    int (*publish)(const void *data, size_t len);
+    // look up a request path in the worker's open file cache, 0 with file filled in or ENOENT, EACCES, EIO
+    int (*file_open)(const char *path, struct handler_file *file);
+    // give back a file from file_open once the response is sent
+    void (*file_release)(struct handler_file *file);
+};
+
+typedef void (*handler_fn)(const struct http_request *req, struct http_response *res);
+
 // Function signature for shared library
-void init_handler(void);
-void handle_request(int client_fd);
+extern const int handler_abi_version;    // HANDLER_ABI_VERSION
+void             init_handler(void);
+void             handle_request(const struct http_request *req, struct http_response *res);
+void             handler_set_hooks(const struct handler_hooks *hooks);    // optional
 
 #endif    // !HANDLER_H
@@ -0,0 +1,204 @@
+#ifndef HTTP_H
+#define HTTP_H
+
+#include "arena.h"
+#include "chunked.h"
+#include <stddef.h>
+#include <strings.h>
+#include <sys/types.h>
+
+#define HTTP_MAX_HEADERS 64
+
+struct http_header
+{
+    const char *name;
+    const char *value;
+};
+
+struct http_body;
+
+// body reader given to handlers, the body is decoded as it comes off the socket
+struct http_body_ops
+{
+    // up to cap decoded bytes, 0 at the end, -1 when the body is bad, too large or the client is gone
+    ssize_t (*read)(struct http_body *body, void *buf, size_t cap);
+    // rest of the body into an unlinked temp file, returns its fd at offset 0, -1 on failure
+    int (*spill)(struct http_body *body, off_t *len);
+};
+
+struct http_body
+{
+    const struct http_body_ops *ops;
+    long long                   length;      // from Content-Length, -1 for chunked
+    long long                   received;    // decoded bytes handed out so far
+    const char                 *status;      // why read failed, sent by the worker if the handler sends nothing
+    // worker private below
+    int            fd;
+    const char    *prefix;    // body bytes that arrived with the head
+    size_t         prefix_len;
+    int            chunked;
+    int            done;
+    int            expect_continue;
+    struct chunked decoder;
+    char          *tee;    // copy of the decoded body, for capture
+    size_t         tee_cap;
+    size_t         tee_len;
+    void (*phase)(int client_fd, int phase);
+};
+
+// request parsed once by the worker, all strings live in the arena
+struct http_request
+{
+    const char        *method;
+    const char        *target;    // path and query as sent
+    const char        *path;
+    const char        *query;    // after '?', NULL when absent
+    const char        *protocol;
+    struct http_header headers[HTTP_MAX_HEADERS];
+    int                header_count;
+    long long          content_length;    // -1 when absent
+    int                chunked;
+    const char        *body;        // body bytes that arrived with the head, NUL terminated
+    size_t             body_len;
+    struct http_body  *reader;      // the whole body, use this rather than body
+    struct arena      *arena;       // reset when the request is done
+};
+
+struct http_response;
+
+// response writer given to handlers
+struct http_response_ops
+{
+    // extra header for the head, call before begin
+    int (*header)(struct http_response *res, const char *name, const char *value);
+    // send the head, content_length -1 leaves the body delimited by close
+    int (*begin)(struct http_response *res, const char *status, const char *mime, long long content_length);
+    int (*write)(struct http_response *res, const void *data, size_t len);
+    int (*sendfile)(struct http_response *res, int fd, off_t offset, size_t len);
+    // begin and write in one go
+    int (*send)(struct http_response *res, const char *status, const char *mime, const void *body, size_t len);
+};
+
+struct http_response
+{
+    const struct http_response_ops *ops;
+    int                             started;    // head sent
+    int                             failed;     // a write failed, the client is gone
+    // worker private below
+    int           fd;
+    struct arena *arena;
+    char         *headers;
+    size_t        headers_len;
+    size_t        headers_cap;
+    void (*phase)(int client_fd, int phase);
+};
+
+enum http_read_result
+{
+    HTTP_READ_OK,
+    HTTP_READ_CLOSED,       // nothing arrived before EOF or timeout
+    HTTP_READ_BAD,          // 400
+    HTTP_READ_TOO_LARGE,    // 431
+};
+
+/**
+ * Read and parse a request head, plus whatever body bytes came with it
+ *
+ * @param fd    Client socket
+ * @param arena Arena for the buffer and the parsed strings
+ * @param req   Output
+ *
+ * @return http_read_result
+ */
+int http_read_request(int fd, struct arena *arena, struct http_request *req);
+
+/**
+ * Set up the body reader of a request
+ *
+ * @param body  Reader, stays valid for the request
+ * @param req   Parsed request, its reader is pointed at body
+ * @param fd    Client socket
+ * @param phase Called with TIMER_BODY before each socket read, may be NULL
+ */
+void http_body_init(struct http_body *body, struct http_request *req, int fd, void (*phase)(int client_fd, int phase));
+
+/**
+ * Keep a copy of the first cap decoded body bytes handed out by read, spilled
+ * bodies bypass it
+ *
+ * @param body Reader
+ * @param buf  Copy, tee_len says how much of it is filled
+ * @param cap  Size of buf
+ */
+void http_body_tee(struct http_body *body, char *buf, size_t cap);
+
+/**
+ * Send 100 Continue if the client asked for it and is still waiting, for
+ * code that reads the body off the socket itself
+ *
+ * @param body Reader
+ *
+ * @return 0 on success, -1 when the write failed
+ */
+int http_body_continue(struct http_body *body);
+
+/**
+ * Set up a response writer
+ *
+ * @param res   Writer
+ * @param fd    Client socket
+ * @param arena Arena for the extra headers
+ * @param phase Called with TIMER_WRITE when the head goes out, may be NULL
+ */
+void http_response_init(struct http_response *res, int fd, struct arena *arena, void (*phase)(int client_fd, int phase));
+
+/**
+ * Send a small html error page
+ *
+ * @param res    Writer
+ * @param status Status line text, e.g. "404 Not Found"
+ */
+void http_response_error(struct http_response *res, const char *status);
+
+/**
+ * Write everything, retrying short writes
+ *
+ * @param fd  Socket
+ * @param buf Data
+ * @param len Length
+ *
+ * @return 0 on success, -1 on failure
+ */
+int http_write_all(int fd, const void *buf, size_t len);
+
+/**
+ * Whether a comma or space separated header value lists a token, case-insensitive
+ *
+ * @param value Header value
+ * @param token e.g. "chunked"
+ *
+ * @return 1 if it does, 0 if not
+ */
+int http_has_token(const char *value, const char *token);
+
+/**
+ * Case-insensitive header lookup
+ *
+ * @param req  Request
+ * @param name Header name
+ *
+ * @return value, NULL when absent
+ */
+static inline const char *http_header(const struct http_request *req, const char *name)
+{
+    for(int i = 0; i < req->header_count; i++)
+    {
+        if(strcasecmp(req->headers[i].name, name) == 0)
+        {
+            return req->headers[i].value;
+        }
+    }
+    return NULL;
+}
+
+#endif    // HTTP_H
@@ -0,0 +1,63 @@
+#ifndef LIBRARY_H
+#define LIBRARY_H
+
+#include "handler.h"
+
+/**
+ * Add a handler library, the same path is only added once
+ *
+ * @param path Path of the shared object
+ *
+ * @return library index on success, -1 on failure
+ */
+int library_register(const char *path);
+
+/**
+ * Load every registered library
+ *
+ * @param hooks Services handed to each library through handler_set_hooks
+ * @param tag   Prefix for log lines
+ */
+void library_load_all(const struct handler_hooks *hooks, const char *tag);
+
+/**
+ * Reload the libraries whose file changed, each one waits only for its own
+ * requests in flight
+ */
+void library_check(void);
+
+/**
+ * Start a thread that runs library_check every LIBRARY_CHECK_MS, so waiting
+ * for requests in flight never stalls the caller
+ *
+ * @return 0 on success, -1 on failure
+ */
+int library_check_start(void);
+
+/**
+ * Stop the thread started by library_check_start
+ */
+void library_check_stop(void);
+
+/**
+ * Pin a library for one request
+ *
+ * @param index Library index
+ *
+ * @return handler, NULL when the library is not loaded; call library_release either way
+ */
+handler_fn library_acquire(int index);
+
+/**
+ * Unpin a library after library_acquire
+ *
+ * @param index Library index
+ */
+void library_release(int index);
+
+/**
+ * Unload every library
+ */
+void library_cleanup(void);
+
+#endif    // LIBRARY_H
@@ -0,0 +1,54 @@
+#ifndef MIME_H
+#define MIME_H
+
+#include <string.h>
+
+/**
+ * Content type by file extension, shared by the handler and the pack tool
+ *
+ * @param file_path Path or file name
+ *
+ * @return MIME type, application/octet-stream when unknown
+ */
+static inline const char *mime_type(const char *file_path)
+{
+    const char *ext = strrchr(file_path, '.');
+    if(ext == NULL)
+    {
+        return "application/octet-stream";
+    }
+
+    if(strcmp(ext, ".html") == 0)
+    {
+        return "text/html";
+    }
+
+    if(strcmp(ext, ".css") == 0)
+    {
+        return "text/css";
+    }
+
+    if(strcmp(ext, ".js") == 0)
+    {
+        return "application/javascript";
+    }
+
+    if(strcmp(ext, ".jpg") == 0 || strcmp(ext, ".jpeg") == 0)
+    {
+        return "image/jpeg";
+    }
+
+    if(strcmp(ext, ".png") == 0)
+    {
+        return "image/png";
+    }
+
+    if(strcmp(ext, ".gif") == 0)
+    {
+        return "image/gif";
+    }
+
+    return "application/octet-stream";
+}
+
+#endif    // MIME_H
@@ -0,0 +1,81 @@
+#ifndef PACK_H
+#define PACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define PACK_MAGIC 0x4B504843U    // "CHPK"
+#define PACK_VERSION 1
+#define PACK_ALIGN 4096    // payloads start on a page
+
+// start of an archive, the index follows it, then the strings, then the payloads
+struct pack_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t count;    // index entries
+    uint32_t reserved;
+    uint64_t size;    // whole file, a shorter one is refused
+};
+
+// one encoding of a file
+struct pack_payload
+{
+    uint64_t offset;    // from the start of the archive, PACK_ALIGN aligned
+    uint64_t length;    // a gzip variant is absent when 0
+    uint32_t etag;      // string offset, quoted strong ETag
+    uint32_t reserved;
+};
+
+// index entry, sorted by pack_compare, string offsets point at NUL terminated strings
+struct pack_entry
+{
+    uint64_t            hash;    // pack_hash of the path
+    uint32_t            path;    // request path, e.g. /public/index.html
+    uint32_t            path_len;
+    uint32_t            mime;
+    uint32_t            reserved;
+    struct pack_payload plain;
+    struct pack_payload gzip;    // from a .gz sibling
+};
+
+/**
+ * FNV-1a of a request path, the index key
+ *
+ * @param path Path
+ * @param len  Length
+ *
+ * @return hash
+ */
+static inline uint64_t pack_hash(const char *path, size_t len)
+{
+    uint64_t hash = 14695981039346656037ULL;
+
+    for(size_t i = 0; i < len; i++)
+    {
+        hash = (hash ^ (unsigned char)path[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+/**
+ * Index order, by hash and then by path for the rare collision
+ *
+ * @param hash_a Hash of path_a
+ * @param path_a Path
+ * @param hash_b Hash of path_b
+ * @param path_b Path
+ *
+ * @return <0, 0 or >0 like strcmp
+ */
+static inline int pack_compare(uint64_t hash_a, const char *path_a, uint64_t hash_b, const char *path_b)
+{
+    if(hash_a != hash_b)
+    {
+        return hash_a < hash_b ? -1 : 1;
+    }
+    return strcmp(path_a, path_b);
+}
+
+#endif    // PACK_H
@@ -0,0 +1,19 @@
+#ifndef PATH_H
+#define PATH_H
+
+#include <stddef.h>
+
+/**
+ * Turn a request path into one relative to the docroot, without empty or .
+ * segments and with .. resolved, shared by the core and the handler so both
+ * open the same files
+ *
+ * @param path Request path
+ * @param out  Normalized path, "." for the docroot itself
+ * @param size Size of out
+ *
+ * @return 0 on success, -1 when .. goes above the docroot or out is too small
+ */
+int path_normalize(const char *path, char *out, size_t size);
+
+#endif    // PATH_H
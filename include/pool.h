@@ -0,0 +1,44 @@
+#ifndef POOL_H
+#define POOL_H
+
+/**
+ * Task run by a pool thread
+ *
+ * @param arg Argument given to pool_submit
+ */
+typedef void (*pool_task_fn)(void *arg);
+
+struct pool;
+
+/**
+ * Create a work-stealing thread pool
+ *
+ * Every thread owns a deque. Tasks submitted from a pool thread go to its
+ * own deque and are popped newest first, idle threads steal oldest first
+ * from the others.
+ *
+ * @param thread_count Number of threads to start
+ *
+ * @return pool on success, NULL on failure
+ */
+struct pool *pool_create(int thread_count);
+
+/**
+ * Queue a task
+ *
+ * @param pool Pool
+ * @param fn   Task function
+ * @param arg  Task argument
+ *
+ * @return 0 on success, -1 if every deque is full
+ */
+int pool_submit(struct pool *pool, pool_task_fn fn, void *arg);
+
+/**
+ * Run the remaining tasks, stop the threads and free the pool
+ *
+ * @param pool Pool
+ */
+void pool_destroy(struct pool *pool);
+
+#endif    // POOL_H
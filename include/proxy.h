@@ -0,0 +1,57 @@
+#ifndef PROXY_H
+#define PROXY_H
+
+#include "handler.h"
+#include <stddef.h>
+
+enum proxy_lb
+{
+    PROXY_LB_ROUND_ROBIN,
+    PROXY_LB_LEAST_CONN,
+    PROXY_LB_HASH    // consistent hash on the client address
+};
+
+// entry of PROXY_ROUTES in config.h, the table ends with a NULL prefix
+struct proxy_route_config
+{
+    const char *prefix;
+    int         lb;
+    const char *upstreams;    // comma separated host:port or unix:/path
+};
+
+struct proxy_route;
+
+/**
+ * Resolve the configured upstreams and set up the connection pools
+ *
+ * @return 0 on success, -1 on failure
+ */
+int proxy_init(void);
+
+/**
+ * Proxy route by index, for building the router
+ *
+ * @param index  Route index
+ * @param prefix Output, path prefix of the route
+ *
+ * @return route, NULL past the last one
+ */
+struct proxy_route *proxy_route_get(int index, const char **prefix);
+
+/**
+ * Forward one request to an upstream of the route and stream the response
+ * back, the client socket is left to the caller to close
+ *
+ * @param client_fd Client socket
+ * @param req       Parsed request, the rest of its body is still on the socket
+ * @param route     Route from the router
+ * @param hooks     Phase notifications for the connection deadlines
+ */
+void proxy_serve(int client_fd, const struct http_request *req, struct proxy_route *route, const struct handler_hooks *hooks);
+
+/**
+ * Close pooled upstream connections and free the routes
+ */
+void proxy_cleanup(void);
+
+#endif    // PROXY_H
@@ -0,0 +1,51 @@
+#ifndef ROUTER_H
+#define ROUTER_H
+
+#include "proxy.h"
+
+enum route_type
+{
+    ROUTE_HANDLER,
+    ROUTE_PROXY,
+    ROUTE_SUBSCRIBE
+};
+
+// entry of HANDLER_ROUTES in config.h, the table ends with a NULL method
+struct handler_route_config
+{
+    const char *method;    // "*" for any method
+    const char *prefix;
+    const char *library;
+};
+
+struct route
+{
+    int                 type;
+    const char         *prefix;
+    int                 library;    // ROUTE_HANDLER
+    struct proxy_route *proxy;      // ROUTE_PROXY
+};
+
+/**
+ * Build the radix tree from HANDLER_ROUTES, the proxy routes and SUBSCRIBE_ROUTE
+ *
+ * @return 0 on success, -1 on failure
+ */
+int router_init(void);
+
+/**
+ * Longest prefix match for a request
+ *
+ * @param method Request method
+ * @param path   Request path
+ *
+ * @return route, NULL when nothing matches
+ */
+const struct route *router_match(const char *method, const char *path);
+
+/**
+ * Free the radix tree
+ */
+void router_cleanup(void);
+
+#endif    // ROUTER_H
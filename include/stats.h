@@ -0,0 +1,54 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include "timer.h"
+#include <stdatomic.h>
+#include <stdint.h>
+
+// one per worker in memory shared with the master, survives respawns
+struct worker_stats
+{
+    _Atomic uint64_t accepted;
+    _Atomic uint64_t requests;
+    _Atomic uint64_t rate_limited;
+    _Atomic uint64_t overloaded;
+    _Atomic uint64_t timeouts[TIMER_PHASES];
+    _Atomic uint64_t arena_peak;          // largest request arena footprint in bytes
+    _Atomic int      pid;                 // current process of the worker
+    _Atomic uint64_t ready_us;            // fork until the worker accepts
+    _Atomic uint64_t first_request_us;    // fork until the first request was served
+    _Atomic uint64_t subscribers;         // open subscribe connections
+    _Atomic uint64_t pushed;              // messages written to subscribers
+    _Atomic uint64_t push_dropped;        // messages skipped for subscribers too far behind
+    _Atomic uint64_t file_hits;           // open file cache lookups answered without a syscall
+    _Atomic uint64_t file_misses;
+};
+
+/**
+ * Map the shared stats region, call before forking the workers
+ *
+ * @return 0 on success, -1 on failure
+ */
+int stats_init(void);
+
+/**
+ * Stats slot of a worker
+ *
+ * @param worker_id Worker index
+ *
+ * @return stats of the worker
+ */
+struct worker_stats *stats_worker(int worker_id);
+
+/**
+ * Print the counters of every worker to stdout, with start-up times and the
+ * private and proportional memory of each worker process
+ */
+void stats_print(void);
+
+/**
+ * Unmap the shared stats region
+ */
+void stats_cleanup(void);
+
+#endif    // STATS_H
@@ -0,0 +1,51 @@
+#ifndef SUBSCRIBE_H
+#define SUBSCRIBE_H
+
+#include "http.h"
+
+// SUBSCRIBE_ON_LAG
+enum subscribe_lag_policy
+{
+    SUBSCRIBE_SKIP,    // jump to the newest message, the client is told how many it missed
+    SUBSCRIBE_CLOSE    // close the connection, the client reconnects with Last-Event-ID
+};
+
+struct subscriber;
+
+/**
+ * Answer a subscribe request with a WebSocket upgrade or an event stream,
+ * called on the pool thread serving the connection
+ *
+ * @param client_fd Client socket
+ * @param req       Parsed request
+ * @param res       Writer, used for the head or the error page
+ *
+ * @return subscriber to hand to subscribe_add, NULL when the request was
+ *         refused and answered
+ */
+struct subscriber *subscribe_accept(int client_fd, const struct http_request *req, struct http_response *res);
+
+/**
+ * Give a subscriber to the subscriber thread, which owns and closes its
+ * socket from then on
+ *
+ * @param sub Subscriber from subscribe_accept
+ */
+void subscribe_add(struct subscriber *sub);
+
+/**
+ * Start the subscriber thread of a worker, it sends published messages to
+ * every subscriber of the worker
+ *
+ * @param worker_id Worker index, selects the broadcast eventfd
+ *
+ * @return 0 on success, -1 on failure
+ */
+int subscribe_start(int worker_id);
+
+/**
+ * Stop the subscriber thread and close the subscribers
+ */
+void subscribe_stop(void);
+
+#endif    // SUBSCRIBE_H
@@ -0,0 +1,92 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#define TIMER_LEVELS 4
+#define TIMER_SLOT_BITS 6
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS)
+
+enum timer_phase
+{
+    TIMER_HEADER,    // waiting for the request head
+    TIMER_BODY,      // waiting for the request body
+    TIMER_WRITE,     // client is not draining the response
+    TIMER_PHASES
+};
+
+struct timer
+{
+    struct timer *next;
+    struct timer *prev;
+    uint64_t      expires;    // in ticks
+    int           fd;
+    int           phase;
+};
+
+/**
+ * Called with the wheel locked for every expired timer
+ *
+ * @param t Expired timer, already unlinked
+ */
+typedef void (*timer_expire_fn)(struct timer *t);
+
+struct timer_wheel
+{
+    pthread_mutex_t lock;
+    uint64_t        tick;        // ticks done since start
+    uint64_t        start_ms;    // monotonic ms at tick 0
+    timer_expire_fn expire;
+    struct timer    slots[TIMER_LEVELS][TIMER_SLOTS];    // list heads
+};
+
+/**
+ * Monotonic clock in milliseconds
+ *
+ * @return ms
+ */
+uint64_t timer_now_ms(void);
+
+/**
+ * Initialize an empty wheel
+ *
+ * @param wheel  Wheel
+ * @param expire Expiry callback
+ */
+void timer_wheel_init(struct timer_wheel *wheel, timer_expire_fn expire);
+
+/**
+ * Initialize a timer that is not on any wheel
+ *
+ * @param t  Timer
+ * @param fd Connection the timer guards
+ */
+void timer_init(struct timer *t, int fd);
+
+/**
+ * Arm or re-arm a timer, O(1)
+ *
+ * @param wheel      Wheel
+ * @param t          Timer
+ * @param phase      timer_phase the connection is entering
+ * @param timeout_ms Time from now until the deadline
+ */
+void timer_arm(struct timer_wheel *wheel, struct timer *t, int phase, uint64_t timeout_ms);
+
+/**
+ * Take a timer off the wheel, O(1); no expiry runs for it after this returns
+ *
+ * @param wheel Wheel
+ * @param t     Timer
+ */
+void timer_cancel(struct timer_wheel *wheel, struct timer *t);
+
+/**
+ * Run every tick up to now, cascading the upper levels and expiring timers
+ *
+ * @param wheel Wheel
+ */
+void timer_advance(struct timer_wheel *wheel);
+
+#endif    // TIMER_H
@@ -0,0 +1,162 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+// USDT probes for perf and bpftrace, e.g. bpftrace -e 'usdt:./main:c_http:* { @[probe] = count(); }'
+#if defined(__has_include)
+    #if __has_include(<sys/sdt.h>)
+        #include <sys/sdt.h>
+        #define TRACE_HAVE_SDT 1
+    #endif
+#endif
+
+#ifdef TRACE_HAVE_SDT
+    #define TRACE_PROBE(name, arg) DTRACE_PROBE1(c_http, name, arg)
+#else
+    #define TRACE_PROBE(name, arg) ((void)(arg))
+#endif
+
+// fire the probe and, for a sampled request, timestamp the phase boundary
+#define TRACE_POINT(rec, point, probe, fd)                                                                                                                                                                                                                         \
+    do                                                                                                                                                                                                                                                             \
+    {                                                                                                                                                                                                                                                              \
+        TRACE_PROBE(probe, fd);                                                                                                                                                                                                                                    \
+        trace_mark((rec), (point));                                                                                                                                                                                                                                \
+    } while(0)
+
+#define TRACE_MAGIC 0x52544843U    // "CHTR"
+#define TRACE_VERSION 1
+#define TRACE_METHOD_MAX 8
+#define TRACE_PATH_MAX 64
+
+// phase boundaries in the order a request usually reaches them
+enum trace_point
+{
+    TRACE_ACCEPTED,         // accept4 returned, counted from the select wakeup
+    TRACE_DEQUEUED,         // a pool thread picked the connection up
+    TRACE_HEAD_READ,        // request head parsed
+    TRACE_ROUTED,           // router picked a route
+    TRACE_DISPATCH,         // library pinned or proxy started
+    TRACE_FILE_STAT,        // handler checked the file
+    TRACE_FILE_OPEN,        // handler opened the file
+    TRACE_BODY_DONE,        // last body byte decoded
+    TRACE_DB_OPEN,          // handler opened the database
+    TRACE_DB_STORE,         // handler stored a pair, the last one wins
+    TRACE_RESPONSE_HEAD,    // response head written
+    TRACE_DISPATCHED,       // handler or proxy returned
+    TRACE_CLOSED,           // socket closed
+    TRACE_POINTS
+};
+
+// one sampled request, offsets are microseconds after start plus one, 0 means not reached
+struct trace_record
+{
+    uint64_t start_ns;    // CLOCK_MONOTONIC
+    uint32_t marks[TRACE_POINTS];
+    uint32_t thread;
+    uint16_t status;
+    uint8_t  sampled;
+    char     method[TRACE_METHOD_MAX];
+    char     path[TRACE_PATH_MAX];
+};
+
+// seqlock so a reader never sees a record half written
+struct trace_slot
+{
+    _Atomic uint32_t    seq;    // odd while being written
+    struct trace_record record;
+};
+
+struct trace_ring
+{
+    _Atomic uint64_t  head;    // records written so far
+    struct trace_slot slots[];
+};
+
+// start of the shared file, one ring per worker follows
+struct trace_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t workers;
+    uint32_t ring_size;
+    uint32_t ring_bytes;
+    uint32_t record_size;
+};
+
+/**
+ * Create the shared trace file and map it, call before forking the workers
+ *
+ * @return 0 on success, -1 on failure
+ */
+int trace_init(void);
+
+/**
+ * Start a record, sampled every TRACE_SAMPLE_RATE calls per worker
+ *
+ * @param rec      Record
+ * @param start_ns trace_now_ns of the wakeup that led to the accept
+ */
+void trace_begin(struct trace_record *rec, uint64_t start_ns);
+
+/**
+ * Timestamp a phase boundary, a no-op for requests that are not sampled
+ *
+ * @param rec   Record, may be NULL
+ * @param point trace_point
+ */
+void trace_mark(struct trace_record *rec, int point);
+
+/**
+ * Record the request line of a sampled request
+ *
+ * @param rec    Record
+ * @param method Request method
+ * @param path   Request path
+ */
+void trace_request(struct trace_record *rec, const char *method, const char *path);
+
+/**
+ * Copy a sampled record into the ring of a worker
+ *
+ * @param worker_id Worker index
+ * @param rec       Record
+ */
+void trace_commit(int worker_id, const struct trace_record *rec);
+
+/**
+ * Record the calling thread works on, for code below the worker
+ *
+ * @param rec Record, NULL when done
+ */
+void trace_set_current(struct trace_record *rec);
+
+/**
+ * trace_mark on the record of the calling thread
+ *
+ * @param point trace_point
+ */
+void trace_current(int point);
+
+/**
+ * Response status of the request of the calling thread
+ *
+ * @param status HTTP status code
+ */
+void trace_current_status(int status);
+
+/**
+ * Cheap monotonic clock, vDSO backed
+ *
+ * @return nanoseconds
+ */
+uint64_t trace_now_ns(void);
+
+/**
+ * Unmap the shared trace file, it is kept for trace dump
+ */
+void trace_cleanup(void);
+
+#endif    // TRACE_H
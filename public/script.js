@@ -12,7 +12,7 @@ document.addEventListener("DOMContentLoaded", () => {
                 headers: {
                     "Content-Type": "application/x-www-form-urlencoded",
                 },
-                  body: `${key}=${val}`
+                body: new URLSearchParams({ [key]: val }),
             });
 
             if (response.ok) {
@@ -0,0 +1,328 @@
+#define _GNU_SOURCE    // MSG_FASTOPEN
+
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+// connection rate benchmark, every request is a fresh connection so the
+// accept path is what gets measured
+
+#define BENCH_MAX_THREADS 512
+#define BENCH_REQUEST_MAX 1024
+#define BENCH_READ_SIZE 16384
+
+struct bench_options
+{
+    const char *host;
+    const char *port;
+    const char *path;
+    int         threads;
+    int         seconds;
+    int         fastopen;
+};
+
+struct bench_thread
+{
+    pthread_t        thread;
+    uint64_t         connections;
+    uint64_t         errors;
+    uint64_t         non_2xx;
+    uint64_t        *latencies_us;
+    size_t           latency_count;
+    size_t           latency_cap;
+    struct addrinfo *addr;
+    const char      *request;
+    size_t           request_len;
+    uint64_t         deadline_us;
+    int              fastopen;
+};
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000) + ((uint64_t)ts.tv_nsec / 1000);
+}
+
+static void record_latency(struct bench_thread *bt, uint64_t us)
+{
+    if(bt->latency_count == bt->latency_cap)
+    {
+        size_t    cap   = bt->latency_cap ? bt->latency_cap * 2 : 4096;
+        uint64_t *grown = (uint64_t *)realloc(bt->latencies_us, cap * sizeof(uint64_t));
+        if(!grown)
+        {
+            return;    // keep counting, just stop sampling
+        }
+        bt->latencies_us = grown;
+        bt->latency_cap  = cap;
+    }
+    bt->latencies_us[bt->latency_count++] = us;
+}
+
+// one connection, one request, read until the server closes; returns the status code or -1
+static int bench_once(const struct bench_thread *bt)
+{
+    char    buf[BENCH_READ_SIZE];
+    size_t  have   = 0;
+    int     status = -1;
+    ssize_t n;
+    int     fd = socket(bt->addr->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if(fd < 0)
+    {
+        return -1;
+    }
+
+    if(bt->fastopen)
+    {
+        // the request goes out with the SYN once the server has handed us a cookie
+        n = sendto(fd, bt->request, bt->request_len, MSG_FASTOPEN | MSG_NOSIGNAL, bt->addr->ai_addr, bt->addr->ai_addrlen);
+    }
+    else if(connect(fd, bt->addr->ai_addr, bt->addr->ai_addrlen) == 0)
+    {
+        n = send(fd, bt->request, bt->request_len, MSG_NOSIGNAL);
+    }
+    else
+    {
+        n = -1;
+    }
+    if(n != (ssize_t)bt->request_len)
+    {
+        close(fd);
+        return -1;
+    }
+
+    while((n = read(fd, buf + have, sizeof(buf) - have - 1)) > 0 || (n < 0 && errno == EINTR))
+    {
+        if(n < 0)
+        {
+            continue;
+        }
+        // only the status line matters, keep reusing the tail of the buffer
+        if(status < 0)
+        {
+            have      += (size_t)n;
+            buf[have]  = '\0';
+            if(strchr(buf, '\n'))
+            {
+                status = strncmp(buf, "HTTP/1.", 7) == 0 ? atoi(buf + 9) : 0;
+            }
+            else if(have == sizeof(buf) - 1)
+            {
+                status = 0;
+            }
+        }
+        if(status >= 0)
+        {
+            have = 0;
+        }
+    }
+    close(fd);
+    return n < 0 ? -1 : status;
+}
+
+static void *bench_run(void *arg)
+{
+    struct bench_thread *bt = (struct bench_thread *)arg;
+
+    while(now_us() < bt->deadline_us)
+    {
+        uint64_t start  = now_us();
+        int      status = bench_once(bt);
+
+        if(status < 0)
+        {
+            bt->errors++;
+            continue;
+        }
+        bt->connections++;
+        if(status < 200 || status > 299)
+        {
+            bt->non_2xx++;
+        }
+        record_latency(bt, now_us() - start);
+    }
+    return NULL;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static uint64_t percentile(const uint64_t *sorted, size_t count, double p)
+{
+    size_t index;
+
+    if(count == 0)
+    {
+        return 0;
+    }
+    index = (size_t)(p * (double)(count - 1));
+    return sorted[index];
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-h host] [-p port] [-c connections] [-d seconds] [-u path] [-f]\n", name);
+    fprintf(stderr, "  -c concurrent connection loops (default 64)\n");
+    fprintf(stderr, "  -f send the request with TCP Fast Open\n");
+}
+
+static int parse_options(int argc, char *argv[], struct bench_options *opts)
+{
+    int opt;
+
+    opts->host     = "localhost";
+    opts->port     = "8080";
+    opts->path     = "/public/index.html";
+    opts->threads  = 64;
+    opts->seconds  = 5;
+    opts->fastopen = 0;
+
+    while((opt = getopt(argc, argv, "h:p:c:d:u:f")) != -1)
+    {
+        switch(opt)
+        {
+            case 'h':
+                opts->host = optarg;
+                break;
+            case 'p':
+                opts->port = optarg;
+                break;
+            case 'c':
+                opts->threads = atoi(optarg);
+                break;
+            case 'd':
+                opts->seconds = atoi(optarg);
+                break;
+            case 'u':
+                opts->path = optarg;
+                break;
+            case 'f':
+                opts->fastopen = 1;
+                break;
+            default:
+                return -1;
+        }
+    }
+    if(opts->threads < 1 || opts->threads > BENCH_MAX_THREADS || opts->seconds < 1)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    struct bench_options opts;
+    struct addrinfo      hints;
+    struct addrinfo     *addr;
+    struct bench_thread *threads;
+    char                 request[BENCH_REQUEST_MAX];
+    int                  request_len;
+    uint64_t             start;
+    double               elapsed;
+    uint64_t             connections = 0;
+    uint64_t             errors      = 0;
+    uint64_t             non_2xx     = 0;
+    uint64_t            *all;
+    size_t               all_count = 0;
+    int                  err;
+
+    if(parse_options(argc, argv, &opts) != 0)
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    err               = getaddrinfo(opts.host, opts.port, &hints, &addr);
+    if(err != 0)
+    {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(err));
+        return EXIT_FAILURE;
+    }
+
+    request_len = snprintf(request, sizeof(request), "GET %s HTTP/1.0\r\nHost: %s\r\n\r\n", opts.path, opts.host);
+    threads     = (struct bench_thread *)calloc((size_t)opts.threads, sizeof(struct bench_thread));
+    if(!threads || request_len < 0 || (size_t)request_len >= sizeof(request))
+    {
+        fprintf(stderr, "accept_bench: setup failed\n");
+        freeaddrinfo(addr);
+        free(threads);
+        return EXIT_FAILURE;
+    }
+
+    start = now_us();
+    for(int i = 0; i < opts.threads; i++)
+    {
+        threads[i].addr        = addr;
+        threads[i].request     = request;
+        threads[i].request_len = (size_t)request_len;
+        threads[i].deadline_us = start + ((uint64_t)opts.seconds * 1000000);
+        threads[i].fastopen    = opts.fastopen;
+        if(pthread_create(&threads[i].thread, NULL, bench_run, &threads[i]) != 0)
+        {
+            perror("accept_bench: pthread_create");
+            opts.threads = i;
+            break;
+        }
+    }
+
+    for(int i = 0; i < opts.threads; i++)
+    {
+        pthread_join(threads[i].thread, NULL);
+        connections += threads[i].connections;
+        errors      += threads[i].errors;
+        non_2xx     += threads[i].non_2xx;
+        all_count   += threads[i].latency_count;
+    }
+    elapsed = (double)(now_us() - start) / 1e6;
+
+    all = (uint64_t *)malloc((all_count ? all_count : 1) * sizeof(uint64_t));
+    if(!all)
+    {
+        perror("accept_bench: malloc");
+        all_count = 0;
+    }
+    all_count = 0;
+    for(int i = 0; i < opts.threads; i++)
+    {
+        if(all)
+        {
+            memcpy(all + all_count, threads[i].latencies_us, threads[i].latency_count * sizeof(uint64_t));
+            all_count += threads[i].latency_count;
+        }
+        free(threads[i].latencies_us);
+    }
+    qsort(all, all_count, sizeof(uint64_t), compare_u64);
+
+    printf("%s:%s%s, %d connection loops, %.1f s%s\n", opts.host, opts.port, opts.path, opts.threads, elapsed, opts.fastopen ? ", fast open" : "");
+    printf("connections: %llu (%.0f/s), errors: %llu, non-2xx: %llu\n", (unsigned long long)connections, (double)connections / elapsed, (unsigned long long)errors, (unsigned long long)non_2xx);
+    printf("connect to close (us): p50 %llu, p90 %llu, p99 %llu, p999 %llu, max %llu\n",
+           (unsigned long long)percentile(all, all_count, 0.50),
+           (unsigned long long)percentile(all, all_count, 0.90),
+           (unsigned long long)percentile(all, all_count, 0.99),
+           (unsigned long long)percentile(all, all_count, 0.999),
+           (unsigned long long)(all_count ? all[all_count - 1] : 0));
+
+    free(all);
+    free(threads);
+    freeaddrinfo(addr);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,249 @@
+#include "../include/admission.h"
+#include "../include/config.h"
+#include <netinet/in.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#define MILLI_TOKENS(n) ((uint64_t)(n) * 1000)
+#define STATE(ms, tokens) (((uint64_t)(uint32_t)(ms) << 32) | (uint32_t)(tokens))
+#define STATE_MS(state) ((uint32_t)((state) >> 32))
+#define STATE_TOKENS(state) ((uint32_t)(state))
+#define STRINGIFY_VALUE(x) #x
+#define STRINGIFY(x) STRINGIFY_VALUE(x)
+#define DISCARD_MAX 65536    // MSG_TRUNC drops TCP data without copying it
+
+// token bucket of one client, key 0 is an empty slot
+struct admission_bucket
+{
+    _Atomic uint64_t key;
+    _Atomic uint64_t state;    // last refill ms << 32 | milli-tokens
+};
+
+struct admission_table
+{
+    _Atomic int64_t         in_flight;
+    _Atomic int64_t         held[WORKER_COUNT];    // in_flight by worker, given back when one dies
+    _Atomic uint64_t        queue_delay_us;        // moving average
+    _Atomic uint64_t        queue_sample_ms;       // when it was last fed
+    struct admission_bucket buckets[ADMISSION_TABLE_SIZE];
+};
+
+static struct admission_table *table  = NULL;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static int                     worker = -1;      // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+static const char response429[] = "HTTP/1.0 429 Too Many Requests\r\n"
+                                  "Retry-After: " STRINGIFY(ADMISSION_RETRY_AFTER) "\r\n"
+                                  "Content-Length: 0\r\n"
+                                  "Connection: close\r\n\r\n";
+
+static const char response503[] = "HTTP/1.0 503 Service Unavailable\r\n"
+                                  "Retry-After: " STRINGIFY(ADMISSION_RETRY_AFTER) "\r\n"
+                                  "Content-Length: 0\r\n"
+                                  "Connection: close\r\n\r\n";
+
+int admission_init(void)
+{
+    void *mem = mmap(NULL, sizeof(struct admission_table), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(mem == MAP_FAILED)
+    {
+        perror("admission_init: mmap\n");
+        return -1;
+    }
+    table = (struct admission_table *)mem;    // zero filled by mmap
+    return 0;
+}
+
+uint64_t admission_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ((uint64_t)ts.tv_sec * 1000) + ((uint64_t)ts.tv_nsec / 1000000);
+}
+
+// 64 bit mix so neighbouring addresses spread over the table
+static uint64_t admission_hash(uint64_t key)
+{
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    return key;
+}
+
+// IPv4 keys are the address tagged with bit 32, IPv6 keys a mix of the /64
+// with the top bit set, so the two never meet and no key is 0
+static uint64_t admission_key(const struct sockaddr *addr)
+{
+    if(addr->sa_family == AF_INET)
+    {
+        const struct sockaddr_in *in = (const struct sockaddr_in *)addr;
+        return (1ULL << 32) | in->sin_addr.s_addr;
+    }
+    if(addr->sa_family == AF_INET6)
+    {
+        const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)addr;
+        uint64_t                   prefix;
+        uint32_t                   v4;
+
+        // IPv4 clients of the dual-stack listener share buckets with plain IPv4
+        if(IN6_IS_ADDR_V4MAPPED(&in6->sin6_addr))
+        {
+            memcpy(&v4, &in6->sin6_addr.s6_addr[12], sizeof(v4));
+            return (1ULL << 32) | v4;
+        }
+        // a /64 is what one subscriber usually gets
+        memcpy(&prefix, in6->sin6_addr.s6_addr, sizeof(prefix));
+        return admission_hash(prefix) | (1ULL << 63);
+    }
+    return 0;
+}
+
+static struct admission_bucket *admission_bucket_find(uint64_t key, uint64_t now_ms)
+{
+    uint64_t hash = admission_hash(key);
+
+    for(int probe = 0; probe < ADMISSION_PROBES; probe++)
+    {
+        struct admission_bucket *bucket = &table->buckets[(hash + (uint64_t)probe) % ADMISSION_TABLE_SIZE];
+        uint64_t                 found  = atomic_load_explicit(&bucket->key, memory_order_acquire);
+        uint64_t                 state;
+
+        if(found == key)
+        {
+            return bucket;
+        }
+
+        // claim an empty slot, or one whose client has been quiet long enough to be full again
+        state = atomic_load_explicit(&bucket->state, memory_order_relaxed);
+        if(found == 0 || (uint32_t)now_ms - STATE_MS(state) > ADMISSION_IDLE_MS)
+        {
+            if(atomic_compare_exchange_strong(&bucket->key, &found, key))
+            {
+                atomic_store_explicit(&bucket->state, STATE(now_ms, MILLI_TOKENS(ADMISSION_BURST)), memory_order_release);
+                return bucket;
+            }
+            if(found == key)
+            {
+                return bucket;    // another worker inserted the same client
+            }
+        }
+    }
+    return NULL;
+}
+
+static int admission_take_token(struct admission_bucket *bucket, uint64_t now_ms)
+{
+    uint64_t state = atomic_load_explicit(&bucket->state, memory_order_relaxed);
+
+    while(1)
+    {
+        uint64_t elapsed = (uint32_t)now_ms - STATE_MS(state);
+        uint64_t tokens;
+
+        if(elapsed > UINT32_MAX / 2)
+        {
+            elapsed = 0;    // another worker stored a slightly newer clock
+        }
+        tokens = STATE_TOKENS(state) + (elapsed * ADMISSION_RATE);
+
+        if(tokens > MILLI_TOKENS(ADMISSION_BURST))
+        {
+            tokens = MILLI_TOKENS(ADMISSION_BURST);
+        }
+        if(tokens < MILLI_TOKENS(1))
+        {
+            return -1;
+        }
+        if(atomic_compare_exchange_weak_explicit(&bucket->state, &state, STATE(now_ms, tokens - MILLI_TOKENS(1)), memory_order_relaxed, memory_order_relaxed))
+        {
+            return 0;
+        }
+    }
+}
+
+int admission_check(const struct sockaddr *addr, uint64_t now_ms)
+{
+    uint64_t                 key = admission_key(addr);
+    struct admission_bucket *bucket;
+
+    if(atomic_load_explicit(&table->in_flight, memory_order_relaxed) >= ADMISSION_MAX_IN_FLIGHT)
+    {
+        return ADMISSION_OVERLOADED;
+    }
+
+    // a stale average means nothing was admitted lately, so nothing is queued either
+    if(now_ms - atomic_load_explicit(&table->queue_sample_ms, memory_order_relaxed) < ADMISSION_DELAY_WINDOW_MS && atomic_load_explicit(&table->queue_delay_us, memory_order_relaxed) > ADMISSION_QUEUE_DELAY_MS * 1000)
+    {
+        return ADMISSION_OVERLOADED;
+    }
+
+    // an address the table has no room for is let through
+    bucket = key ? admission_bucket_find(key, now_ms) : NULL;
+    if(bucket && admission_take_token(bucket, now_ms) != 0)
+    {
+        return ADMISSION_RATE_LIMITED;
+    }
+
+    atomic_fetch_add_explicit(&table->in_flight, 1, memory_order_relaxed);
+    if(worker >= 0)
+    {
+        atomic_fetch_add_explicit(&table->held[worker], 1, memory_order_relaxed);
+    }
+    return ADMISSION_ADMIT;
+}
+
+void admission_queue_delay(uint64_t delay_ms, uint64_t now_ms)
+{
+    uint64_t avg = atomic_load_explicit(&table->queue_delay_us, memory_order_relaxed);
+
+    // racy 1/8 moving average, an occasional lost update does not matter here
+    avg = avg - (avg / 8) + (delay_ms * 1000 / 8);
+    atomic_store_explicit(&table->queue_delay_us, avg, memory_order_relaxed);
+    atomic_store_explicit(&table->queue_sample_ms, now_ms, memory_order_relaxed);
+}
+
+void admission_done(void)
+{
+    atomic_fetch_sub_explicit(&table->in_flight, 1, memory_order_relaxed);
+    if(worker >= 0)
+    {
+        atomic_fetch_sub_explicit(&table->held[worker], 1, memory_order_relaxed);
+    }
+}
+
+void admission_set_worker(int worker_id)
+{
+    worker = worker_id;
+}
+
+void admission_worker_exited(int worker_id)
+{
+    // a killed worker never calls admission_done for what it had accepted
+    int64_t held = atomic_exchange_explicit(&table->held[worker_id], 0, memory_order_relaxed);
+
+    atomic_fetch_sub_explicit(&table->in_flight, held, memory_order_relaxed);
+}
+
+void admission_reject(int client_fd, int result)
+{
+    const char *response = result == ADMISSION_RATE_LIMITED ? response429 : response503;
+    size_t      len      = result == ADMISSION_RATE_LIMITED ? sizeof(response429) - 1 : sizeof(response503) - 1;
+
+    // deferred accept means the request is already queued, closing on unread
+    // data would send a reset that destroys the reply, so drop it unread
+    recv(client_fd, NULL, DISCARD_MAX, MSG_DONTWAIT | MSG_TRUNC);
+
+    // one non-blocking send, a client that cannot take it just loses the reply
+    send(client_fd, response, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+void admission_cleanup(void)
+{
+    if(table)
+    {
+        munmap(table, sizeof(struct admission_table));
+        table = NULL;
+    }
+}
@@ -0,0 +1,225 @@
+#include "../include/arena.h"
+#include "../include/config.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define ARENA_ALIGN 16
+#define ALIGN_UP(x) (((x) + (ARENA_ALIGN - 1)) & ~((size_t)ARENA_ALIGN - 1))
+#define SLAB_HEADER ALIGN_UP(sizeof(struct arena_slab))
+
+static struct arena_slab *arena_new_slab(size_t size)
+{
+    struct arena_slab *slab = (struct arena_slab *)malloc(SLAB_HEADER + size);
+    if(!slab)
+    {
+        perror("arena_new_slab: malloc\n");
+        return NULL;
+    }
+    slab->next = NULL;
+    slab->size = size;
+    slab->used = 0;
+    return slab;
+}
+
+static char *slab_data(struct arena_slab *slab)
+{
+    return (char *)slab + SLAB_HEADER;
+}
+
+int arena_init(struct arena *arena, size_t size)
+{
+    arena->first = arena_new_slab(size);
+    if(!arena->first)
+    {
+        return -1;
+    }
+    arena->current     = arena->first;
+    arena->used        = 0;
+    arena->peak        = 0;
+    arena->capacity    = size;
+    arena->slab_allocs = 1;
+    arena->next_free   = NULL;
+    return 0;
+}
+
+void *arena_alloc(struct arena *arena, size_t size)
+{
+    struct arena_slab *slab = arena->current;
+    void              *ptr;
+
+    size = ALIGN_UP(size);
+
+    // move on to a kept slab or grow the chain
+    while(slab->size - slab->used < size)
+    {
+        if(!slab->next)
+        {
+            size_t grow = slab->size * 2;
+            if(grow < size)
+            {
+                grow = size;
+            }
+            slab->next = arena_new_slab(grow);
+            if(!slab->next)
+            {
+                return NULL;
+            }
+            arena->capacity += grow;
+            arena->slab_allocs++;
+        }
+        slab       = slab->next;
+        slab->used = 0;
+    }
+
+    ptr             = slab_data(slab) + slab->used;
+    slab->used     += size;
+    arena->current  = slab;
+    arena->used    += size;
+    if(arena->used > arena->peak)
+    {
+        arena->peak = arena->used;
+    }
+    return ptr;
+}
+
+void arena_reset(struct arena *arena)
+{
+    struct arena_slab *slab = arena->first;
+    size_t             kept = 0;
+
+    // keep slabs while under the retain limit so steady state never mallocs
+    while(slab->next)
+    {
+        kept += slab->size;
+        if(kept + slab->next->size > ARENA_RETAIN_SIZE)
+        {
+            break;
+        }
+        slab = slab->next;
+    }
+
+    while(slab->next)
+    {
+        struct arena_slab *drop = slab->next;
+        slab->next              = drop->next;
+        arena->capacity        -= drop->size;
+        free(drop);
+    }
+
+    arena->first->used = 0;
+    arena->current     = arena->first;
+    arena->used        = 0;
+}
+
+void arena_destroy(struct arena *arena)
+{
+    struct arena_slab *slab = arena->first;
+    while(slab)
+    {
+        struct arena_slab *next = slab->next;
+        free(slab);
+        slab = next;
+    }
+    arena->first    = NULL;
+    arena->current  = NULL;
+    arena->capacity = 0;
+}
+
+void arena_pool_init(struct arena_pool *pool)
+{
+    pthread_mutex_init(&pool->lock, NULL);
+    pool->free       = NULL;
+    pool->free_count = 0;
+    pool->stats      = (struct arena_stats){0, 0, 0, 0};
+}
+
+struct arena *arena_pool_acquire(struct arena_pool *pool)
+{
+    struct arena *arena;
+
+    pthread_mutex_lock(&pool->lock);
+    arena = pool->free;
+    if(arena)
+    {
+        pool->free = arena->next_free;
+        pool->free_count--;
+        pool->stats.capacity -= arena->capacity;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if(arena)
+    {
+        return arena;
+    }
+
+    arena = (struct arena *)malloc(sizeof(struct arena));
+    if(!arena)
+    {
+        perror("arena_pool_acquire: malloc\n");
+        return NULL;
+    }
+    if(arena_init(arena, ARENA_SLAB_SIZE) != 0)
+    {
+        free(arena);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stats.arenas++;
+    pthread_mutex_unlock(&pool->lock);
+    return arena;
+}
+
+void arena_pool_release(struct arena_pool *pool, struct arena *arena)
+{
+    arena_reset(arena);
+
+    pthread_mutex_lock(&pool->lock);
+    if(arena->peak > pool->stats.peak)
+    {
+        pool->stats.peak = arena->peak;
+    }
+    pool->stats.slab_allocs += arena->slab_allocs;
+    arena->slab_allocs       = 0;
+    if(pool->free_count < ARENA_POOL_SIZE)
+    {
+        arena->next_free      = pool->free;
+        pool->free            = arena;
+        pool->stats.capacity += arena->capacity;
+        pool->free_count++;
+        arena = NULL;
+    }
+    else
+    {
+        pool->stats.arenas--;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if(arena)
+    {
+        arena_destroy(arena);
+        free(arena);
+    }
+}
+
+void arena_pool_stats(struct arena_pool *pool, struct arena_stats *stats)
+{
+    pthread_mutex_lock(&pool->lock);
+    *stats = pool->stats;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void arena_pool_destroy(struct arena_pool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    while(pool->free)
+    {
+        struct arena *arena = pool->free;
+        pool->free          = arena->next_free;
+        arena_destroy(arena);
+        free(arena);
+    }
+    pool->free_count = 0;
+    pthread_mutex_unlock(&pool->lock);
+    pthread_mutex_destroy(&pool->lock);
+}
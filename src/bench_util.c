@@ -0,0 +1,130 @@
+#include "../include/bench_util.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+uint64_t bench_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000) + (uint64_t)ts.tv_nsec;
+}
+
+int bench_send_all(int fd, const char *buf, size_t len)
+{
+    while(len > 0)
+    {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+
+        if(n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(n <= 0)
+        {
+            return -1;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+int bench_read_status(int fd)
+{
+    char    buf[BENCH_READ_SIZE];
+    size_t  have   = 0;
+    int     status = -1;
+    ssize_t n;
+
+    while((n = read(fd, buf + have, sizeof(buf) - have - 1)) > 0 || (n < 0 && errno == EINTR))
+    {
+        if(n < 0)
+        {
+            continue;
+        }
+        // only the status line matters, keep reusing the tail of the buffer
+        if(status < 0)
+        {
+            have      += (size_t)n;
+            buf[have]  = '\0';
+            if(strchr(buf, '\n'))
+            {
+                status = strncmp(buf, "HTTP/1.", 7) == 0 ? atoi(buf + 9) : 0;
+            }
+            else if(have == sizeof(buf) - 1)
+            {
+                status = 0;
+            }
+        }
+        if(status >= 0)
+        {
+            have = 0;
+        }
+    }
+    return n < 0 ? -1 : status;
+}
+
+int bench_compare_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+uint32_t bench_percentile(const uint32_t *sorted, size_t count, double p)
+{
+    if(count == 0)
+    {
+        return 0;
+    }
+    return sorted[(size_t)(p * (double)(count - 1))];
+}
+
+double bench_change(uint32_t before, uint32_t after)
+{
+    return before ? 100.0 * ((double)after - (double)before) / (double)before : 0.0;
+}
+
+int bench_resolve(const char *tool, const char *target, struct addrinfo **addr)
+{
+    struct addrinfo hints;
+    char            host[256];
+    const char     *port = strrchr(target, ':');
+    size_t          host_len;
+    int             err;
+
+    if(!port || (size_t)(port - target) >= sizeof(host))
+    {
+        fprintf(stderr, "%s: target %s is not host:port\n", tool, target);
+        return -1;
+    }
+    host_len = (size_t)(port - target);
+    if(target[0] == '[' && host_len > 2 && target[host_len - 1] == ']')
+    {
+        memcpy(host, target + 1, host_len - 2);
+        host[host_len - 2] = '\0';
+    }
+    else
+    {
+        memcpy(host, target, host_len);
+        host[host_len] = '\0';
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    err               = getaddrinfo(host, port + 1, &hints, addr);
+    if(err != 0)
+    {
+        fprintf(stderr, "%s: %s: %s\n", tool, target, gai_strerror(err));
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,157 @@
+#include "../include/broadcast.h"
+#include "../include/config.h"
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// stamp is 2 * seq + 1 while a slot is written and 2 * seq + 2 once it holds message seq
+struct broadcast_slot
+{
+    _Atomic uint64_t stamp;
+    uint32_t         len;
+    char             data[BROADCAST_MESSAGE_MAX];
+};
+
+struct broadcast_ring
+{
+    _Atomic uint64_t      head;                      // next sequence number
+    _Atomic int           notified[WORKER_COUNT];    // eventfd signalled and not yet rearmed
+    struct broadcast_slot slots[BROADCAST_RING_SIZE];
+};
+
+static struct broadcast_ring *ring = NULL;                // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static int                    event_fds[WORKER_COUNT];    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+int broadcast_init(void)
+{
+    void *mem = mmap(NULL, sizeof(struct broadcast_ring), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(mem == MAP_FAILED)
+    {
+        perror("broadcast_init: mmap\n");
+        return -1;
+    }
+    ring = (struct broadcast_ring *)mem;    // zero filled by mmap
+
+    // created here so every worker can signal every other one
+    for(int i = 0; i < WORKER_COUNT; i++)
+    {
+        event_fds[i] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if(event_fds[i] < 0)
+        {
+            perror("broadcast_init: eventfd\n");
+            for(int j = 0; j < i; j++)
+            {
+                close(event_fds[j]);
+            }
+            munmap(ring, sizeof(struct broadcast_ring));
+            ring = NULL;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int broadcast_publish(const void *data, size_t len)
+{
+    struct broadcast_slot *slot;
+    uint64_t               seq;
+
+    if(!ring)
+    {
+        return -1;
+    }
+    if(len > BROADCAST_MESSAGE_MAX)
+    {
+        len = BROADCAST_MESSAGE_MAX;
+    }
+
+    seq  = atomic_fetch_add_explicit(&ring->head, 1, memory_order_relaxed);
+    slot = &ring->slots[seq % BROADCAST_RING_SIZE];
+    atomic_store_explicit(&slot->stamp, (2 * seq) + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    memcpy(slot->data, data, len);
+    slot->len = (uint32_t)len;
+    atomic_store_explicit(&slot->stamp, (2 * seq) + 2, memory_order_release);
+
+    // one wakeup per worker until it drains, however many messages arrive meanwhile
+    for(int i = 0; i < WORKER_COUNT; i++)
+    {
+        if(!atomic_exchange_explicit(&ring->notified[i], 1, memory_order_acq_rel))
+        {
+            broadcast_wake(i);
+        }
+    }
+    return 0;
+}
+
+uint64_t broadcast_head(void)
+{
+    return ring ? atomic_load_explicit(&ring->head, memory_order_acquire) : 0;
+}
+
+int broadcast_read(uint64_t seq, char *buf, size_t *len)
+{
+    const struct broadcast_slot *slot = &ring->slots[seq % BROADCAST_RING_SIZE];
+    uint64_t                     want = (2 * seq) + 2;
+    uint64_t                     stamp;
+
+    stamp = atomic_load_explicit(&slot->stamp, memory_order_acquire);
+    if(stamp < want)
+    {
+        return BROADCAST_PENDING;
+    }
+    if(stamp > want)
+    {
+        return BROADCAST_GONE;
+    }
+    *len = slot->len;
+    memcpy(buf, slot->data, *len);
+
+    // a publisher a whole ring ahead may have started on the slot meanwhile
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&slot->stamp, memory_order_relaxed) == want ? BROADCAST_OK : BROADCAST_GONE;
+}
+
+int broadcast_fd(int worker_id)
+{
+    return ring ? event_fds[worker_id] : -1;
+}
+
+void broadcast_rearm(int worker_id)
+{
+    uint64_t count;
+
+    // drain first, a publish that still sees the flag set has written its slot already
+    if(read(event_fds[worker_id], &count, sizeof(count)) < 0)
+    {
+        // EAGAIN, nothing was signalled
+    }
+    atomic_store_explicit(&ring->notified[worker_id], 0, memory_order_release);
+}
+
+void broadcast_wake(int worker_id)
+{
+    uint64_t one = 1;
+
+    if(write(event_fds[worker_id], &one, sizeof(one)) < 0)
+    {
+        // EAGAIN only when the counter is about to overflow, it is readable anyway
+    }
+}
+
+void broadcast_cleanup(void)
+{
+    if(!ring)
+    {
+        return;
+    }
+    for(int i = 0; i < WORKER_COUNT; i++)
+    {
+        close(event_fds[i]);
+    }
+    munmap(ring, sizeof(struct broadcast_ring));
+    ring = NULL;
+}
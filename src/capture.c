@@ -0,0 +1,172 @@
+#include "../include/capture.h"
+#include "../include/config.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CAPTURE_LENGTH_FIELD_MAX 32                                        // "Content-Length: " plus digits and CRLF
+#define CAPTURE_EVERY (CAPTURE_SAMPLE_RATE > 0 ? CAPTURE_SAMPLE_RATE : 1)    // 0 is caught by capture_init
+
+static int capture_fd = -1;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+static _Thread_local uint32_t sample_count = 0;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+int capture_init(void)
+{
+    struct stat                st;
+    struct capture_file_header header = {CAPTURE_MAGIC, CAPTURE_VERSION};
+
+    if(CAPTURE_SAMPLE_RATE == 0)
+    {
+        return 0;
+    }
+
+    // shared by all workers, O_APPEND keeps each single write of a record whole
+    capture_fd = open(CAPTURE_PATH, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP);
+    if(capture_fd < 0)
+    {
+        perror("capture_init: open\n");
+        return -1;
+    }
+    if(fstat(capture_fd, &st) != 0)
+    {
+        perror("capture_init: fstat\n");
+        capture_cleanup();
+        return -1;
+    }
+    if(st.st_size == 0 && write(capture_fd, &header, sizeof(header)) != (ssize_t)sizeof(header))
+    {
+        perror("capture_init: write\n");
+        capture_cleanup();
+        return -1;
+    }
+    return 0;
+}
+
+void capture_begin(struct capture *cap, struct http_body *body, struct arena *arena)
+{
+    struct timespec ts;
+    char           *tee;
+
+    cap->sampled = capture_fd >= 0 && ++sample_count % CAPTURE_EVERY == 0;
+    if(!cap->sampled)
+    {
+        return;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    cap->time_ns = ((uint64_t)ts.tv_sec * 1000000000) + (uint64_t)ts.tv_nsec;
+    cap->arena   = arena;
+
+    tee = body->done ? NULL : (char *)arena_alloc(arena, CAPTURE_BODY_MAX);
+    if(tee)
+    {
+        http_body_tee(body, tee, CAPTURE_BODY_MAX);
+    }
+}
+
+// framing headers are replaced by a Content-Length matching the captured body
+static int capture_skip_header(const char *name)
+{
+    return strcasecmp(name, "Content-Length") == 0 || strcasecmp(name, "Transfer-Encoding") == 0 || strcasecmp(name, "Expect") == 0 || strcasecmp(name, "Connection") == 0 || strcasecmp(name, "Keep-Alive") == 0;
+}
+
+// request line and headers as they can be sent again
+static char *capture_head(const struct capture *cap, const struct http_request *req, size_t body_len, size_t *head_len)
+{
+    size_t len = strlen(req->method) + strlen(req->target) + strlen(req->protocol) + 4 + CAPTURE_LENGTH_FIELD_MAX + 2;
+    char  *head;
+    char  *out;
+
+    for(int i = 0; i < req->header_count; i++)
+    {
+        len += strlen(req->headers[i].name) + strlen(req->headers[i].value) + 4;
+    }
+
+    head = (char *)arena_alloc(cap->arena, len + 1);
+    if(!head)
+    {
+        return NULL;
+    }
+
+    out = head + sprintf(head, "%s %s %s\r\n", req->method, req->target, req->protocol);
+    for(int i = 0; i < req->header_count; i++)
+    {
+        if(!capture_skip_header(req->headers[i].name))
+        {
+            out += sprintf(out, "%s: %s\r\n", req->headers[i].name, req->headers[i].value);
+        }
+    }
+    if(body_len > 0 || req->chunked || req->content_length >= 0)
+    {
+        out += sprintf(out, "Content-Length: %zu\r\n", body_len);
+    }
+    out += sprintf(out, "\r\n");
+
+    *head_len = (size_t)(out - head);
+    return head;
+}
+
+void capture_commit(const struct capture *cap, const struct http_request *req, const struct http_body *body)
+{
+    struct capture_record record;
+    struct iovec          iov[3];
+    const char           *body_data = body->tee;
+    size_t                body_len  = body->tee_len;
+    int                   complete  = body->done && !body->status && (long long)body->tee_len == body->received;
+    char                 *head;
+    size_t                head_len;
+    ssize_t               written;
+
+    if(!cap->sampled)
+    {
+        return;
+    }
+
+    // nothing went through the reader, the proxy forwards the socket itself
+    if(body->received == 0 && !body->done && !req->chunked && (long long)req->body_len == req->content_length)
+    {
+        body_data = req->body;
+        body_len  = req->body_len < CAPTURE_BODY_MAX ? req->body_len : CAPTURE_BODY_MAX;
+        complete  = body_len == req->body_len;
+    }
+
+    head = capture_head(cap, req, body_len, &head_len);
+    if(!head || head_len + body_len > UINT32_MAX)
+    {
+        return;
+    }
+
+    memset(&record, 0, sizeof(record));
+    record.length   = (uint32_t)(head_len + body_len);
+    record.head_len = (uint32_t)head_len;
+    record.time_ns  = cap->time_ns;
+    record.flags    = complete ? 0 : CAPTURE_TRUNCATED;
+
+    iov[0].iov_base = &record;
+    iov[0].iov_len  = sizeof(record);
+    iov[1].iov_base = head;
+    iov[1].iov_len  = head_len;
+    iov[2].iov_base = (void *)body_data;
+    iov[2].iov_len  = body_len;
+
+    written = writev(capture_fd, iov, body_len > 0 ? 3 : 2);
+    if(written != (ssize_t)(sizeof(record) + head_len + body_len))
+    {
+        perror("capture_commit: writev\n");
+    }
+}
+
+void capture_cleanup(void)
+{
+    if(capture_fd >= 0)
+    {
+        close(capture_fd);
+        capture_fd = -1;
+    }
+}
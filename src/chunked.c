@@ -0,0 +1,144 @@
+#include "../include/chunked.h"
+
+#define CHUNKED_MAX_DIGITS 15
+
+void chunked_init(struct chunked *c)
+{
+    c->state     = CHUNKED_SIZE;
+    c->remaining = 0;
+    c->digits    = 0;
+}
+
+static int hex_value(char ch)
+{
+    if(ch >= '0' && ch <= '9')
+    {
+        return ch - '0';
+    }
+    if(ch >= 'a' && ch <= 'f')
+    {
+        return ch - 'a' + 10;
+    }
+    if(ch >= 'A' && ch <= 'F')
+    {
+        return ch - 'A' + 10;
+    }
+    return -1;
+}
+
+ssize_t chunked_parse(struct chunked *c, const char *buf, size_t len, const char **data, size_t *data_len)
+{
+    size_t i = 0;
+
+    *data_len = 0;
+
+    while(i < len && c->state != CHUNKED_DONE)
+    {
+        char ch = buf[i];
+
+        switch(c->state)
+        {
+            case CHUNKED_SIZE:
+                if(hex_value(ch) >= 0)
+                {
+                    if(++c->digits > CHUNKED_MAX_DIGITS)
+                    {
+                        return -1;
+                    }
+                    c->remaining = (c->remaining << 4) | (size_t)hex_value(ch);
+                }
+                else if(c->digits == 0)
+                {
+                    return -1;
+                }
+                else if(ch == ';' || ch == ' ' || ch == '\t')
+                {
+                    c->state = CHUNKED_EXT;
+                }
+                else if(ch == '\r')
+                {
+                    c->state = CHUNKED_SIZE_LF;
+                }
+                else
+                {
+                    return -1;
+                }
+                i++;
+                break;
+            case CHUNKED_EXT:
+                if(ch == '\r')
+                {
+                    c->state = CHUNKED_SIZE_LF;
+                }
+                i++;
+                break;
+            case CHUNKED_SIZE_LF:
+                if(ch != '\n')
+                {
+                    return -1;
+                }
+                c->digits = 0;
+                c->state  = c->remaining == 0 ? CHUNKED_TRAILER : CHUNKED_DATA;
+                i++;
+                break;
+            case CHUNKED_DATA:
+            {
+                size_t take = len - i < c->remaining ? len - i : c->remaining;
+
+                // hand back one run of payload at a time
+                *data         = buf + i;
+                *data_len     = take;
+                c->remaining -= take;
+                if(c->remaining == 0)
+                {
+                    c->state = CHUNKED_DATA_CR;
+                }
+                return (ssize_t)(i + take);
+            }
+            case CHUNKED_DATA_CR:
+                if(ch != '\r')
+                {
+                    return -1;
+                }
+                c->state = CHUNKED_DATA_LF;
+                i++;
+                break;
+            case CHUNKED_DATA_LF:
+                if(ch != '\n')
+                {
+                    return -1;
+                }
+                c->state = CHUNKED_SIZE;
+                i++;
+                break;
+            case CHUNKED_TRAILER:
+                // an empty line ends the body, anything else is a trailer field
+                c->state = ch == '\r' ? CHUNKED_TRAILER_LF : CHUNKED_TRAILER_LINE;
+                i++;
+                break;
+            case CHUNKED_TRAILER_LINE:
+                if(ch == '\n')
+                {
+                    c->state = CHUNKED_TRAILER;
+                }
+                i++;
+                break;
+            case CHUNKED_TRAILER_LF:
+                if(ch != '\n')
+                {
+                    return -1;
+                }
+                c->state = CHUNKED_DONE;
+                i++;
+                break;
+            default:
+                return -1;
+        }
+    }
+    return (ssize_t)i;
+}
+
+int chunked_done(const struct chunked *c)
+{
+    return c->state == CHUNKED_DONE;
+}
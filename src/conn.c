@@ -0,0 +1,66 @@
+#include "../include/conn.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+int conn_table_init(struct conn_table *table, size_t count)
+{
+    table->conns = (struct conn *)calloc(count, sizeof(struct conn));
+    if(!table->conns)
+    {
+        perror("conn_table_init: calloc\n");
+        return -1;
+    }
+
+    pthread_mutex_init(&table->lock, NULL);
+    table->free   = NULL;
+    table->count  = count;
+    table->in_use = 0;
+    for(size_t i = count; i > 0; i--)
+    {
+        table->conns[i - 1].fd        = -1;
+        table->conns[i - 1].next_free = table->free;
+        table->free                   = &table->conns[i - 1];
+    }
+    return 0;
+}
+
+struct conn *conn_acquire(struct conn_table *table, int fd)
+{
+    struct conn *conn;
+
+    pthread_mutex_lock(&table->lock);
+    conn = table->free;
+    if(conn)
+    {
+        table->free = conn->next_free;
+        table->in_use++;
+    }
+    pthread_mutex_unlock(&table->lock);
+
+    if(conn)
+    {
+        conn->fd        = fd;
+        conn->next_free = NULL;
+        timer_init(&conn->timer, fd);
+    }
+    return conn;
+}
+
+void conn_release(struct conn_table *table, struct conn *conn)
+{
+    conn->fd = -1;
+
+    pthread_mutex_lock(&table->lock);
+    conn->next_free = table->free;
+    table->free     = conn;
+    table->in_use--;
+    pthread_mutex_unlock(&table->lock);
+}
+
+void conn_table_destroy(struct conn_table *table)
+{
+    pthread_mutex_destroy(&table->lock);
+    free(table->conns);
+    table->conns = NULL;
+    table->free  = NULL;
+}
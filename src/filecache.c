@@ -0,0 +1,562 @@
+#define _GNU_SOURCE    // O_PATH
+
+#include "../include/filecache.h"
+#include "../include/config.h"
+#include "../include/mime.h"
+#include "../include/path.h"
+#include "../include/stats.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define FILE_CACHE_PATH_MAX 256    // longer paths are opened every time
+#define FILE_CACHE_BUCKETS ((size_t)FILE_CACHE_ENTRIES * 2)
+#define FILE_CACHE_EVENTS (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+// an open file or a path known to be missing, everything under cache_lock
+struct file_cache_entry
+{
+    char                     path[FILE_CACHE_PATH_MAX];    // normalized, relative to the docroot
+    uint64_t                 hash;
+    int                      fd;       // -1 for a negative entry
+    int                      error;    // ENOENT or EACCES for a negative entry
+    size_t                   size;
+    struct timespec          mtime;
+    const char              *mime;
+    uint64_t                 loaded_ms;
+    int                      refs;      // requests sending from fd
+    int                      cached;    // in the table, otherwise the last release frees it
+    struct file_cache_entry *next;      // bucket chain or free list
+    struct file_cache_entry *newer;
+    struct file_cache_entry *older;
+};
+
+// a directory of cached paths and its inotify watch
+struct file_cache_watch
+{
+    int  wd;                          // -1 for a free slot
+    char dir[FILE_CACHE_PATH_MAX];    // "" for the docroot
+};
+
+static struct file_cache_watch   watches[FILE_CACHE_WATCHES];                      // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static struct file_cache_entry  *entries           = NULL;                         // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static struct file_cache_entry **buckets           = NULL;                         // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static struct file_cache_entry  *free_list         = NULL;                         // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static struct file_cache_entry  *newest            = NULL;                         // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static struct file_cache_entry  *oldest            = NULL;                         // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static uint64_t                  generation        = 0;                            // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static pthread_mutex_t           cache_lock        = PTHREAD_MUTEX_INITIALIZER;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static char                      docroot[PATH_MAX] = HANDLER_DOCROOT;              // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static int                       docroot_fd        = AT_FDCWD;                     // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static int                       inotify_fd        = -1;                           // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static struct worker_stats      *stats             = NULL;                         // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+static uint64_t file_cache_now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000) + ((uint64_t)ts.tv_nsec / 1000000);
+}
+
+static uint64_t file_cache_hash(const char *path)
+{
+    uint64_t hash = 14695981039346656037ULL;
+
+    while(*path)
+    {
+        hash = (hash ^ (unsigned char)*path++) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+static void lru_unlink(struct file_cache_entry *entry)
+{
+    if(entry->newer)
+    {
+        entry->newer->older = entry->older;
+    }
+    else
+    {
+        newest = entry->older;
+    }
+    if(entry->older)
+    {
+        entry->older->newer = entry->newer;
+    }
+    else
+    {
+        oldest = entry->newer;
+    }
+    entry->newer = NULL;
+    entry->older = NULL;
+}
+
+static void lru_push(struct file_cache_entry *entry)
+{
+    entry->older = newest;
+    entry->newer = NULL;
+    if(newest)
+    {
+        newest->newer = entry;
+    }
+    else
+    {
+        oldest = entry;
+    }
+    newest = entry;
+}
+
+static struct file_cache_entry *table_find(const char *key, uint64_t hash)
+{
+    struct file_cache_entry *entry = buckets[hash % FILE_CACHE_BUCKETS];
+
+    while(entry && (entry->hash != hash || strcmp(entry->path, key) != 0))
+    {
+        entry = entry->next;
+    }
+    return entry;
+}
+
+static void entry_free(struct file_cache_entry *entry)
+{
+    if(entry->fd >= 0)
+    {
+        close(entry->fd);
+        entry->fd = -1;
+    }
+    entry->next = free_list;
+    free_list   = entry;
+}
+
+// out of the table, the fd stays open while a request still sends from it
+static void table_remove(struct file_cache_entry *entry)
+{
+    struct file_cache_entry **link = &buckets[entry->hash % FILE_CACHE_BUCKETS];
+
+    while(*link != entry)
+    {
+        link = &(*link)->next;
+    }
+    *link = entry->next;
+    lru_unlink(entry);
+    entry->cached = 0;
+    if(entry->refs == 0)
+    {
+        entry_free(entry);
+    }
+}
+
+static void table_flush(void)
+{
+    while(oldest)
+    {
+        table_remove(oldest);
+    }
+}
+
+// a free entry, evicting the least recently used one that is not being sent
+static struct file_cache_entry *entry_take(void)
+{
+    struct file_cache_entry *entry = oldest;
+
+    while(!free_list && entry)
+    {
+        struct file_cache_entry *next = entry->newer;
+
+        if(entry->refs == 0)
+        {
+            table_remove(entry);
+        }
+        entry = next;
+    }
+    entry = free_list;
+    if(entry)
+    {
+        free_list = entry->next;
+    }
+    return entry;
+}
+
+// watches the directory of key so a change there drops its entries at once
+static void watch_parent(const char *key)
+{
+    const char *slash     = strrchr(key, '/');
+    size_t      len       = slash ? (size_t)(slash - key) : 0;
+    int         free_slot = -1;
+    char        full[PATH_MAX];
+    int         wd;
+
+    if(inotify_fd < 0)
+    {
+        return;
+    }
+    for(int i = 0; i < FILE_CACHE_WATCHES; i++)
+    {
+        if(watches[i].wd >= 0 && strncmp(watches[i].dir, key, len) == 0 && watches[i].dir[len] == '\0')
+        {
+            return;
+        }
+        if(watches[i].wd < 0 && free_slot < 0)
+        {
+            free_slot = i;
+        }
+    }
+    if(free_slot < 0)
+    {
+        return;
+    }
+
+    // a missing directory cannot be watched, its negative entries only expire
+    if(snprintf(full, sizeof(full), "%s/%.*s", docroot, (int)len, key) >= (int)sizeof(full))
+    {
+        return;
+    }
+    wd = inotify_add_watch(inotify_fd, full, FILE_CACHE_EVENTS);
+    if(wd < 0)
+    {
+        return;
+    }
+    // the same directory under another name reports under the first one
+    for(int i = 0; i < FILE_CACHE_WATCHES; i++)
+    {
+        if(watches[i].wd == wd)
+        {
+            return;
+        }
+    }
+    watches[free_slot].wd = wd;
+    memcpy(watches[free_slot].dir, key, len);
+    watches[free_slot].dir[len] = '\0';
+}
+
+// opens key outside the lock, error 0 with fd or ENOENT, EACCES, EIO
+static void entry_load(const char *key, struct file_cache_entry *loaded)
+{
+    struct stat st;
+
+    memset(loaded, 0, sizeof(*loaded));
+    loaded->fd = openat(docroot_fd, key, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if(loaded->fd < 0)
+    {
+        if(errno == EACCES || errno == EPERM)
+        {
+            loaded->error = EACCES;
+        }
+        else if(errno == ENOENT || errno == ENOTDIR || errno == ENAMETOOLONG || errno == ELOOP)
+        {
+            loaded->error = ENOENT;
+        }
+        else
+        {
+            loaded->error = EIO;    // out of descriptors or similar, not remembered
+        }
+        return;
+    }
+    if(fstat(loaded->fd, &st) != 0)
+    {
+        loaded->error = EIO;
+    }
+    // directories and devices are not served
+    else if(!S_ISREG(st.st_mode) || !(st.st_mode & S_IRUSR))
+    {
+        loaded->error = EACCES;
+    }
+    if(loaded->error)
+    {
+        close(loaded->fd);
+        loaded->fd = -1;
+        return;
+    }
+    loaded->size  = (size_t)st.st_size;
+    loaded->mtime = st.st_mtim;
+    loaded->mime  = mime_type(key);
+}
+
+// called under cache_lock
+static int entry_hand_out(struct file_cache_entry *entry, struct handler_file *file)
+{
+    if(entry->error)
+    {
+        return entry->error;
+    }
+    entry->refs++;
+    file->fd    = entry->fd;
+    file->size  = entry->size;
+    file->mtime = entry->mtime;
+    file->mime  = entry->mime;
+    file->ref   = entry;
+    return 0;
+}
+
+static void count(int hit)
+{
+    if(stats)
+    {
+        atomic_fetch_add_explicit(hit ? &stats->file_hits : &stats->file_misses, 1, memory_order_relaxed);
+    }
+}
+
+int file_cache_init(int worker_id)
+{
+    char resolved[PATH_MAX];
+
+    stats = stats_worker(worker_id);
+    for(int i = 0; i < FILE_CACHE_WATCHES; i++)
+    {
+        watches[i].wd = -1;
+    }
+    if(!realpath(HANDLER_DOCROOT, resolved))
+    {
+        perror("file_cache_init: realpath");
+        return -1;
+    }
+    docroot_fd = open(resolved, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if(docroot_fd < 0)
+    {
+        perror("file_cache_init: open");
+        docroot_fd = AT_FDCWD;
+        return -1;
+    }
+    snprintf(docroot, sizeof(docroot), "%s", resolved);
+
+    if(FILE_CACHE_BUCKETS == 0)
+    {
+        return -1;
+    }
+    entries = (struct file_cache_entry *)calloc(FILE_CACHE_ENTRIES, sizeof(struct file_cache_entry));
+    buckets = (struct file_cache_entry **)calloc(FILE_CACHE_BUCKETS, sizeof(struct file_cache_entry *));
+    if(!entries || !buckets)
+    {
+        perror("file_cache_init: calloc");
+        free(entries);
+        free(buckets);
+        entries = NULL;
+        buckets = NULL;
+        return -1;
+    }
+    for(size_t i = 0; i < FILE_CACHE_ENTRIES; i++)
+    {
+        entries[i].fd = -1;
+        entry_free(&entries[i]);
+    }
+
+    // without inotify the entries still expire after FILE_CACHE_TTL_MS
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(inotify_fd < 0)
+    {
+        perror("file_cache_init: inotify_init1");
+    }
+    return 0;
+}
+
+int file_cache_open(const char *path, struct handler_file *file)
+{
+    struct file_cache_entry  loaded;
+    struct file_cache_entry *entry;
+    char                     key[PATH_MAX];
+    uint64_t                 hash      = 0;
+    uint64_t                 now       = 0;
+    uint64_t                 seen      = 0;
+    int                      cacheable = 0;
+    int                      result;
+
+    memset(file, 0, sizeof(*file));
+    file->fd = -1;
+    if(path_normalize(path, key, sizeof(key)) != 0)
+    {
+        return ENOENT;
+    }
+
+    if(entries && strlen(key) < FILE_CACHE_PATH_MAX)
+    {
+        hash = file_cache_hash(key);
+        now  = file_cache_now_ms();
+        pthread_mutex_lock(&cache_lock);
+        entry = table_find(key, hash);
+        if(entry && now - entry->loaded_ms < FILE_CACHE_TTL_MS)
+        {
+            lru_unlink(entry);
+            lru_push(entry);
+            result = entry_hand_out(entry, file);
+            pthread_mutex_unlock(&cache_lock);
+            count(1);
+            return result;
+        }
+        if(entry)
+        {
+            table_remove(entry);
+        }
+        // watched before the open, an event from here on either bumps the generation or drops the entry
+        watch_parent(key);
+        seen      = generation;
+        cacheable = 1;
+        pthread_mutex_unlock(&cache_lock);
+    }
+    count(0);
+
+    entry_load(key, &loaded);
+    if(cacheable && loaded.error != EIO)
+    {
+        pthread_mutex_lock(&cache_lock);
+        if(generation == seen && !table_find(key, hash) && (entry = entry_take()) != NULL)
+        {
+            memcpy(entry->path, key, strlen(key) + 1);
+            entry->hash      = hash;
+            entry->fd        = loaded.fd;
+            entry->error     = loaded.error;
+            entry->size      = loaded.size;
+            entry->mtime     = loaded.mtime;
+            entry->mime      = loaded.mime;
+            entry->loaded_ms = now;
+            entry->refs      = 0;
+            entry->cached    = 1;
+            entry->next      = buckets[hash % FILE_CACHE_BUCKETS];
+            lru_push(entry);
+            buckets[hash % FILE_CACHE_BUCKETS] = entry;
+            result = entry_hand_out(entry, file);
+            pthread_mutex_unlock(&cache_lock);
+            return result;
+        }
+        pthread_mutex_unlock(&cache_lock);
+    }
+
+    // not cached, the caller owns the fd
+    if(loaded.error)
+    {
+        return loaded.error;
+    }
+    file->fd    = loaded.fd;
+    file->size  = loaded.size;
+    file->mtime = loaded.mtime;
+    file->mime  = loaded.mime;
+    return 0;
+}
+
+void file_cache_release(struct handler_file *file)
+{
+    struct file_cache_entry *entry = (struct file_cache_entry *)file->ref;
+
+    if(!entry)
+    {
+        if(file->fd >= 0)
+        {
+            close(file->fd);
+        }
+    }
+    else
+    {
+        pthread_mutex_lock(&cache_lock);
+        if(--entry->refs == 0 && !entry->cached)
+        {
+            entry_free(entry);
+        }
+        pthread_mutex_unlock(&cache_lock);
+    }
+    file->fd  = -1;
+    file->ref = NULL;
+}
+
+int file_cache_fd(void)
+{
+    return inotify_fd;
+}
+
+// called under cache_lock
+static void file_cache_event(const struct inotify_event *event)
+{
+    struct file_cache_watch *watch = NULL;
+    char                     key[FILE_CACHE_PATH_MAX * 2];
+    struct file_cache_entry *entry;
+
+    if(event->mask & IN_Q_OVERFLOW)
+    {
+        table_flush();
+        return;
+    }
+    for(int i = 0; i < FILE_CACHE_WATCHES && !watch; i++)
+    {
+        if(watches[i].wd == event->wd)
+        {
+            watch = &watches[i];
+        }
+    }
+    if(!watch)
+    {
+        return;
+    }
+    if(event->mask & IN_IGNORED)
+    {
+        watch->wd = -1;
+    }
+
+    // a directory that changes moves every path below it
+    if(event->mask & (IN_ISDIR | IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF))
+    {
+        table_flush();
+        return;
+    }
+    if(event->len == 0)
+    {
+        return;
+    }
+    snprintf(key, sizeof(key), "%s%s%s", watch->dir, watch->dir[0] ? "/" : "", event->name);
+    entry = table_find(key, file_cache_hash(key));
+    if(entry)
+    {
+        table_remove(entry);
+    }
+}
+
+void file_cache_poll(void)
+{
+    char    buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+
+    while((len = read(inotify_fd, buf, sizeof(buf))) > 0)
+    {
+        pthread_mutex_lock(&cache_lock);
+        for(ssize_t at = 0; at < len;)
+        {
+            const struct inotify_event *event = (const struct inotify_event *)(buf + at);
+
+            file_cache_event(event);
+            at += (ssize_t)(sizeof(struct inotify_event) + event->len);
+        }
+        generation++;
+        pthread_mutex_unlock(&cache_lock);
+    }
+}
+
+void file_cache_cleanup(void)
+{
+    pthread_mutex_lock(&cache_lock);
+    if(entries)
+    {
+        table_flush();
+    }
+    pthread_mutex_unlock(&cache_lock);
+    free(entries);
+    free(buckets);
+    entries = NULL;
+    buckets = NULL;
+    if(inotify_fd >= 0)
+    {
+        close(inotify_fd);
+        inotify_fd = -1;
+    }
+    if(docroot_fd != AT_FDCWD)
+    {
+        close(docroot_fd);
+        docroot_fd = AT_FDCWD;
+    }
+}
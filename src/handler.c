@@ -1,418 +1,1401 @@
+#define _GNU_SOURCE    // O_PATH
+
 #include "../include/handler.h"
+#include "../include/arena.h"
+#include "../include/config.h"
+#include "../include/mime.h"
+#include "../include/pack.h"
+#include "../include/path.h"
+#include "../include/trace.h"
 #include <arpa/inet.h>
+#include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
 #include <ndbm.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 
-#define BUFFER_SIZE 1024
-#define FMT_BUFFER 50
+#define POST_CHUNK 4096
+#define POST_PAIR_MAX 1024
+#define POST_BATCH_MAX 1048576    // whole POST body, parsed before anything is stored
 #define HANDLER_VERSION "5.3.4"
+#define PRELOAD_SLOTS (HANDLER_PRELOAD_FILES * 2)    // open addressing, at most half full
+#define PRELOAD_ALIGN 64
+#define PRELOAD_PATH_MAX 256
 
-void init_handler(void)
+const int handler_abi_version = HANDLER_ABI_VERSION;
+
+// a file read into memory when the handler is loaded, served while the file on disk is unchanged
+struct preload_entry
 {
-    printf("Initialized Handler version: %s\n", HANDLER_VERSION);
+    const char     *path;    // request path, NULL for an empty slot
+    const char     *mime;
+    const char     *data;
+    size_t          len;
+    struct timespec mtime;
+};
+
+// a mapped archive from the pack tool, replaced whole when a new one is renamed over HANDLER_ARCHIVE
+struct archive
+{
+    int                      fd;    // payloads are sent from here
+    const unsigned char     *base;
+    size_t                   size;
+    const struct pack_entry *index;
+    uint32_t                 count;
+    dev_t                    dev;
+    ino_t                    ino;
+    int                      refs;    // under archive_lock, the current archive holds one
+};
+
+static struct handler_hooks hooks;                           // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static int                  docroot_fd = AT_FDCWD;           // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static struct preload_entry preload_table[PRELOAD_SLOTS];    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static unsigned char       *preload_region     = NULL;       // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static size_t               preload_region_len = 0;          // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+static struct archive  *archive            = NULL;                         // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static pthread_mutex_t  archive_lock       = PTHREAD_MUTEX_INITIALIZER;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static _Atomic uint64_t archive_checked_ms = 0;                            // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+void handler_set_hooks(const struct handler_hooks *worker_hooks)
+{
+    hooks = *worker_hooks;
+}
+
+// phase boundary for request tracing, the worker timestamps it and fires its point probe
+static void trace_point(int point)
+{
+    if(hooks.trace)
+    {
+        hooks.trace(point);
+    }
+}
+
+static void construct_response(struct http_response *res, const char *status, const char *body, const char *mime, size_t body_len)
+{
+    res->ops->send(res, status, mime, body, body_len);
 }
 
-static void construct_response(int clientfd, const char *status, const char *body, const char *mime, size_t body_len)
+static uint32_t preload_hash(const char *path)
 {
-    char response[BUFFER_SIZE];
+    uint32_t hash = 2166136261U;    // FNV-1a
 
-    snprintf(response,
-             sizeof(response),
-             "HTTP/1.0 %s\r\n"
-             "Content-Type: %s\r\n"
-             "Content-Length: %zu\r\n\r\n",
-             status,
-             mime,
-             body_len);
+    for(; *path; path++)
+    {
+        hash = (hash ^ (unsigned char)*path) * 16777619U;
+    }
+    return hash;
+}
 
-    printf("%s", response);
-    write(clientfd, response, strlen(response));
+// slot holding path, or the empty slot where it would go
+static struct preload_entry *preload_slot(const char *path)
+{
+    uint32_t slot = preload_hash(path) % PRELOAD_SLOTS;
 
-    if(body != NULL)
+    while(preload_table[slot].path && strcmp(preload_table[slot].path, path) != 0)
     {
-        write(clientfd, body, body_len);
+        slot = (slot + 1) % PRELOAD_SLOTS;
     }
+    return &preload_table[slot];
+}
+
+static size_t preload_align(size_t len)
+{
+    return (len + PRELOAD_ALIGN - 1) / PRELOAD_ALIGN * PRELOAD_ALIGN;
 }
 
-static void trim_protocol(char *protocol)
+static int read_whole(int fd, char *buf, size_t len)
 {
-    for(int i = 0; protocol[i] != '\0'; i++)
+    size_t have = 0;
+
+    while(have < len)
     {
-        if(protocol[i] == '\r' || protocol[i] == '\n')
+        ssize_t n = pread(fd, buf + have, len - have, (off_t)have);
+        if(n <= 0)
         {
-            protocol[i] = '\0';
-            break;
+            return -1;
         }
+        have += (size_t)n;
     }
+    return 0;
 }
 
-static void parse_request(struct req_info *info, char *buffer)
+// paths and sizes of the files worth preloading, within the budget
+static int preload_scan(DIR *dir, struct preload_entry *files, size_t *total)
 {
-    char *save;
+    const struct dirent *dirent;
+    int                  count = 0;
 
-    info->method   = strtok_r(buffer, " ", &save);
-    info->path     = strtok_r(NULL, " ", &save);
-    info->protocol = strtok_r(NULL, " ", &save);
-    if(info->protocol)
+    *total = 0;
+    while(count < HANDLER_PRELOAD_FILES && (dirent = readdir(dir)) != NULL)
     {
-        trim_protocol(info->protocol);
-    }
+        char        path[PRELOAD_PATH_MAX];
+        struct stat st;
+        size_t      need;
+        int         path_len = snprintf(path, sizeof(path), "/%s/%s", HANDLER_PRELOAD_DIR, dirent->d_name);
 
-    printf("PARSED METHOD: %s\n", info->method);
-    printf("PARSED PATH: %s\n", info->path);
-    printf("PARSED PROTOCOL: %s\n", info->protocol);
+        if(path_len >= (int)sizeof(path) || fstatat(dirfd(dir), dirent->d_name, &st, 0) != 0 || !S_ISREG(st.st_mode) || !(st.st_mode & S_IRUSR) || st.st_size == 0 || st.st_size > HANDLER_PRELOAD_FILE_MAX)
+        {
+            continue;
+        }
+        need = preload_align((size_t)path_len + 1) + preload_align((size_t)st.st_size);
+        if(*total + need > HANDLER_PRELOAD_MAX)
+        {
+            continue;
+        }
+
+        files[count].path  = strdup(path);
+        files[count].len   = (size_t)st.st_size;
+        files[count].mtime = st.st_mtim;
+        if(!files[count].path)
+        {
+            break;
+        }
+        *total += need;
+        count++;
+    }
+    return count;
 }
 
-static const char *get_mime_type(const char *file_path)
+// small files of HANDLER_PRELOAD_DIR in one region, read-only so forked
+// workers never copy it, locked and on huge pages where the kernel allows
+static void preload_files(void)
 {
-    const char *ext = strrchr(file_path, '.');
-    if(ext == NULL)
+    struct preload_entry *files;
+    DIR                  *dir;
+    size_t                total;
+    size_t                used   = 0;
+    int                   loaded = 0;
+    int                   count;
+    int                   dir_fd = openat(docroot_fd, HANDLER_PRELOAD_DIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if(HANDLER_PRELOAD_MAX == 0 || dir_fd < 0)
     {
-        return "application/octet-stream";
+        return;
     }
-
-    if(strcmp(ext, ".html") == 0)
+    dir   = fdopendir(dir_fd);
+    files = (struct preload_entry *)calloc(HANDLER_PRELOAD_FILES, sizeof(struct preload_entry));
+    if(!dir || !files)
     {
-        return "text/html";
+        perror("preload_files");
+        free(files);
+        if(dir)
+        {
+            closedir(dir);
+        }
+        else
+        {
+            close(dir_fd);
+        }
+        return;
     }
 
-    if(strcmp(ext, ".css") == 0)
+    count = preload_scan(dir, files, &total);
+    if(count > 0)
     {
-        return "text/css";
+        preload_region = (unsigned char *)mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(preload_region == MAP_FAILED)
+        {
+            perror("preload_files: mmap");
+            preload_region = NULL;
+        }
     }
 
-    if(strcmp(ext, ".js") == 0)
+    if(preload_region)
     {
-        return "application/javascript";
+        preload_region_len = total;
+        madvise(preload_region, total, MADV_HUGEPAGE);    // before the first touch, or it is too late
+
+        for(int i = 0; i < count; i++)
+        {
+            size_t                path_len = strlen(files[i].path) + 1;
+            char                 *path     = (char *)preload_region + used;
+            char                 *data     = path + preload_align(path_len);
+            int                   fd       = openat(dirfd(dir), files[i].path + strlen(HANDLER_PRELOAD_DIR) + 2, O_RDONLY | O_CLOEXEC);
+            struct preload_entry *entry;
+
+            used += preload_align(path_len) + preload_align(files[i].len);
+            if(fd < 0 || read_whole(fd, data, files[i].len) != 0)
+            {
+                if(fd >= 0)
+                {
+                    close(fd);
+                }
+                continue;
+            }
+            close(fd);
+
+            memcpy(path, files[i].path, path_len);
+            entry        = preload_slot(path);
+            entry->path  = path;
+            entry->mime  = mime_type(path);
+            entry->data  = data;
+            entry->len   = files[i].len;
+            entry->mtime = files[i].mtime;
+            loaded++;
+        }
+
+        mprotect(preload_region, total, PROT_READ);
+        // locks are not inherited, but the master holding them keeps the shared pages resident
+        if(mlock(preload_region, total) != 0)
+        {
+            perror("preload_files: mlock");
+        }
+        printf("Handler preloaded %d files, %zu bytes\n", loaded, total);
     }
 
-    if(strcmp(ext, ".jpg") == 0 || strcmp(ext, ".jpeg") == 0)
+    for(int i = 0; i < count; i++)
     {
-        return "image/jpeg";
+        free((void *)files[i].path);
     }
+    free(files);
+    closedir(dir);
+}
+
+// resolved once, every request path is looked up relative to it
+static void open_docroot(void)
+{
+    char resolved[PATH_MAX];
 
-    if(strcmp(ext, ".png") == 0)
+    if(!realpath(HANDLER_DOCROOT, resolved))
     {
-        return "image/png";
+        perror("open_docroot: realpath");
+        return;
     }
-
-    if(strcmp(ext, ".gif") == 0)
+    docroot_fd = open(resolved, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if(docroot_fd < 0)
     {
-        return "image/gif";
+        perror("open_docroot: open");
+        docroot_fd = AT_FDCWD;
+        return;
     }
+    printf("Handler docroot: %s\n", resolved);
+}
+
+static uint64_t archive_now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000) + ((uint64_t)ts.tv_nsec / 1000000);
+}
+
+static const char *archive_string(const struct archive *ar, uint32_t offset)
+{
+    return (const char *)ar->base + offset;
+}
 
-    return "application/octet-stream";
+static int archive_string_valid(const struct archive *ar, uint32_t offset)
+{
+    return offset < ar->size && memchr(ar->base + offset, '\0', ar->size - offset) != NULL;
 }
 
-static int file_readable(const char *file_path)
+static int archive_payload_valid(const struct archive *ar, const struct pack_payload *payload)
 {
-    struct stat file_stat;
+    return payload->offset <= ar->size && payload->length <= ar->size - payload->offset && archive_string_valid(ar, payload->etag);
+}
 
-    if(stat(file_path, &file_stat) == 0 && (file_stat.st_mode & S_IRUSR))
+// everything a lookup follows stays inside the mapping, whatever the file holds
+static int archive_valid(const struct archive *ar)
+{
+    for(uint32_t i = 0; i < ar->count; i++)
     {
-        return 0;
+        const struct pack_entry *entry = &ar->index[i];
+
+        if(!archive_string_valid(ar, entry->path) || strlen(archive_string(ar, entry->path)) != entry->path_len || !archive_string_valid(ar, entry->mime) || !archive_payload_valid(ar, &entry->plain) || (entry->gzip.length > 0 && !archive_payload_valid(ar, &entry->gzip)))
+        {
+            return 0;
+        }
     }
+    return 1;
+}
 
-    return -1;
+static void archive_free(struct archive *ar)
+{
+    munmap((void *)ar->base, ar->size);
+    close(ar->fd);
+    free(ar);
 }
 
-static int file_exists(const char *file_path)
+static struct archive *archive_open(void)
 {
-    struct stat file_stat;
+    const char               *path = HANDLER_ARCHIVE;
+    const struct pack_header *header;
+    struct archive           *ar;
+    struct stat               st;
+    void                     *base;
+    int                       fd = openat(docroot_fd, path, O_RDONLY | O_CLOEXEC);
 
-    if(stat(file_path, &file_stat) == 0)
+    if(fd < 0)
     {
-        return 0;
+        return NULL;
+    }
+    if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct pack_header))
+    {
+        close(fd);
+        return NULL;
+    }
+    base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ar   = (struct archive *)calloc(1, sizeof(struct archive));
+    if(base == MAP_FAILED || !ar)
+    {
+        perror("archive_open");
+        if(base != MAP_FAILED)
+        {
+            munmap(base, (size_t)st.st_size);
+        }
+        free(ar);
+        close(fd);
+        return NULL;
     }
 
-    return -1;
+    header    = (const struct pack_header *)base;
+    ar->fd    = fd;
+    ar->base  = (const unsigned char *)base;
+    ar->size  = (size_t)st.st_size;
+    ar->index = (const struct pack_entry *)(ar->base + sizeof(struct pack_header));
+    ar->count = header->count;
+    ar->dev   = st.st_dev;
+    ar->ino   = st.st_ino;
+    ar->refs  = 1;
+    if(header->magic != PACK_MAGIC || header->version != PACK_VERSION || header->size != ar->size || header->count > (ar->size - sizeof(struct pack_header)) / sizeof(struct pack_entry) || !archive_valid(ar))
+    {
+        fprintf(stderr, "Handler: %s is not a valid archive\n", path);
+        archive_free(ar);
+        return NULL;
+    }
+    return ar;
 }
 
-static int file_verification(char *file_path)
+// one stat per interval, a deploy renames a new archive over the old one
+static void archive_check(void)
 {
-    int  retval;
-    int  a;
-    int  b;
-    char file_path_formatted[FMT_BUFFER];
+    const char     *path    = HANDLER_ARCHIVE;
+    uint64_t        now     = archive_now_ms();
+    uint64_t        checked = atomic_load_explicit(&archive_checked_ms, memory_order_relaxed);
+    struct archive *fresh;
+    struct archive *old;
+    struct stat     st;
+    int             same;
+
+    if(!path || now - checked < HANDLER_ARCHIVE_CHECK_MS || !atomic_compare_exchange_strong(&archive_checked_ms, &checked, now))
+    {
+        return;
+    }
+    // gone or unreadable, keep serving the one already mapped
+    if(fstatat(docroot_fd, path, &st, 0) != 0)
+    {
+        return;
+    }
+    pthread_mutex_lock(&archive_lock);
+    same = archive && archive->dev == st.st_dev && archive->ino == st.st_ino;
+    pthread_mutex_unlock(&archive_lock);
+    if(same)
+    {
+        return;
+    }
 
-    snprintf(file_path_formatted, FMT_BUFFER, ".%s", file_path);
+    fresh = archive_open();
+    if(!fresh)
+    {
+        return;
+    }
+    printf("Handler serving %s, %u files\n", path, fresh->count);
+
+    // requests still sending from the old archive keep it until they release it
+    pthread_mutex_lock(&archive_lock);
+    old     = archive;
+    archive = fresh;
+    same    = old && --old->refs == 0;
+    pthread_mutex_unlock(&archive_lock);
+    if(same)
+    {
+        archive_free(old);
+    }
+}
 
-    a      = file_readable(file_path_formatted);
-    b      = file_exists(file_path_formatted);
-    retval = 0;
+static struct archive *archive_acquire(void)
+{
+    struct archive *ar;
 
-    // 404 case
-    if(b != 0)
+    archive_check();
+    pthread_mutex_lock(&archive_lock);
+    ar = archive;
+    if(ar)
     {
-        retval = -1;
-        return retval;
+        ar->refs++;
     }
+    pthread_mutex_unlock(&archive_lock);
+    return ar;
+}
+
+static void archive_release(struct archive *ar)
+{
+    int last;
+
+    pthread_mutex_lock(&archive_lock);
+    last = --ar->refs == 0;
+    pthread_mutex_unlock(&archive_lock);
+    if(last)
+    {
+        archive_free(ar);
+    }
+}
+
+// binary search of the sorted index, only the mapping is read
+static const struct pack_entry *archive_find(const struct archive *ar, const char *path)
+{
+    uint64_t hash = pack_hash(path, strlen(path));
+    uint32_t low  = 0;
+    uint32_t high = ar->count;
 
-    // 403 case
-    if(a != 0)
+    while(low < high)
     {
-        retval = -2;
-        return retval;
+        uint32_t mid = low + ((high - low) / 2);
+        int      cmp = pack_compare(ar->index[mid].hash, archive_string(ar, ar->index[mid].path), hash, path);
+
+        if(cmp == 0)
+        {
+            return &ar->index[mid];
+        }
+        if(cmp < 0)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
     }
+    return NULL;
+}
+
+// runs where the library is loaded, in the master before the workers fork
+void init_handler(void)
+{
+    const char *archive_path = HANDLER_ARCHIVE;
+
+    printf("Initialized Handler version: %s\n", HANDLER_VERSION);
+    open_docroot();
 
-    return retval;
+    // with an archive the docroot files are never read, nothing to preload
+    if(archive_path)
+    {
+        archive = archive_open();
+        atomic_store(&archive_checked_ms, archive_now_ms());
+        if(archive)
+        {
+            printf("Handler serving %s, %u files\n", archive_path, archive->count);
+        }
+    }
+    if(!archive)
+    {
+        preload_files();
+    }
 }
 
-static int open_requested_file(char *path)    // removed fd pointer -> now return fd
+// on dlclose when the library is replaced
+__attribute__((destructor)) static void fini_handler(void)
 {
-    int  fd;
-    char file_path_formatted[FMT_BUFFER];
+    if(preload_region)
+    {
+        munmap(preload_region, preload_region_len);
+        preload_region     = NULL;
+        preload_region_len = 0;
+    }
+    memset(preload_table, 0, sizeof(preload_table));
+    if(archive)
+    {
+        archive_free(archive);
+        archive = NULL;
+    }
+    if(docroot_fd != AT_FDCWD)
+    {
+        close(docroot_fd);
+        docroot_fd = AT_FDCWD;
+    }
+}
 
-    snprintf(file_path_formatted, FMT_BUFFER, ".%s", path);
+// memory copy of a file that is preloaded and unchanged on disk, NULL otherwise
+static const struct preload_entry *preload_find(const char *path, const struct handler_file *file)
+{
+    const struct preload_entry *entry;
 
-    fd = open(file_path_formatted, O_RDONLY | O_CLOEXEC);
-    if(fd < 0)
+    if(!preload_region)
     {
-        perror("open");
-        return -1;
+        return NULL;
+    }
+    entry = preload_slot(path);
+    if(!entry->path || entry->len != file->size || entry->mtime.tv_sec != file->mtime.tv_sec || entry->mtime.tv_nsec != file->mtime.tv_nsec)
+    {
+        return NULL;
     }
-    return fd;
+    return entry;
 }
 
-static size_t find_content_length(int fd)
+// a hot file costs no syscall in the worker's cache, a core without one gets the file opened here
+static int file_open(const char *path, struct handler_file *file)
 {
-    struct stat fileStat;
+    struct stat st;
+    char        relative[PATH_MAX];
+
+    if(hooks.file_open)
+    {
+        return hooks.file_open(path, file);
+    }
 
-    if(fstat(fd, &fileStat) == 0)
+    // the same normalization as the core's cache, so .. cannot leave the docroot here either
+    memset(file, 0, sizeof(*file));
+    if(path_normalize(path, relative, sizeof(relative)) != 0)
     {
-        return (size_t)fileStat.st_size;
+        file->fd = -1;
+        return ENOENT;
     }
-    return (size_t)-1;
+    file->fd = openat(docroot_fd, relative, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if(file->fd < 0)
+    {
+        return errno == EACCES ? EACCES : ENOENT;
+    }
+    if(fstat(file->fd, &st) != 0 || !S_ISREG(st.st_mode) || !(st.st_mode & S_IRUSR))
+    {
+        close(file->fd);
+        file->fd = -1;
+        return EACCES;
+    }
+    file->size  = (size_t)st.st_size;
+    file->mtime = st.st_mtim;
+    file->mime  = mime_type(path);
+    return 0;
 }
 
-static void construct_get_response400(int clientfd)
+static void file_close(struct handler_file *file)
+{
+    if(hooks.file_release)
+    {
+        hooks.file_release(file);
+    }
+    else if(file->fd >= 0)
+    {
+        close(file->fd);
+    }
+}
+
+static void construct_get_response400(struct http_response *res)
 {
     const char body[] = "<html><body><h1>400 Bad Request</h1></body></html>";
-    construct_response(clientfd, "400 Not Found", body, "text/html", strlen(body));
+    construct_response(res, "400 Bad Request", body, "text/html", strlen(body));
 }
 
-static void construct_get_response404(int clientfd)
+static void construct_get_response404(struct http_response *res)
 {
     const char body[] = "<html><body><h1>404 Not Found</h1></body></html>";
-    construct_response(clientfd, "404 Not Found", body, "text/html", strlen(body));
+    construct_response(res, "404 Not Found", body, "text/html", strlen(body));
 }
 
-static void construct_get_response405(int clientfd)
+static void construct_get_response405(struct http_response *res)
 {
     const char body[] = "<html><body><h1>405 Unknown Method</h1></body></html>";
-    construct_response(clientfd, "405 Unknown Method", body, "text/html", strlen(body));
+    construct_response(res, "405 Unknown Method", body, "text/html", strlen(body));
 }
 
-static void construct_get_response403(int clientfd)
+static void construct_get_response403(struct http_response *res)
 {
     const char body[] = "<html><body><h1>403 Forbidden</h1></body></html>";
-    construct_response(clientfd, "403 Forbidden", body, "text/html", strlen(body));
+    construct_response(res, "403 Forbidden", body, "text/html", strlen(body));
 }
 
-static void construct_get_response500(int clientfd)
+static void construct_get_response500(struct http_response *res)
 {
     const char body[] = "<html><body><h1>500 Internal Server Error</h1></body></html>";
-    construct_response(clientfd, "500 Internal Server Error", body, "text/html", strlen(body));
+    construct_response(res, "500 Internal Server Error", body, "text/html", strlen(body));
 }
 
-static void construct_get_response200(int clientfd, const char *mime, int filefd)
+static void construct_get_response200(struct http_response *res, const struct handler_file *file)
 {
-    size_t  fileSize;
-    char   *buffer;
-    ssize_t bytesread;
+    // straight from the page cache, the body never passes through user space
+    if(res->ops->begin(res, "200 OK", file->mime, (long long)file->size) == 0)
+    {
+        res->ops->sendfile(res, file->fd, 0, file->size);
+    }
+}
 
-    fileSize = find_content_length(filefd);
+// subscribers see the pair as it was stored, after the database has it
+static void publish_post(const char *key, const char *value)
+{
+    char   message[POST_PAIR_MAX + 2];
+    size_t key_len   = strlen(key);
+    size_t value_len = strlen(value);
 
-    buffer = (char *)malloc(sizeof(char) * fileSize);
+    if(!hooks.publish || key_len + value_len + 1 >= sizeof(message))
+    {
+        return;
+    }
+    memcpy(message, key, key_len);
+    message[key_len] = '=';
+    memcpy(message + key_len + 1, value, value_len);
+    hooks.publish(message, key_len + 1 + value_len);
+}
 
-    bytesread = read(filefd, buffer, fileSize);
+static int store_string(DBM *db, const char *key, const char *value)
+{
+    const_datum key_datum   = MAKE_CONST_DATUM(key);
+    const_datum value_datum = MAKE_CONST_DATUM(value);
+
+    return dbm_store(db, *(datum *)&key_datum, *(datum *)&value_datum, DBM_REPLACE);
+}
+
+// one pair of a POST body and what became of it
+struct post_pair
+{
+    const char *key;
+    const char *value;
+    const char *status;    // NULL until decided, then reported back for the key
+};
+
+struct post_batch
+{
+    struct arena     *arena;
+    struct post_pair *pairs;
+    size_t            count;
+    size_t            cap;
+};
+
+static int batch_add(struct post_batch *batch, const char *key, const char *value)
+{
+    struct post_pair *pair;
+
+    if(batch->count == batch->cap)
+    {
+        size_t            cap   = batch->cap ? batch->cap * 2 : 16;
+        struct post_pair *grown = (struct post_pair *)arena_alloc(batch->arena, cap * sizeof(struct post_pair));
+        if(!grown)
+        {
+            return -1;
+        }
+        if(batch->count)
+        {
+            memcpy(grown, batch->pairs, batch->count * sizeof(struct post_pair));
+        }
+        batch->pairs = grown;
+        batch->cap   = cap;
+    }
+
+    pair         = &batch->pairs[batch->count++];
+    pair->key    = key;
+    pair->value  = value;
+    pair->status = NULL;
+    if(!value || *key == '\0')
+    {
+        pair->status = "invalid";
+    }
+    else if(strlen(key) + 1 + strlen(value) >= POST_PAIR_MAX)
+    {
+        pair->status = "too long";
+    }
+    return 0;
+}
+
+// the whole body, pairs are only written once all of them have been parsed
+static char *read_post(struct http_body *body, struct arena *arena, size_t *len, int *result)
+{
+    size_t cap = POST_CHUNK;
+    char  *buf = (char *)arena_alloc(arena, cap + 1);
 
-    if(bytesread < 0)
+    *len = 0;
+    while(buf)
     {
-        construct_get_response404(clientfd);
-        free(buffer);
+        ssize_t n;
+
+        if(*len == cap)
+        {
+            char *grown;
+            char  probe;
+
+            // a full buffer at the limit is only too large if one more byte follows
+            if(cap >= POST_BATCH_MAX)
+            {
+                n = body->ops->read(body, &probe, 1);
+                if(n == 0)
+                {
+                    buf[*len] = '\0';
+                    *result   = 0;
+                    return buf;
+                }
+                *result = n < 0 ? -2 : -3;
+                return NULL;
+            }
+            cap *= 2;
+            grown = (char *)arena_alloc(arena, cap + 1);
+            if(grown)
+            {
+                memcpy(grown, buf, *len);
+            }
+            buf = grown;
+            continue;
+        }
+
+        n = body->ops->read(body, buf + *len, cap - *len);
+        if(n < 0)
+        {
+            *result = -2;
+            return NULL;
+        }
+        if(n == 0)
+        {
+            buf[*len] = '\0';
+            *result   = 0;
+            return buf;
+        }
+        *len += (size_t)n;
+    }
+    *result = -4;
+    return NULL;
+}
+
+static int hex_value(char c)
+{
+    if(c >= '0' && c <= '9')
+    {
+        return c - '0';
+    }
+    if(c >= 'a' && c <= 'f')
+    {
+        return c - 'a' + 10;
+    }
+    if(c >= 'A' && c <= 'F')
+    {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+// '+' and %XX decoded in place, a bad escape or a %00 fails
+static int form_decode(char *s)
+{
+    char *out = s;
+
+    for(; *s; s++)
+    {
+        if(*s == '+')
+        {
+            *out++ = ' ';
+        }
+        else if(*s == '%')
+        {
+            int high = hex_value(s[1]);
+            int low  = high < 0 ? -1 : hex_value(s[2]);
+
+            if(low < 0 || (high == 0 && low == 0))
+            {
+                return -1;
+            }
+            *out++ = (char)((high << 4) | low);
+            s += 2;
+        }
+        else
+        {
+            *out++ = *s;
+        }
+    }
+    *out = '\0';
+    return 0;
+}
+
+// application/x-www-form-urlencoded, a pair without '=' is reported as invalid
+static int parse_form(char *body, struct post_batch *batch)
+{
+    char *save;
+
+    for(char *field = strtok_r(body, "&", &save); field; field = strtok_r(NULL, "&", &save))
+    {
+        char *value = strchr(field, '=');
+
+        if(value)
+        {
+            *value++ = '\0';
+        }
+        if(form_decode(field) != 0 || (value && form_decode(value) != 0) || batch_add(batch, field, value) != 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static const char *json_skip(const char *p)
+{
+    while(*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+    {
+        p++;
+    }
+    return p;
+}
+
+static char *utf8_put(char *out, uint32_t cp)
+{
+    if(cp < 0x80)
+    {
+        *out++ = (char)cp;
+    }
+    else if(cp < 0x800)
+    {
+        *out++ = (char)(0xC0 | (cp >> 6));
+        *out++ = (char)(0x80 | (cp & 0x3F));
+    }
+    else if(cp < 0x10000)
+    {
+        *out++ = (char)(0xE0 | (cp >> 12));
+        *out++ = (char)(0x80 | ((cp >> 6) & 0x3F));
+        *out++ = (char)(0x80 | (cp & 0x3F));
     }
     else
     {
-        construct_response(clientfd, "200 OK", buffer, mime, fileSize);
-        free(buffer);
+        *out++ = (char)(0xF0 | (cp >> 18));
+        *out++ = (char)(0x80 | ((cp >> 12) & 0x3F));
+        *out++ = (char)(0x80 | ((cp >> 6) & 0x3F));
+        *out++ = (char)(0x80 | (cp & 0x3F));
     }
+    return out;
 }
 
-static void get_body_pos(char buffer[BUFFER_SIZE], char **bodyptr)
+static int json_hex4(const char *p, uint32_t *cp)
 {
-    const char *key;
+    *cp = 0;
+    for(int i = 0; i < 4; i++)
+    {
+        int v = hex_value(p[i]);
+        if(v < 0)
+        {
+            return -1;
+        }
+        *cp = (*cp << 4) | (uint32_t)v;
+    }
+    return 0;
+}
 
-    key = "\r\n\r\n";
+// decodes the string starting at the quote in place, the result starts at
+// the quote and is never longer, returns the position after the closing quote
+static char *json_string(char *p, const char **str)
+{
+    char *out = p;
 
-    *bodyptr = strstr(buffer, key);
+    *str = p;
+    for(p++; *p != '"'; p++)
+    {
+        uint32_t cp;
 
-    if(*bodyptr)
+        if((unsigned char)*p < 0x20)
+        {
+            return NULL;    // control characters must be escaped, the NUL ends the body
+        }
+        if(*p != '\\')
+        {
+            *out++ = *p;
+            continue;
+        }
+        p++;
+        switch(*p)
+        {
+            case '"':
+            case '\\':
+            case '/':
+                *out++ = *p;
+                break;
+            case 'b':
+                *out++ = '\b';
+                break;
+            case 'f':
+                *out++ = '\f';
+                break;
+            case 'n':
+                *out++ = '\n';
+                break;
+            case 'r':
+                *out++ = '\r';
+                break;
+            case 't':
+                *out++ = '\t';
+                break;
+            case 'u':
+                if(json_hex4(p + 1, &cp) != 0 || cp == 0)
+                {
+                    return NULL;
+                }
+                p += 4;
+                if(cp >= 0xD800 && cp <= 0xDBFF)
+                {
+                    uint32_t low;
+                    if(p[1] != '\\' || p[2] != 'u' || json_hex4(p + 3, &low) != 0 || low < 0xDC00 || low > 0xDFFF)
+                    {
+                        return NULL;
+                    }
+                    cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                    p += 6;
+                }
+                else if(cp >= 0xDC00 && cp <= 0xDFFF)
+                {
+                    return NULL;
+                }
+                out = utf8_put(out, cp);
+                break;
+            default:
+                return NULL;
+        }
+    }
+    *out = '\0';
+    return p + 1;
+}
+
+// what may follow a number or a literal
+static int json_delimiter(char c)
+{
+    return c == ',' || c == '}' || c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\0';
+}
+
+static const char *json_digits(const char *p)
+{
+    while(*p >= '0' && *p <= '9')
     {
-        *bodyptr += 4;
+        p++;
     }
+    return p;
 }
 
-static int store_string(DBM *db, const char *key, const char *value)
+// -?(0|[1-9][0-9]*)(\.[0-9]+)?([eE][+-]?[0-9]+)?, returns its length, 0 when p does not start with one
+static size_t json_number(const char *p)
 {
-    const_datum key_datum   = MAKE_CONST_DATUM(key);
-    const_datum value_datum = MAKE_CONST_DATUM(value);
+    const char *s = *p == '-' ? p + 1 : p;
 
-    return dbm_store(db, *(datum *)&key_datum, *(datum *)&value_datum, DBM_REPLACE);
+    if(*s == '0')
+    {
+        s++;
+    }
+    else if(*s >= '1' && *s <= '9')
+    {
+        s = json_digits(s);
+    }
+    else
+    {
+        return 0;
+    }
+    if(*s == '.')
+    {
+        if(s[1] < '0' || s[1] > '9')
+        {
+            return 0;
+        }
+        s = json_digits(s + 1);
+    }
+    if(*s == 'e' || *s == 'E')
+    {
+        s += s[1] == '+' || s[1] == '-' ? 2 : 1;
+        if(*s < '0' || *s > '9')
+        {
+            return 0;
+        }
+        s = json_digits(s);
+    }
+    return (size_t)(s - p);
+}
+
+// numbers, true and false are stored as written, null leaves the key invalid
+static char *json_literal(char *p, struct arena *arena, const char **value)
+{
+    size_t len;
+    char  *copy;
+
+    if(strncmp(p, "null", 4) == 0 && json_delimiter(p[4]))
+    {
+        *value = NULL;
+        return p + 4;
+    }
+    if(strncmp(p, "true", 4) == 0)
+    {
+        len = 4;
+    }
+    else if(strncmp(p, "false", 5) == 0)
+    {
+        len = 5;
+    }
+    else
+    {
+        len = json_number(p);
+    }
+    if(len == 0 || !json_delimiter(p[len]))
+    {
+        return NULL;
+    }
+    copy = (char *)arena_alloc(arena, len + 1);
+    if(!copy)
+    {
+        return NULL;
+    }
+    memcpy(copy, p, len);
+    copy[len] = '\0';
+    *value    = copy;
+    return p + len;
 }
 
-static void store_in_db(const char *key, const char *value)
+// application/json batch: one flat object, {"key": "value", ...}
+static int parse_json(char *body, struct post_batch *batch)
+{
+    char *p = (char *)json_skip(body);
+
+    if(*p != '{')
+    {
+        return -1;
+    }
+    p = (char *)json_skip(p + 1);
+    if(*p == '}')
+    {
+        return *json_skip(p + 1) == '\0' ? 0 : -1;
+    }
+
+    for(;;)
+    {
+        const char *key;
+        const char *value;
+
+        if(*p != '"' || (p = json_string(p, &key)) == NULL)
+        {
+            return -1;
+        }
+        p = (char *)json_skip(p);
+        if(*p != ':')
+        {
+            return -1;
+        }
+        p = (char *)json_skip(p + 1);
+        p = *p == '"' ? json_string(p, &value) : json_literal(p, batch->arena, &value);
+        if(!p || batch_add(batch, key, value) != 0)
+        {
+            return -1;
+        }
+        p = (char *)json_skip(p);
+        if(*p == '}')
+        {
+            return *json_skip(p + 1) == '\0' ? 0 : -1;
+        }
+        if(*p != ',')
+        {
+            return -1;
+        }
+        p = (char *)json_skip(p + 1);
+    }
+}
+
+// every valid pair under one dbm_open, subscribers hear about them once it is closed
+static int store_batch(struct post_batch *batch, int *stored)
 {
     char db_name[] = "posts_db";    // cppcheck-suppress constVariable
-    DBM *db        = dbm_open(db_name, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    DBM *db;
+
+    *stored = 0;
+    for(size_t i = 0; i < batch->count && *stored == 0; i++)
+    {
+        *stored = batch->pairs[i].status == NULL;
+    }
+    if(*stored == 0)
+    {
+        return 0;
+    }
+    *stored = 0;
 
+    db = dbm_open(db_name, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    trace_point(TRACE_DB_OPEN);
     if(!db)
     {
         perror("dbm_open");
-        return;
+        return -1;
     }
-
-    if(store_string(db, key, value) != 0)
+    for(size_t i = 0; i < batch->count; i++)
     {
-        perror("store_string");
-        dbm_close(db);
-        return;
+        struct post_pair *pair = &batch->pairs[i];
+
+        if(pair->status)
+        {
+            continue;
+        }
+        if(store_string(db, pair->key, pair->value) != 0)
+        {
+            perror("store_string");
+            pair->status = "failed";
+            continue;
+        }
+        pair->status = "stored";
+        (*stored)++;
     }
     dbm_close(db);
+    trace_point(TRACE_DB_STORE);
+
+    for(size_t i = 0; i < batch->count; i++)
+    {
+        if(strcmp(batch->pairs[i].status, "stored") == 0)
+        {
+            publish_post(batch->pairs[i].key, batch->pairs[i].value);
+        }
+    }
+    return 0;
 }
 
-static int tokenize_post(char *body)
+static char *json_put_string(char *out, const char *str)
 {
-    const char *key;
-    const char *value;
-    char       *save;
+    *out++ = '"';
+    for(; *str; str++)
+    {
+        unsigned char ch = (unsigned char)*str;
+        if(ch == '"' || ch == '\\')
+        {
+            *out++ = '\\';
+            *out++ = (char)ch;
+        }
+        else if(ch < 0x20)
+        {
+            out += sprintf(out, "\\u%04x", ch);
+        }
+        else
+        {
+            *out++ = (char)ch;
+        }
+    }
+    *out++ = '"';
+    return out;
+}
 
-    key   = strtok_r(body, "=", &save);
-    value = strtok_r(NULL, "=", &save);
+// {"stored": N, "results": [{"key": "...", "status": "stored"}, ...]}
+static void construct_post_response(struct http_response *res, const struct post_batch *batch, int stored)
+{
+    size_t cap = 64;
+    char  *body;
+    char  *out;
 
-    if(key == NULL || value == NULL)
+    for(size_t i = 0; i < batch->count; i++)
     {
-        printf("Invalid post body structure\n");
-        return -1;
+        cap += (strlen(batch->pairs[i].key) * 6) + 48;
+    }
+    body = (char *)arena_alloc(batch->arena, cap);
+    if(!body)
+    {
+        construct_get_response500(res);
+        return;
+    }
+
+    out = body + sprintf(body, "{\"stored\": %d, \"results\": [", stored);
+    for(size_t i = 0; i < batch->count; i++)
+    {
+        out += sprintf(out, "%s{\"key\": ", i ? ", " : "");
+        out = json_put_string(out, batch->pairs[i].key);
+        out += sprintf(out, ", \"status\": \"%s\"}", batch->pairs[i].status);
     }
+    out += sprintf(out, "]}\n");
 
-    store_in_db(key, value);
+    // nothing could be stored, the body was all invalid pairs
+    construct_response(res, stored > 0 || batch->count == 0 ? "200 OK" : "400 Bad Request", body, "application/json", (size_t)(out - body));
+}
+
+// Accept-Encoding lists gzip without q=0
+static int accepts_gzip(const char *accept)
+{
+    while(accept && *accept)
+    {
+        size_t len;
+
+        accept += strspn(accept, " \t,");
+        len = strcspn(accept, ",");
+        if(len >= 4 && strncasecmp(accept, "gzip", 4) == 0 && (len == 4 || accept[4] == ';' || accept[4] == ' '))
+        {
+            const char *q = strstr(accept, "q=");
+            return !(q && q < accept + len && strtod(q + 2, NULL) <= 0);
+        }
+        accept += len;
+    }
     return 0;
 }
 
-void handle_request(int client_fd)
+// the ETag and MIME strings come from the archive and the body is sent from its page cache
+static void archive_serve(const struct archive *ar, const struct http_request *req, struct http_response *res, int head_only)
 {
-    struct req_info info;
-    char            buffer[BUFFER_SIZE];
-    char to_parse[BUFFER_SIZE];
-    ssize_t         valread;
+    const struct pack_entry   *entry = NULL;
+    const struct pack_payload *payload;
+    const char                *mime;
+    const char                *etag;
+    const char                *match;
+    char                       path[PATH_MAX];
+
+    // archive paths are absolute, normalize the same way the docroot lookup does
+    trace_point(TRACE_FILE_STAT);
+    path[0] = '/';
+    if(path_normalize(req->path, path + 1, sizeof(path) - 1) == 0)
+    {
+        entry = archive_find(ar, path);
+    }
+    if(!entry)
+    {
+        construct_get_response404(res);
+        return;
+    }
 
-    memset(buffer, 0, BUFFER_SIZE);
-    memset(to_parse, '\0', BUFFER_SIZE);
-    valread = read(client_fd, buffer, BUFFER_SIZE);
-    if(valread < 0)
+    payload = &entry->plain;
+    if(entry->gzip.length > 0)
+    {
+        res->ops->header(res, "Vary", "Accept-Encoding");
+        if(accepts_gzip(http_header(req, "Accept-Encoding")))
+        {
+            payload = &entry->gzip;
+            res->ops->header(res, "Content-Encoding", "gzip");
+        }
+    }
+    mime  = archive_string(ar, entry->mime);
+    etag  = archive_string(ar, payload->etag);
+    match = http_header(req, "If-None-Match");
+    res->ops->header(res, "ETag", etag);
+
+    if(match && (strcmp(match, "*") == 0 || strstr(match, etag)))
+    {
+        res->ops->begin(res, "304 Not Modified", mime, (long long)payload->length);
+    }
+    else if(res->ops->begin(res, "200 OK", mime, (long long)payload->length) == 0 && !head_only)
     {
-        // handle reading error
-        perror("handle_request: read\n");
+        res->ops->sendfile(res, ar->fd, (off_t)payload->offset, (size_t)payload->length);
+    }
+}
+
+void handle_request(const struct http_request *req, struct http_response *res)
+{
+    struct archive *ar = NULL;
+
+    // a deployed archive answers GET and HEAD on its own, the docroot is not looked at
+    if(strcmp("GET", req->method) == 0 || strcmp("HEAD", req->method) == 0)
+    {
+        ar = archive_acquire();
+    }
+    if(ar)
+    {
+        archive_serve(ar, req, res, req->method[0] == 'H');
+        archive_release(ar);
         return;
     }
 
-    strncpy(to_parse, buffer, BUFFER_SIZE - 1);
-    printf("INCOMING:\n%s\nEND BUFFER\n", buffer);
-    // parse
-    parse_request(&info, to_parse);
     // check for get, head, post
-    if(strcmp("GET", info.method) == 0)
+    if(strcmp("GET", req->method) == 0 || strcmp("HEAD", req->method) == 0)
     {
-        // size_t      content_length;
-        const char *mime;
-        int         requested_fd;
-        int         verification;
+        const struct preload_entry *preloaded;
+        struct handler_file         file;
+        int                         error;
 
-        verification = file_verification(info.path);
+        error = file_open(req->path, &file);
+        trace_point(TRACE_FILE_STAT);
+        trace_point(TRACE_FILE_OPEN);
 
         // error handle if path is not real and stuff
-        if(verification == -1)
+        if(error == ENOENT)
         {
             // send 404 error back to client
-            construct_get_response404(client_fd);
+            construct_get_response404(res);
             return;
         }
 
-        else if(verification == -2)
+        else if(error == EACCES)
         {
-            // send 404 error back to client
-            construct_get_response403(client_fd);
+            // send 403 error back to client
+            construct_get_response403(res);
             return;
         }
 
-        // handle
-        requested_fd = open_requested_file(info.path);
-        if(requested_fd < 0)
+        else if(error != 0)
         {
-            construct_get_response500(client_fd);
+            construct_get_response500(res);
             return;
         }
 
-        mime = get_mime_type(info.path);
-        // content_length = find_content_length(clientfd);
-        // construct_response(clientfd, "200 OK", buffer, mime, content_length);
-        construct_get_response200(client_fd, mime, requested_fd);
-    }
+        // handle head
+        if(req->method[0] == 'H')
+        {
+            construct_response(res, "200 OK", NULL, "text/html", 0);
+        }
 
-    else if(strcmp("HEAD", info.method) == 0)
-    {
-        int verification;
+        // hot files come from memory shared with the other workers
+        else if((preloaded = preload_find(req->path, &file)) != NULL)
+        {
+            construct_response(res, "200 OK", preloaded->data, preloaded->mime, preloaded->len);
+        }
 
-        verification = file_verification(info.path);
+        else
+        {
+            construct_get_response200(res, &file);
+        }
+        file_close(&file);
+    }
 
-        // error handle if path is not real and stuff
-        if(verification == -1)
+    else if(strcmp("POST", req->method) == 0)
+    {
+        const char       *type = http_header(req, "Content-Type");
+        struct post_batch batch;
+        char             *body;
+        size_t            len;
+        int               stored;
+        int               result;
+
+        body = read_post(req->reader, req->arena, &len, &result);
+        if(result == -2)
         {
-            // send 404 error back to client
-            construct_get_response404(client_fd);
+            // the body reader knows what went wrong, the worker answers
             return;
         }
-
-        else if(verification == -2)
+        if(result == -3)
         {
-            // send 404 error back to client
-            construct_get_response403(client_fd);
+            construct_response(res, "413 Payload Too Large", NULL, "text/html", 0);
             return;
         }
 
-        // handle head
-        construct_response(client_fd, "200 OK", NULL, "text/html", 0);
-    }
-
-    else if(strcmp("POST", info.method) == 0)
-    {
-        // handle post
-        // int   content_len;
-        char *bodyptr;
+        if(!body)
+        {
+            construct_get_response500(res);
+            return;
+        }
 
-        // content_len = get_content_length(buffer);
-        get_body_pos(buffer, &bodyptr);
-        if(tokenize_post(bodyptr) < 0)
+        memset(&batch, 0, sizeof(batch));
+        batch.arena = req->arena;
+        if(memchr(body, '\0', len))
+        {
+            result = -1;
+        }
+        else if(type && strncasecmp(type, "application/json", 16) == 0)
+        {
+            result = parse_json(body, &batch);
+        }
+        else
+        {
+            result = parse_form(body, &batch);
+        }
+        if(result != 0)
+        {
+            construct_get_response400(res);
+            return;
+        }
+        if(store_batch(&batch, &stored) != 0)
         {
-            construct_get_response400(client_fd);
+            construct_get_response500(res);
             return;
         }
-        construct_response(client_fd, "200 OK", NULL, "text/html", 0);
+        construct_post_response(res, &batch, stored);
         return;
     }
 
     else
     {
         // handler error
-        construct_get_response405(client_fd);
+        construct_get_response405(res);
     }
 }
@@ -0,0 +1,680 @@
+#define _GNU_SOURCE    // splice, pipe2, O_TMPFILE
+
+#include "../include/http.h"
+#include "../include/config.h"
+#include "../include/timer.h"
+#include "../include/trace.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define HEAD_END "\r\n\r\n"
+#define HEAD_END_LEN 4
+#define STATUS_LINE_MAX 512
+#define CONTINUE_LINE "HTTP/1.1 100 Continue\r\n\r\n"
+#define SPLICE_MAX 65536
+#define WRITE_STEP_MAX 65536     // response bytes per send or sendfile, TIMER_WRITE is re-armed after each
+
+int http_write_all(int fd, const void *buf, size_t len)
+{
+    const char *ptr = (const char *)buf;
+
+    while(len > 0)
+    {
+        ssize_t n = send(fd, ptr, len, MSG_NOSIGNAL);
+        if(n < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        ptr += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int write_file(int fd, const char *buf, size_t len)
+{
+    while(len > 0)
+    {
+        ssize_t n = write(fd, buf, len);
+        if(n < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static ssize_t find_head_end(const char *buf, size_t len, size_t from)
+{
+    for(size_t i = from; i + HEAD_END_LEN <= len; i++)
+    {
+        if(memcmp(buf + i, HEAD_END, HEAD_END_LEN) == 0)
+        {
+            return (ssize_t)(i + HEAD_END_LEN);
+        }
+    }
+    return -1;
+}
+
+static char *trim(char *str)
+{
+    char *end;
+
+    while(*str == ' ' || *str == '\t')
+    {
+        str++;
+    }
+    end = str + strlen(str);
+    while(end > str && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r'))
+    {
+        *--end = '\0';
+    }
+    return str;
+}
+
+int http_has_token(const char *value, const char *token)
+{
+    size_t token_len = strlen(token);
+
+    while(*value)
+    {
+        size_t len;
+
+        value += strspn(value, " \t,");
+        len    = strcspn(value, " \t,");
+        if(len == token_len && strncasecmp(value, token, token_len) == 0)
+        {
+            return 1;
+        }
+        value += len;
+    }
+    return 0;
+}
+
+static int parse_request_line(struct http_request *req, char *line)
+{
+    char *save;
+    char *query;
+
+    req->method   = strtok_r(line, " ", &save);
+    req->target   = strtok_r(NULL, " ", &save);
+    req->protocol = strtok_r(NULL, " ", &save);
+    if(!req->method || !req->target || !req->protocol || strncmp(req->protocol, "HTTP/", 5) != 0)
+    {
+        return -1;
+    }
+
+    // path is a copy so the target stays intact for proxying
+    req->path = arena_alloc(req->arena, strlen(req->target) + 1);
+    if(!req->path)
+    {
+        return -1;
+    }
+    strcpy((char *)req->path, req->target);    // NOLINT(clang-analyzer-security.insecureAPI.strcpy)
+    query = strchr(req->path, '?');
+    if(query)
+    {
+        *query     = '\0';
+        req->query = query + 1;
+    }
+    return 0;
+}
+
+static int parse_headers(struct http_request *req, char *lines)
+{
+    char *save;
+    char *line;
+
+    for(line = strtok_r(lines, "\n", &save); line; line = strtok_r(NULL, "\n", &save))
+    {
+        char *colon = strchr(line, ':');
+        char *name;
+        char *value;
+
+        if(!colon)
+        {
+            if(*trim(line) == '\0')
+            {
+                continue;
+            }
+            return -1;
+        }
+        if(req->header_count == HTTP_MAX_HEADERS)
+        {
+            return -1;
+        }
+
+        *colon = '\0';
+        name   = trim(line);
+        value  = trim(colon + 1);
+
+        if(strcasecmp(name, "Content-Length") == 0)
+        {
+            char *end;
+            req->content_length = strtoll(value, &end, 10);
+            if(end == value || *end != '\0' || req->content_length < 0)
+            {
+                return -1;
+            }
+        }
+        else if(strcasecmp(name, "Transfer-Encoding") == 0 && http_has_token(value, "chunked"))
+        {
+            req->chunked = 1;
+        }
+
+        req->headers[req->header_count].name  = name;
+        req->headers[req->header_count].value = value;
+        req->header_count++;
+    }
+
+    // both framings at once is how requests get smuggled
+    return (req->chunked && req->content_length >= 0) ? -1 : 0;
+}
+
+int http_read_request(int fd, struct arena *arena, struct http_request *req)
+{
+    char   *buf      = (char *)arena_alloc(arena, HTTP_HEAD_MAX + 1);
+    size_t  have     = 0;
+    ssize_t head_len = -1;
+    char   *headers;
+
+    memset(req, 0, sizeof(*req));
+    req->arena          = arena;
+    req->content_length = -1;
+    if(!buf)
+    {
+        return HTTP_READ_BAD;
+    }
+
+    while(head_len < 0)
+    {
+        size_t  from = have > HEAD_END_LEN ? have - HEAD_END_LEN : 0;
+        ssize_t n;
+
+        if(have == HTTP_HEAD_MAX)
+        {
+            return HTTP_READ_TOO_LARGE;
+        }
+        n = read(fd, buf + have, HTTP_HEAD_MAX - have);
+        if(n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(n <= 0)
+        {
+            return have == 0 ? HTTP_READ_CLOSED : HTTP_READ_BAD;
+        }
+        have     += (size_t)n;
+        head_len  = find_head_end(buf, have, from);
+    }
+
+    // body bytes that came along, moved out so the head can be split in place
+    req->body_len = have - (size_t)head_len;
+    req->body     = arena_alloc(arena, req->body_len + 1);
+    if(!req->body)
+    {
+        return HTTP_READ_BAD;
+    }
+    memcpy((char *)req->body, buf + head_len, req->body_len);
+    ((char *)req->body)[req->body_len] = '\0';
+    buf[head_len - 2]                  = '\0';
+
+    headers = strchr(buf, '\n');
+    if(!headers)
+    {
+        return HTTP_READ_BAD;
+    }
+    *headers++ = '\0';
+    trim(buf);
+
+    if(parse_request_line(req, buf) != 0 || parse_headers(req, headers) != 0)
+    {
+        return HTTP_READ_BAD;
+    }
+    return HTTP_READ_OK;
+}
+
+int http_body_continue(struct http_body *body)
+{
+    if(!body->expect_continue)
+    {
+        return 0;
+    }
+    body->expect_continue = 0;
+    return http_write_all(body->fd, CONTINUE_LINE, sizeof(CONTINUE_LINE) - 1);
+}
+
+static ssize_t body_fail(struct http_body *body, const char *status)
+{
+    if(!body->status)
+    {
+        body->status = status;
+    }
+    return -1;
+}
+
+// raw body bytes, the ones that came with the head first
+static ssize_t body_fill(struct http_body *body, char *buf, size_t cap)
+{
+    ssize_t n;
+
+    if(body->prefix_len > 0)
+    {
+        size_t take = body->prefix_len < cap ? body->prefix_len : cap;
+        memcpy(buf, body->prefix, take);
+        body->prefix     += take;
+        body->prefix_len -= take;
+        return (ssize_t)take;
+    }
+
+    // the client holds the body back until told to go on
+    if(http_body_continue(body) != 0)
+    {
+        return -1;
+    }
+    if(body->phase)
+    {
+        body->phase(body->fd, TIMER_BODY);
+    }
+    do
+    {
+        n = read(body->fd, buf, cap);
+    } while(n < 0 && errno == EINTR);
+    return n;
+}
+
+// decode in place, payload runs are moved down over the framing
+static ssize_t body_read_chunked(struct http_body *body, char *buf, size_t cap)
+{
+    size_t out = 0;
+
+    while(out == 0 && !chunked_done(&body->decoder))
+    {
+        ssize_t n   = body_fill(body, buf, cap);
+        size_t  off = 0;
+
+        if(n <= 0)
+        {
+            return body_fail(body, "400 Bad Request");
+        }
+        while(off < (size_t)n && !chunked_done(&body->decoder))
+        {
+            const char *data;
+            size_t      data_len;
+            ssize_t     used = chunked_parse(&body->decoder, buf + off, (size_t)n - off, &data, &data_len);
+
+            if(used < 0)
+            {
+                return body_fail(body, "400 Bad Request");
+            }
+            if(data_len > 0)
+            {
+                memmove(buf + out, data, data_len);
+                out += data_len;
+            }
+            off += (size_t)used;
+        }
+    }
+
+    body->done = chunked_done(&body->decoder);
+    return (ssize_t)out;
+}
+
+static ssize_t body_read(struct http_body *body, void *buf, size_t cap)
+{
+    ssize_t n;
+
+    if(body->status)
+    {
+        return -1;
+    }
+    if(body->done || cap == 0)
+    {
+        return 0;
+    }
+
+    if(body->chunked)
+    {
+        n = body_read_chunked(body, (char *)buf, cap);
+    }
+    else
+    {
+        unsigned long long left = (unsigned long long)(body->length - body->received);
+
+        n = body_fill(body, (char *)buf, left < cap ? (size_t)left : cap);
+        if(n <= 0)
+        {
+            return body_fail(body, "400 Bad Request");
+        }
+    }
+    if(n < 0)
+    {
+        return -1;
+    }
+
+    if(body->tee && body->tee_len < body->tee_cap)
+    {
+        size_t take = body->tee_cap - body->tee_len < (size_t)n ? body->tee_cap - body->tee_len : (size_t)n;
+        memcpy(body->tee + body->tee_len, buf, take);
+        body->tee_len += take;
+    }
+
+    body->received += n;
+    if(body->received > HTTP_BODY_MAX)
+    {
+        return body_fail(body, "413 Payload Too Large");
+    }
+    if(!body->chunked && body->received == body->length)
+    {
+        body->done = 1;
+    }
+    if(body->done)
+    {
+        trace_current(TRACE_BODY_DONE);
+    }
+    return n;
+}
+
+// socket to file through a pipe, the payload stays in the kernel
+static int body_splice(struct http_body *body, int file_fd)
+{
+    int pipe_fds[2];
+    int result = 0;
+
+    if(pipe2(pipe_fds, O_CLOEXEC) != 0)
+    {
+        perror("body_splice: pipe2\n");
+        return (int)body_fail(body, "500 Internal Server Error");
+    }
+    if(http_body_continue(body) != 0)
+    {
+        result = (int)body_fail(body, "400 Bad Request");
+    }
+
+    while(result == 0 && body->received < body->length)
+    {
+        unsigned long long left = (unsigned long long)(body->length - body->received);
+        ssize_t            in;
+
+        if(body->phase)
+        {
+            body->phase(body->fd, TIMER_BODY);
+        }
+        in = splice(body->fd, NULL, pipe_fds[1], NULL, left < SPLICE_MAX ? (size_t)left : SPLICE_MAX, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if(in < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(in <= 0)
+        {
+            result = (int)body_fail(body, "400 Bad Request");
+            break;
+        }
+        body->received += in;
+
+        while(in > 0)
+        {
+            ssize_t out = splice(pipe_fds[0], NULL, file_fd, NULL, (size_t)in, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if(out < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if(out <= 0)
+            {
+                perror("body_splice: splice\n");
+                result = (int)body_fail(body, "500 Internal Server Error");
+                break;
+            }
+            in -= out;
+        }
+    }
+
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+    body->done = result == 0;
+    if(body->done)
+    {
+        trace_current(TRACE_BODY_DONE);
+    }
+    return result;
+}
+
+static int body_spill(struct http_body *body, off_t *len)
+{
+    char    chunk[HTTP_BODY_CHUNK];
+    ssize_t n;
+    int     file_fd = open(HTTP_SPILL_DIR, O_TMPFILE | O_RDWR | O_CLOEXEC, S_IRUSR | S_IWUSR);
+
+    if(file_fd < 0)
+    {
+        perror("body_spill: open\n");
+        return (int)body_fail(body, "500 Internal Server Error");
+    }
+
+    // what is already in memory, and chunked bodies that need decoding, go through user space
+    do
+    {
+        n = (body->chunked || body->prefix_len > 0) ? body_read(body, chunk, sizeof(chunk)) : 0;
+        if(n > 0 && write_file(file_fd, chunk, (size_t)n) != 0)
+        {
+            perror("body_spill: write\n");
+            n = body_fail(body, "500 Internal Server Error");
+        }
+    } while(n > 0);
+
+    if(n < 0 || (!body->done && body_splice(body, file_fd) != 0) || lseek(file_fd, 0, SEEK_SET) != 0)
+    {
+        close(file_fd);
+        return -1;
+    }
+    *len = (off_t)body->received;
+    return file_fd;
+}
+
+static const struct http_body_ops body_ops = {body_read, body_spill};
+
+void http_body_init(struct http_body *body, struct http_request *req, int fd, void (*phase)(int client_fd, int phase))
+{
+    const char *expect = http_header(req, "Expect");
+
+    memset(body, 0, sizeof(*body));
+    body->ops        = &body_ops;
+    body->fd         = fd;
+    body->phase      = phase;
+    body->prefix     = req->body;
+    body->prefix_len = req->body_len;
+    body->chunked    = req->chunked;
+    body->length     = req->chunked ? -1 : (req->content_length > 0 ? req->content_length : 0);
+    body->done       = !req->chunked && body->length == 0;
+    chunked_init(&body->decoder);
+
+    // only worth answering if the client is still holding the body back
+    body->expect_continue = expect && strcasecmp(expect, "100-continue") == 0 && strcmp(req->protocol, "HTTP/1.1") == 0 && req->body_len == 0 && !body->done;
+
+    req->reader = body;
+}
+
+void http_body_tee(struct http_body *body, char *buf, size_t cap)
+{
+    body->tee     = buf;
+    body->tee_cap = cap;
+    body->tee_len = 0;
+}
+
+static int response_header(struct http_response *res, const char *name, const char *value)
+{
+    size_t need = strlen(name) + strlen(value) + 4;
+
+    if(res->started)
+    {
+        return -1;
+    }
+    if(res->headers_len + need > res->headers_cap)
+    {
+        size_t cap = res->headers_cap ? res->headers_cap * 2 : 256;
+        char  *grown;
+
+        while(cap < res->headers_len + need)
+        {
+            cap *= 2;
+        }
+        grown = (char *)arena_alloc(res->arena, cap + 1);
+        if(!grown)
+        {
+            return -1;
+        }
+        if(res->headers_len)
+        {
+            memcpy(grown, res->headers, res->headers_len);
+        }
+        res->headers     = grown;
+        res->headers_cap = cap;
+    }
+    snprintf(res->headers + res->headers_len, need + 1, "%s: %s\r\n", name, value);
+    res->headers_len += need;
+    return 0;
+}
+
+static int response_fail(struct http_response *res)
+{
+    res->failed = 1;
+    return -1;
+}
+
+// the write deadline bounds each step, a slow client that keeps reading is never cut off
+static void response_progress(struct http_response *res)
+{
+    if(res->phase)
+    {
+        res->phase(res->fd, TIMER_WRITE);
+    }
+}
+
+static int response_begin(struct http_response *res, const char *status, const char *mime, long long content_length)
+{
+    size_t cap = STATUS_LINE_MAX + res->headers_len;
+    char  *head;
+    int    len;
+
+    if(res->started)
+    {
+        return -1;
+    }
+    res->started = 1;
+    response_progress(res);
+
+    head = (char *)arena_alloc(res->arena, cap);
+    if(!head)
+    {
+        return response_fail(res);
+    }
+
+    if(content_length >= 0)
+    {
+        len = snprintf(head, cap, "HTTP/1.0 %s\r\nContent-Type: %s\r\nContent-Length: %lld\r\nConnection: close\r\n%.*s\r\n", status, mime, content_length, (int)res->headers_len, res->headers ? res->headers : "");
+    }
+    else
+    {
+        len = snprintf(head, cap, "HTTP/1.0 %s\r\nContent-Type: %s\r\nConnection: close\r\n%.*s\r\n", status, mime, (int)res->headers_len, res->headers ? res->headers : "");
+    }
+    if(len < 0 || (size_t)len >= cap || http_write_all(res->fd, head, (size_t)len) != 0)
+    {
+        return response_fail(res);
+    }
+    trace_current(TRACE_RESPONSE_HEAD);
+    trace_current_status(atoi(status));
+    return 0;
+}
+
+static int response_write(struct http_response *res, const void *data, size_t len)
+{
+    const char *ptr = (const char *)data;
+
+    if(!res->started || res->failed)
+    {
+        return -1;
+    }
+
+    while(len > 0)
+    {
+        size_t step = len < WRITE_STEP_MAX ? len : WRITE_STEP_MAX;
+
+        if(http_write_all(res->fd, ptr, step) != 0)
+        {
+            return response_fail(res);
+        }
+        response_progress(res);
+        ptr += step;
+        len -= step;
+    }
+    return 0;
+}
+
+static int response_sendfile(struct http_response *res, int fd, off_t offset, size_t len)
+{
+    if(!res->started || res->failed)
+    {
+        return -1;
+    }
+
+    while(len > 0)
+    {
+        ssize_t n = sendfile(res->fd, fd, &offset, len < WRITE_STEP_MAX ? len : WRITE_STEP_MAX);
+        if(n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(n <= 0)
+        {
+            return response_fail(res);
+        }
+        response_progress(res);
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int response_send(struct http_response *res, const char *status, const char *mime, const void *body, size_t len)
+{
+    if(response_begin(res, status, mime, (long long)len) != 0)
+    {
+        return -1;
+    }
+    return (body && len) ? response_write(res, body, len) : 0;
+}
+
+static const struct http_response_ops response_ops = {response_header, response_begin, response_write, response_sendfile, response_send};
+
+void http_response_init(struct http_response *res, int fd, struct arena *arena, void (*phase)(int client_fd, int phase))
+{
+    memset(res, 0, sizeof(*res));
+    res->ops   = &response_ops;
+    res->fd    = fd;
+    res->arena = arena;
+    res->phase = phase;
+}
+
+void http_response_error(struct http_response *res, const char *status)
+{
+    char body[STATUS_LINE_MAX];
+    int  len = snprintf(body, sizeof(body), "<html><body><h1>%s</h1></body></html>", status);
+
+    response_send(res, status, "text/html", body, (size_t)len);
+}
@@ -0,0 +1,247 @@
+#include "../include/library.h"
+#include "../include/config.h"
+#include <dlfcn.h>    // dynlib
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+struct library
+{
+    const char      *path;
+    pthread_rwlock_t lock;    // readers are requests in flight, writer is a reload
+    void            *lib;
+    handler_fn       handle;
+    time_t           mtime;
+};
+
+static struct library              libraries[LIBRARY_MAX];                       // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static int                         library_count = 0;                            // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static const struct handler_hooks *library_hooks = NULL;                         // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static const char                 *library_tag   = "";                           // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static pthread_mutex_t             check_lock    = PTHREAD_MUTEX_INITIALIZER;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static int                         check_running = 0;                            // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static pthread_t                   check_thread;                                 // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static pthread_cond_t              check_cond;                                   // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+int library_register(const char *path)
+{
+    pthread_rwlockattr_t attr;
+
+    for(int i = 0; i < library_count; i++)
+    {
+        if(strcmp(libraries[i].path, path) == 0)
+        {
+            return i;
+        }
+    }
+    if(library_count == LIBRARY_MAX)
+    {
+        fprintf(stderr, "library_register: more than %d handler libraries\n", LIBRARY_MAX);
+        return -1;
+    }
+
+    // a waiting reload holds off new requests, otherwise steady traffic would starve it
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    libraries[library_count].path = path;
+    pthread_rwlock_init(&libraries[library_count].lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+    return library_count++;
+}
+
+// caller holds the write lock
+static void library_unload(struct library *library)
+{
+    if(library->lib)
+    {
+        dlclose(library->lib);
+    }
+    library->lib    = NULL;
+    library->handle = NULL;
+}
+
+// caller holds the write lock
+static int library_load(struct library *library)
+{
+    void (*init_handler_func)(void)                          = NULL;
+    void (*set_hooks_func)(const struct handler_hooks *hooks) = NULL;
+    const int *abi_version                                    = NULL;
+
+    library->lib = dlopen(library->path, RTLD_NOW);
+    if(!library->lib)
+    {
+        fprintf(stderr, "%s: Failed to load handler library: %s\n", library_tag, dlerror());
+        return -1;
+    }
+
+    // link handler func
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+    abi_version       = (const int *)dlsym(library->lib, "handler_abi_version");
+    init_handler_func = (void (*)(void))dlsym(library->lib, "init_handler");
+    library->handle   = (handler_fn)dlsym(library->lib, "handle_request");
+    set_hooks_func    = (void (*)(const struct handler_hooks *))dlsym(library->lib, "handler_set_hooks");
+#pragma GCC diagnostic pop
+    if(!abi_version || *abi_version != HANDLER_ABI_VERSION)
+    {
+        fprintf(stderr, "%s: %s was built for another handler ABI\n", library_tag, library->path);
+        library_unload(library);
+        return -1;
+    }
+    if(!library->handle)
+    {
+        fprintf(stderr, "%s: Failed to resolve handler function: %s\n", library_tag, dlerror());
+        library_unload(library);
+        return -1;
+    }
+
+    if(set_hooks_func && library_hooks)
+    {
+        set_hooks_func(library_hooks);
+    }
+    if(init_handler_func)
+    {
+        init_handler_func();
+    }
+    return 0;
+}
+
+// check a library for updates, swap it once its requests in flight are done
+static void library_reload(struct library *library)
+{
+    struct stat lib_stat;
+
+    if(stat(library->path, &lib_stat) != 0 || (library->lib && lib_stat.st_mtime <= library->mtime))
+    {
+        return;
+    }
+
+    pthread_rwlock_wrlock(&library->lock);
+    if(library->lib)
+    {
+        printf("%s: Detected updated handler library %s\n", library_tag, library->path);
+    }
+    library_unload(library);
+    if(library_load(library) == 0)
+    {
+        library->mtime = lib_stat.st_mtime;
+    }
+    pthread_rwlock_unlock(&library->lock);
+}
+
+void library_load_all(const struct handler_hooks *hooks, const char *tag)
+{
+    library_hooks = hooks;
+    library_tag   = tag;
+    library_check();
+}
+
+void library_check(void)
+{
+    for(int i = 0; i < library_count; i++)
+    {
+        library_reload(&libraries[i]);
+    }
+}
+
+// waits on the write lock here, away from the thread that accepts and runs the timer wheel
+static void *library_check_run(void *arg)
+{
+    sigset_t        set;
+    struct timespec deadline;
+
+    (void)arg;
+
+    // leave SIGINT/SIGTERM to the accept thread so select is interrupted
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    pthread_mutex_lock(&check_lock);
+    while(check_running)
+    {
+        pthread_mutex_unlock(&check_lock);
+        library_check();
+        pthread_mutex_lock(&check_lock);
+
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec  += LIBRARY_CHECK_MS / 1000;
+        deadline.tv_nsec += (long)(LIBRARY_CHECK_MS % 1000) * 1000000L;
+        if(deadline.tv_nsec >= 1000000000L)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        while(check_running)
+        {
+            if(pthread_cond_timedwait(&check_cond, &check_lock, &deadline) == ETIMEDOUT)
+            {
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&check_lock);
+    return NULL;
+}
+
+int library_check_start(void)
+{
+    pthread_condattr_t attr;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&check_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    check_running = 1;
+    if(pthread_create(&check_thread, NULL, library_check_run, NULL) != 0)
+    {
+        fprintf(stderr, "library_check_start: pthread_create failed\n");
+        check_running = 0;
+        pthread_cond_destroy(&check_cond);
+        return -1;
+    }
+    return 0;
+}
+
+void library_check_stop(void)
+{
+    pthread_mutex_lock(&check_lock);
+    if(!check_running)
+    {
+        pthread_mutex_unlock(&check_lock);
+        return;
+    }
+    check_running = 0;
+    pthread_cond_signal(&check_cond);
+    pthread_mutex_unlock(&check_lock);
+
+    pthread_join(check_thread, NULL);
+    pthread_cond_destroy(&check_cond);
+}
+
+handler_fn library_acquire(int index)
+{
+    pthread_rwlock_rdlock(&libraries[index].lock);
+    return libraries[index].handle;
+}
+
+void library_release(int index)
+{
+    pthread_rwlock_unlock(&libraries[index].lock);
+}
+
+void library_cleanup(void)
+{
+    for(int i = 0; i < library_count; i++)
+    {
+        pthread_rwlock_wrlock(&libraries[i].lock);
+        library_unload(&libraries[i]);
+        pthread_rwlock_unlock(&libraries[i].lock);
+    }
+}
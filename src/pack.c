@@ -0,0 +1,393 @@
+#include "../include/config.h"
+#include "../include/mime.h"
+#include "../include/pack.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// pack: the docroot as one archive the handler serves without touching the
+// filesystem, a file.gz next to file becomes its precompressed variant
+
+#define PACK_DEFAULT_PATH "public.pack"
+#define PACK_ETAG_SIZE 19    // quoted 16 hex digits and the NUL
+
+struct pack_file
+{
+    char    *path;      // request path
+    char    *source;    // where it is read from
+    uint64_t size;
+    uint64_t hash;
+    char    *gzip_source;
+    uint64_t gzip_size;
+    int      merged;    // a .gz folded into its sibling
+};
+
+struct pack_list
+{
+    struct pack_file *files;
+    size_t            count;
+    size_t            cap;
+};
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-o archive] [-u url_prefix] [dir]\n", name);
+    fprintf(stderr, "  default dir %s, default archive %s\n", HANDLER_PRELOAD_DIR, PACK_DEFAULT_PATH);
+    fprintf(stderr, "  -u prefix of the request paths, default / and the name of dir\n");
+    fprintf(stderr, "  the archive is written next to itself and renamed over it, a running server picks it up\n");
+}
+
+static int pack_add(struct pack_list *list, const char *path, const char *source, uint64_t size)
+{
+    struct pack_file *file;
+
+    if(list->count == list->cap)
+    {
+        size_t            cap   = list->cap ? list->cap * 2 : 64;
+        struct pack_file *grown = (struct pack_file *)realloc(list->files, cap * sizeof(struct pack_file));
+        if(!grown)
+        {
+            perror("pack_add: realloc");
+            return -1;
+        }
+        list->files = grown;
+        list->cap   = cap;
+    }
+
+    file = &list->files[list->count];
+    memset(file, 0, sizeof(*file));
+    file->path   = strdup(path);
+    file->source = strdup(source);
+    file->size   = size;
+    if(!file->path || !file->source)
+    {
+        perror("pack_add: strdup");
+        free(file->path);
+        free(file->source);
+        return -1;
+    }
+    list->count++;
+    return 0;
+}
+
+// regular files below dir, hidden entries skipped
+static int pack_walk(const char *dir, const char *url, struct pack_list *list)
+{
+    const struct dirent *dirent;
+    DIR                 *d      = opendir(dir);
+    int                  result = 0;
+
+    if(!d)
+    {
+        perror(dir);
+        return -1;
+    }
+    while(result == 0 && (dirent = readdir(d)) != NULL)
+    {
+        char        source[PATH_MAX];
+        char        path[PATH_MAX];
+        struct stat st;
+
+        if(dirent->d_name[0] == '.')
+        {
+            continue;
+        }
+        if(snprintf(source, sizeof(source), "%s/%s", dir, dirent->d_name) >= (int)sizeof(source) || snprintf(path, sizeof(path), "%s/%s", url, dirent->d_name) >= (int)sizeof(path))
+        {
+            fprintf(stderr, "pack: %s/%s: path too long\n", dir, dirent->d_name);
+            result = -1;
+        }
+        else if(stat(source, &st) != 0)
+        {
+            perror(source);
+            result = -1;
+        }
+        else if(S_ISDIR(st.st_mode))
+        {
+            result = pack_walk(source, path, list);
+        }
+        else if(S_ISREG(st.st_mode))
+        {
+            result = pack_add(list, path, source, (uint64_t)st.st_size);
+        }
+    }
+    closedir(d);
+    return result;
+}
+
+static int compare_path(const void *a, const void *b)
+{
+    return strcmp(((const struct pack_file *)a)->path, ((const struct pack_file *)b)->path);
+}
+
+static int compare_index(const void *a, const void *b)
+{
+    const struct pack_file *fa = (const struct pack_file *)a;
+    const struct pack_file *fb = (const struct pack_file *)b;
+
+    return pack_compare(fa->hash, fa->path, fb->hash, fb->path);
+}
+
+// file.gz next to file is served for clients that accept gzip, when it is smaller
+static void pack_merge_gzip(struct pack_list *list)
+{
+    size_t kept = 0;
+
+    qsort(list->files, list->count, sizeof(struct pack_file), compare_path);
+    for(size_t i = 0; i < list->count; i++)
+    {
+        struct pack_file *gz  = &list->files[i];
+        size_t            len = strlen(gz->path);
+        char              path[PATH_MAX];
+        struct pack_file  key;
+        struct pack_file *base;
+
+        if(len <= 3 || len >= sizeof(path) || strcmp(gz->path + len - 3, ".gz") != 0)
+        {
+            continue;
+        }
+        memcpy(path, gz->path, len - 3);
+        path[len - 3] = '\0';
+        key.path      = path;
+        base          = (struct pack_file *)bsearch(&key, list->files, list->count, sizeof(struct pack_file), compare_path);
+        if(base && gz->size < base->size)
+        {
+            base->gzip_source = gz->source;
+            base->gzip_size   = gz->size;
+            gz->merged        = 1;
+        }
+    }
+
+    for(size_t i = 0; i < list->count; i++)
+    {
+        if(list->files[i].merged)
+        {
+            free(list->files[i].path);
+            continue;
+        }
+        list->files[kept++] = list->files[i];
+    }
+    list->count = kept;
+}
+
+static uint64_t pack_align(uint64_t offset)
+{
+    return (offset + PACK_ALIGN - 1) / PACK_ALIGN * PACK_ALIGN;
+}
+
+// copies a payload into place and returns its ETag
+static int pack_copy(int out, const char *source, uint64_t size, uint64_t offset, char *etag)
+{
+    char   *data   = (char *)malloc(size ? size : 1);
+    FILE   *in     = fopen(source, "rb");
+    int     result = -1;
+    ssize_t written;
+
+    if(!data || !in)
+    {
+        perror(source);
+    }
+    else if(fread(data, 1, size, in) != size || fgetc(in) != EOF)
+    {
+        fprintf(stderr, "pack: %s changed while packing\n", source);
+    }
+    else if((written = pwrite(out, data, size, (off_t)offset)) < 0 || (uint64_t)written != size)
+    {
+        perror("pack_copy: pwrite");
+    }
+    else
+    {
+        snprintf(etag, PACK_ETAG_SIZE, "\"%016" PRIx64 "\"", pack_hash(data, size));
+        result = 0;
+    }
+    if(in)
+    {
+        fclose(in);
+    }
+    free(data);
+    return result;
+}
+
+static int pack_write(const struct pack_list *list, const char *out_path, uint64_t *total)
+{
+    struct pack_header  header;
+    struct pack_entry  *index;
+    char               *strings;
+    char                tmp_path[PATH_MAX];
+    uint64_t            strings_off = sizeof(header) + (list->count * sizeof(struct pack_entry));
+    uint64_t            strings_len = 0;
+    uint64_t            offset;
+    size_t              at = 0;
+    int                 out;
+    int                 result = 0;
+
+    for(size_t i = 0; i < list->count; i++)
+    {
+        strings_len += strlen(list->files[i].path) + 1 + strlen(mime_type(list->files[i].path)) + 1 + (2 * PACK_ETAG_SIZE);
+    }
+    if(strings_off + strings_len > UINT32_MAX)
+    {
+        fprintf(stderr, "pack: too many files\n");
+        return -1;
+    }
+
+    index   = (struct pack_entry *)calloc(list->count ? list->count : 1, sizeof(struct pack_entry));
+    strings = (char *)calloc(strings_len ? strings_len : 1, 1);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", out_path);
+    out = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if(!index || !strings || out < 0)
+    {
+        perror("pack_write");
+        free(index);
+        free(strings);
+        if(out >= 0)
+        {
+            close(out);
+        }
+        return -1;
+    }
+
+    offset = pack_align(strings_off + strings_len);
+    for(size_t i = 0; i < list->count && result == 0; i++)
+    {
+        const struct pack_file *file  = &list->files[i];
+        struct pack_entry      *entry = &index[i];
+        const char             *mime  = mime_type(file->path);
+
+        entry->hash     = file->hash;
+        entry->path     = (uint32_t)(strings_off + at);
+        entry->path_len = (uint32_t)strlen(file->path);
+        memcpy(strings + at, file->path, entry->path_len + 1);
+        at += entry->path_len + 1;
+        entry->mime = (uint32_t)(strings_off + at);
+        memcpy(strings + at, mime, strlen(mime) + 1);
+        at += strlen(mime) + 1;
+
+        entry->plain.offset = offset;
+        entry->plain.length = file->size;
+        entry->plain.etag   = (uint32_t)(strings_off + at);
+        result              = pack_copy(out, file->source, file->size, offset, strings + at);
+        at += PACK_ETAG_SIZE;
+        offset = pack_align(offset + file->size);
+
+        if(result == 0 && file->gzip_source)
+        {
+            entry->gzip.offset = offset;
+            entry->gzip.length = file->gzip_size;
+            entry->gzip.etag   = (uint32_t)(strings_off + at);
+            result             = pack_copy(out, file->gzip_source, file->gzip_size, offset, strings + at);
+            at += PACK_ETAG_SIZE;
+            offset = pack_align(offset + file->gzip_size);
+        }
+    }
+
+    memset(&header, 0, sizeof(header));
+    header.magic   = PACK_MAGIC;
+    header.version = PACK_VERSION;
+    header.count   = (uint32_t)list->count;
+    header.size    = offset;
+
+    // payloads first, the header last so a half written file is never valid
+    if(result == 0 && (pwrite(out, strings, strings_len, (off_t)strings_off) != (ssize_t)strings_len || pwrite(out, index, list->count * sizeof(struct pack_entry), sizeof(header)) != (ssize_t)(list->count * sizeof(struct pack_entry)) || ftruncate(out, (off_t)offset) != 0 || pwrite(out, &header, sizeof(header), 0) != (ssize_t)sizeof(header) || fsync(out) != 0))
+    {
+        perror("pack_write: write");
+        result = -1;
+    }
+    close(out);
+    free(index);
+    free(strings);
+
+    // a server checking the path sees the old archive or the new one, never a mix
+    if(result == 0 && rename(tmp_path, out_path) != 0)
+    {
+        perror("pack_write: rename");
+        result = -1;
+    }
+    if(result != 0)
+    {
+        unlink(tmp_path);
+    }
+    *total = offset;
+    return result;
+}
+
+int main(int argc, char *argv[])
+{
+    struct pack_list list;
+    const char      *out_path = PACK_DEFAULT_PATH;
+    const char      *dir      = HANDLER_PRELOAD_DIR;
+    const char      *prefix   = NULL;
+    char             url[PATH_MAX];
+    size_t           gzip_count = 0;
+    uint64_t         total;
+    int              opt;
+    int              result;
+
+    while((opt = getopt(argc, argv, "o:u:")) != -1)
+    {
+        switch(opt)
+        {
+            case 'o':
+                out_path = optarg;
+                break;
+            case 'u':
+                prefix = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if(optind < argc)
+    {
+        dir = argv[optind];
+    }
+
+    // request paths are /public/... for the dir public, wherever it is packed from
+    if(prefix)
+    {
+        snprintf(url, sizeof(url), "%s", prefix);
+    }
+    else
+    {
+        const char *name = strrchr(dir, '/');
+        snprintf(url, sizeof(url), "/%s", name && name[1] ? name + 1 : dir);
+    }
+    while(strlen(url) > 0 && url[strlen(url) - 1] == '/')
+    {
+        url[strlen(url) - 1] = '\0';
+    }
+
+    memset(&list, 0, sizeof(list));
+    result = pack_walk(dir, url, &list);
+    if(result == 0)
+    {
+        pack_merge_gzip(&list);
+        for(size_t i = 0; i < list.count; i++)
+        {
+            list.files[i].hash = pack_hash(list.files[i].path, strlen(list.files[i].path));
+            gzip_count += list.files[i].gzip_source != NULL;
+        }
+        qsort(list.files, list.count, sizeof(struct pack_file), compare_index);
+        result = pack_write(&list, out_path, &total);
+    }
+    if(result == 0)
+    {
+        printf("%s: %zu files, %zu gzip variants, %" PRIu64 " bytes, paths under %s/\n", out_path, list.count, gzip_count, total, url);
+    }
+
+    for(size_t i = 0; i < list.count; i++)
+    {
+        free(list.files[i].path);
+        free(list.files[i].source);
+        free(list.files[i].gzip_source);
+    }
+    free(list.files);
+    return result == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,57 @@
+#define _GNU_SOURCE    // strchrnul
+
+#include "../include/path.h"
+#include <string.h>
+
+int path_normalize(const char *path, char *out, size_t size)
+{
+    size_t len = 0;
+
+    while(*path)
+    {
+        const char *end;
+        size_t      seg;
+
+        while(*path == '/')
+        {
+            path++;
+        }
+        end = strchrnul(path, '/');
+        seg = (size_t)(end - path);
+        if(seg == 2 && path[0] == '.' && path[1] == '.')
+        {
+            if(len == 0)
+            {
+                return -1;
+            }
+            while(len > 0 && out[len - 1] != '/')
+            {
+                len--;
+            }
+            if(len > 0)
+            {
+                len--;
+            }
+        }
+        else if(seg > 0 && !(seg == 1 && path[0] == '.'))
+        {
+            if(len + seg + 2 > size)
+            {
+                return -1;
+            }
+            if(len > 0)
+            {
+                out[len++] = '/';
+            }
+            memcpy(out + len, path, seg);
+            len += seg;
+        }
+        path = end;
+    }
+    if(len == 0)
+    {
+        out[len++] = '.';
+    }
+    out[len] = '\0';
+    return 0;
+}
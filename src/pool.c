@@ -0,0 +1,268 @@
+#include "../include/pool.h"
+#include "../include/config.h"
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+struct pool_task
+{
+    pool_task_fn fn;
+    void        *arg;
+};
+
+// ring buffer, owner works on the bottom, thieves take from the top
+struct pool_deque
+{
+    pthread_mutex_t  lock;
+    struct pool_task tasks[POOL_DEQUE_SIZE];
+    size_t           top;
+    size_t           bottom;
+};
+
+struct pool_thread
+{
+    struct pool      *pool;
+    pthread_t         thread;
+    struct pool_deque deque;
+    int               index;
+};
+
+struct pool
+{
+    pthread_mutex_t     lock;    // only guards sleeping
+    pthread_cond_t      cond;
+    atomic_int          pending;
+    atomic_ulong        submits;    // bumped under lock after each push, sleepers wait for a change
+    atomic_uint         next;       // round robin for external submits
+    int                 stop;
+    int                 thread_count;
+    struct pool_thread *threads;
+};
+
+static _Thread_local struct pool_thread *current_thread = NULL;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+static int deque_push(struct pool_deque *dq, pool_task_fn fn, void *arg)
+{
+    int retval = -1;
+
+    pthread_mutex_lock(&dq->lock);
+    if(dq->bottom - dq->top < POOL_DEQUE_SIZE)
+    {
+        dq->tasks[dq->bottom % POOL_DEQUE_SIZE].fn  = fn;
+        dq->tasks[dq->bottom % POOL_DEQUE_SIZE].arg = arg;
+        dq->bottom++;
+        retval = 0;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return retval;
+}
+
+// owner side, newest task first while its data is still in cache
+static int deque_pop(struct pool_deque *dq, struct pool_task *task)
+{
+    int retval = -1;
+
+    pthread_mutex_lock(&dq->lock);
+    if(dq->bottom != dq->top)
+    {
+        dq->bottom--;
+        *task  = dq->tasks[dq->bottom % POOL_DEQUE_SIZE];
+        retval = 0;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return retval;
+}
+
+// thief side, oldest task first
+static int deque_steal(struct pool_deque *dq, struct pool_task *task, int block)
+{
+    int retval = -1;
+
+    if(block)
+    {
+        pthread_mutex_lock(&dq->lock);
+    }
+    else if(pthread_mutex_trylock(&dq->lock) != 0)
+    {
+        return -1;    // owner or another thief is busy here, try elsewhere
+    }
+    if(dq->bottom != dq->top)
+    {
+        *task = dq->tasks[dq->top % POOL_DEQUE_SIZE];
+        dq->top++;
+        retval = 0;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return retval;
+}
+
+static int pool_find_task(struct pool_thread *self, struct pool_task *task, int block)
+{
+    struct pool *pool = self->pool;
+
+    if(deque_pop(&self->deque, task) == 0)
+    {
+        return 0;
+    }
+
+    for(int i = 1; i < pool->thread_count; i++)
+    {
+        struct pool_thread *victim = &pool->threads[(self->index + i) % pool->thread_count];
+        if(deque_steal(&victim->deque, task, block) == 0)
+        {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static void *pool_thread_run(void *arg)
+{
+    struct pool_thread *self = (struct pool_thread *)arg;
+    struct pool        *pool = self->pool;
+    sigset_t            set;
+
+    // leave SIGINT/SIGTERM to the accept thread so select is interrupted
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    current_thread = self;
+
+    while(1)
+    {
+        struct pool_task task;
+        unsigned long    seen = atomic_load(&pool->submits);
+
+        // a locked pass after the trylock one, so a busy deque is not skipped on the way to sleep
+        if(pool_find_task(self, &task, 0) == 0 || (atomic_load(&pool->pending) > 0 && pool_find_task(self, &task, 1) == 0))
+        {
+            atomic_fetch_sub(&pool->pending, 1);
+            task.fn(task.arg);
+            continue;
+        }
+
+        // nothing left that was pushed before seen was read, anything newer bumps submits
+        pthread_mutex_lock(&pool->lock);
+        if(pool->stop && atomic_load(&pool->pending) == 0)
+        {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        while(atomic_load(&pool->submits) == seen && !pool->stop)
+        {
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return NULL;
+}
+
+struct pool *pool_create(int thread_count)
+{
+    struct pool *pool = (struct pool *)calloc(1, sizeof(struct pool));
+    int          started;
+
+    if(!pool)
+    {
+        perror("pool_create: calloc\n");
+        return NULL;
+    }
+
+    pool->threads = (struct pool_thread *)calloc((size_t)thread_count, sizeof(struct pool_thread));
+    if(!pool->threads)
+    {
+        perror("pool_create: calloc\n");
+        free(pool);
+        return NULL;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    atomic_init(&pool->pending, 0);
+    atomic_init(&pool->submits, 0);
+    atomic_init(&pool->next, 0);
+    pool->thread_count = thread_count;
+
+    for(started = 0; started < thread_count; started++)
+    {
+        struct pool_thread *t = &pool->threads[started];
+        t->pool               = pool;
+        t->index              = started;
+        pthread_mutex_init(&t->deque.lock, NULL);
+
+        if(pthread_create(&t->thread, NULL, pool_thread_run, t) != 0)
+        {
+            fprintf(stderr, "pool_create: pthread_create failed\n");
+            break;
+        }
+    }
+
+    if(started < thread_count)
+    {
+        pool->thread_count = started;
+        pool_destroy(pool);
+        return NULL;
+    }
+
+    return pool;
+}
+
+int pool_submit(struct pool *pool, pool_task_fn fn, void *arg)
+{
+    int pushed = -1;
+
+    // counted before the push so a thread taking it right away never drives pending below zero
+    atomic_fetch_add(&pool->pending, 1);
+
+    if(current_thread && current_thread->pool == pool)
+    {
+        // submitted from a pool thread, keep it local
+        pushed = deque_push(&current_thread->deque, fn, arg);
+    }
+
+    for(int i = 0; pushed != 0 && i < pool->thread_count; i++)
+    {
+        unsigned int idx = atomic_fetch_add(&pool->next, 1) % (unsigned int)pool->thread_count;
+        pushed           = deque_push(&pool->threads[idx].deque, fn, arg);
+    }
+
+    if(pushed != 0)
+    {
+        atomic_fetch_sub(&pool->pending, 1);
+        return -1;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    atomic_fetch_add(&pool->submits, 1);
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+void pool_destroy(struct pool *pool)
+{
+    if(!pool)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for(int i = 0; i < pool->thread_count; i++)
+    {
+        pthread_join(pool->threads[i].thread, NULL);
+        pthread_mutex_destroy(&pool->threads[i].deque.lock);
+    }
+
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->threads);
+    free(pool);
+}
@@ -0,0 +1,1060 @@
+#include "../include/proxy.h"
+#include "../include/admission.h"
+#include "../include/chunked.h"
+#include "../include/config.h"
+#include "../include/timer.h"
+#include "../include/trace.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define PROXY_NAME_MAX 128
+#define PROXY_ERROR_SIZE 512
+#define PROXY_HEAD_EXTRA 512    // room for the headers the proxy adds
+#define HEAD_END "\r\n\r\n"
+#define HEAD_END_LEN 4
+#define CHUNK_HEAD_MAX 18    // hex size line in front of a re-framed chunk
+
+struct upstream
+{
+    char                    name[PROXY_NAME_MAX];
+    struct sockaddr_storage addr;
+    socklen_t               addr_len;
+    pthread_mutex_t         lock;    // guards the idle pool and the health fields
+    int                     idle[PROXY_POOL_SIZE];
+    int                     idle_count;
+    int                     fails;
+    uint64_t                down_until_ms;
+    atomic_int              active;
+};
+
+struct proxy_ring_node
+{
+    uint32_t hash;
+    int      upstream;
+};
+
+struct proxy_route
+{
+    const char             *prefix;
+    size_t                  prefix_len;
+    int                     lb;
+    struct upstream        *upstreams;
+    int                     count;
+    atomic_uint             next;
+    struct proxy_ring_node *ring;
+    int                     ring_size;
+};
+
+// what the proxy needs to know about a request or response head
+struct message_info
+{
+    long long content_length;    // -1 when absent
+    int       chunked;
+    int       close;
+    int       keep_alive;
+};
+
+static const struct proxy_route_config route_configs[] = PROXY_ROUTES;
+
+static struct proxy_route *routes      = NULL;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static int                 route_count = 0;       // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+// FNV-1a
+static uint32_t proxy_hash(const void *data, size_t len)
+{
+    const unsigned char *bytes = (const unsigned char *)data;
+    uint32_t             hash  = 2166136261U;
+
+    for(size_t i = 0; i < len; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+static int upstream_resolve(struct upstream *up, const char *spec, size_t len)
+{
+    struct addrinfo  hints;
+    struct addrinfo *res;
+    char            *port;
+    int              err;
+
+    if(len == 0 || len >= PROXY_NAME_MAX)
+    {
+        fprintf(stderr, "upstream_resolve: bad upstream '%.*s'\n", (int)len, spec);
+        return -1;
+    }
+    memcpy(up->name, spec, len);
+    up->name[len] = '\0';
+
+    if(strncmp(up->name, "unix:", 5) == 0)
+    {
+        struct sockaddr_un *un = (struct sockaddr_un *)&up->addr;
+        if(strlen(up->name + 5) >= sizeof(un->sun_path))
+        {
+            fprintf(stderr, "upstream_resolve: socket path too long '%s'\n", up->name);
+            return -1;
+        }
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, up->name + 5);    // NOLINT(clang-analyzer-security.insecureAPI.strcpy)
+        up->addr_len = sizeof(struct sockaddr_un);
+        return 0;
+    }
+
+    port = strrchr(up->name, ':');
+    if(!port)
+    {
+        fprintf(stderr, "upstream_resolve: missing port in '%s'\n", up->name);
+        return -1;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    *port = '\0';
+    err   = getaddrinfo(up->name, port + 1, &hints, &res);
+    *port = ':';
+    if(err != 0)
+    {
+        fprintf(stderr, "upstream_resolve: %s: %s\n", up->name, gai_strerror(err));
+        return -1;
+    }
+    memcpy(&up->addr, res->ai_addr, res->ai_addrlen);
+    up->addr_len = res->ai_addrlen;
+    freeaddrinfo(res);
+    return 0;
+}
+
+static int ring_compare(const void *a, const void *b)
+{
+    uint32_t ha = ((const struct proxy_ring_node *)a)->hash;
+    uint32_t hb = ((const struct proxy_ring_node *)b)->hash;
+    return (ha > hb) - (ha < hb);
+}
+
+static int route_build_ring(struct proxy_route *route)
+{
+    route->ring_size = route->count * PROXY_VNODES;
+    route->ring      = (struct proxy_ring_node *)malloc((size_t)route->ring_size * sizeof(struct proxy_ring_node));
+    if(!route->ring)
+    {
+        perror("route_build_ring: malloc\n");
+        return -1;
+    }
+
+    for(int i = 0; i < route->count; i++)
+    {
+        for(int v = 0; v < PROXY_VNODES; v++)
+        {
+            char key[PROXY_NAME_MAX + 16];
+            int  key_len = snprintf(key, sizeof(key), "%s#%d", route->upstreams[i].name, v);
+
+            route->ring[(i * PROXY_VNODES) + v].hash     = proxy_hash(key, (size_t)key_len);
+            route->ring[(i * PROXY_VNODES) + v].upstream = i;
+        }
+    }
+    qsort(route->ring, (size_t)route->ring_size, sizeof(struct proxy_ring_node), ring_compare);
+    return 0;
+}
+
+static int route_init(struct proxy_route *route, const struct proxy_route_config *config)
+{
+    const char *spec = config->upstreams;
+
+    route->prefix     = config->prefix;
+    route->prefix_len = strlen(config->prefix);
+    route->lb         = config->lb;
+    route->upstreams  = (struct upstream *)calloc(PROXY_MAX_UPSTREAMS, sizeof(struct upstream));
+    route->count      = 0;
+    atomic_init(&route->next, 0);
+    if(!route->upstreams)
+    {
+        perror("route_init: calloc\n");
+        return -1;
+    }
+
+    while(*spec)
+    {
+        size_t           len = strcspn(spec, ",");
+        struct upstream *up  = &route->upstreams[route->count];
+
+        if(route->count == PROXY_MAX_UPSTREAMS)
+        {
+            fprintf(stderr, "route_init: more than %d upstreams for %s\n", PROXY_MAX_UPSTREAMS, route->prefix);
+            return -1;
+        }
+        if(upstream_resolve(up, spec, len) != 0)
+        {
+            return -1;
+        }
+        pthread_mutex_init(&up->lock, NULL);
+        atomic_init(&up->active, 0);
+        route->count++;
+
+        spec += len;
+        if(*spec == ',')
+        {
+            spec++;
+        }
+    }
+
+    if(route->count == 0)
+    {
+        fprintf(stderr, "route_init: no upstreams for %s\n", route->prefix);
+        return -1;
+    }
+    return route_build_ring(route);
+}
+
+int proxy_init(void)
+{
+    int configured = 0;
+
+    while(route_configs[configured].prefix)
+    {
+        configured++;
+    }
+    if(configured == 0)
+    {
+        return 0;
+    }
+
+    routes = (struct proxy_route *)calloc((size_t)configured, sizeof(struct proxy_route));
+    if(!routes)
+    {
+        perror("proxy_init: calloc\n");
+        return -1;
+    }
+
+    for(route_count = 0; route_count < configured; route_count++)
+    {
+        if(route_init(&routes[route_count], &route_configs[route_count]) != 0)
+        {
+            route_count++;
+            proxy_cleanup();
+            return -1;
+        }
+    }
+    return 0;
+}
+
+struct proxy_route *proxy_route_get(int index, const char **prefix)
+{
+    if(index < 0 || index >= route_count)
+    {
+        return NULL;
+    }
+    *prefix = routes[index].prefix;
+    return &routes[index];
+}
+
+static void proxy_error(int client_fd, const char *status)
+{
+    char body[PROXY_ERROR_SIZE];
+    char response[PROXY_ERROR_SIZE * 2];
+    int  body_len = snprintf(body, sizeof(body), "<html><body><h1>%s</h1></body></html>", status);
+    int  len      = snprintf(response, sizeof(response), "HTTP/1.0 %s\r\nContent-Type: text/html\r\nContent-Length: %d\r\nConnection: close\r\n\r\n%s", status, body_len, body);
+
+    http_write_all(client_fd, response, (size_t)len);
+}
+
+static ssize_t find_head_end(const char *buf, size_t len, size_t from)
+{
+    for(size_t i = from; i + HEAD_END_LEN <= len; i++)
+    {
+        if(memcmp(buf + i, HEAD_END, HEAD_END_LEN) == 0)
+        {
+            return (ssize_t)(i + HEAD_END_LEN);
+        }
+    }
+    return -1;
+}
+
+// read until the blank line that ends a head, *have holds the bytes already in buf and
+// on return everything read, the head length is returned
+static ssize_t read_head(int fd, char *buf, size_t cap, size_t *have)
+{
+    ssize_t end = find_head_end(buf, *have, 0);
+
+    while(end < 0)
+    {
+        size_t  from = *have > HEAD_END_LEN ? *have - HEAD_END_LEN : 0;
+        ssize_t n;
+
+        if(*have == cap)
+        {
+            return -1;    // head too large
+        }
+        n = read(fd, buf + *have, cap - *have);
+        if(n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(n <= 0)
+        {
+            return -1;
+        }
+        *have += (size_t)n;
+        end    = find_head_end(buf, *have, from);
+    }
+    return end;
+}
+
+static int header_is(const char *line, size_t name_len, const char *name)
+{
+    return name_len == strlen(name) && strncasecmp(line, name, name_len) == 0;
+}
+
+static int value_has(const char *value, size_t value_len, const char *token)
+{
+    size_t token_len = strlen(token);
+    size_t i         = 0;
+
+    while(i < value_len)
+    {
+        size_t start;
+
+        while(i < value_len && strchr(" \t,", value[i]))
+        {
+            i++;
+        }
+        start = i;
+        while(i < value_len && !strchr(" \t,", value[i]))
+        {
+            i++;
+        }
+        if(i - start == token_len && strncasecmp(value + start, token, token_len) == 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// walk the header lines after the start line, collect info and copy the end-to-end ones to out
+static int copy_headers(const char *head, size_t head_len, char *out, size_t cap, size_t *out_len, struct message_info *info)
+{
+    const char *line = memchr(head, '\n', head_len);
+    const char *end  = head + head_len - 2;    // final CRLF
+
+    info->content_length = -1;
+    info->chunked        = 0;
+    info->close          = 0;
+    info->keep_alive     = 0;
+
+    for(line = line ? line + 1 : end; line < end;)
+    {
+        const char *eol   = memchr(line, '\n', (size_t)(end - line));
+        const char *colon = memchr(line, ':', (size_t)(end - line));
+        size_t      line_len;
+        size_t      name_len;
+        const char *value;
+        size_t      value_len;
+        int         hop_by_hop = 0;
+
+        eol      = eol ? eol + 1 : end;
+        line_len = (size_t)(eol - line);
+        if(!colon || colon > eol)
+        {
+            return -1;
+        }
+        name_len  = (size_t)(colon - line);
+        value     = colon + 1;
+        value_len = (size_t)(eol - value);
+
+        if(header_is(line, name_len, "Content-Length"))
+        {
+            const char *digits = value;
+            char       *digits_end;
+
+            while(digits < eol && (*digits == ' ' || *digits == '\t'))
+            {
+                digits++;
+            }
+            if(digits == eol || *digits < '0' || *digits > '9')
+            {
+                return -1;
+            }
+            // digits only, anything but trailing whitespace would forward the body with the wrong length
+            errno                = 0;
+            info->content_length = strtoll(digits, &digits_end, 10);
+            while(digits_end < eol && (*digits_end == ' ' || *digits_end == '\t' || *digits_end == '\r' || *digits_end == '\n'))
+            {
+                digits_end++;
+            }
+            if(errno == ERANGE || digits_end != eol)
+            {
+                return -1;
+            }
+        }
+        else if(header_is(line, name_len, "Transfer-Encoding"))
+        {
+            info->chunked = value_has(value, value_len, "chunked");
+        }
+        else if(header_is(line, name_len, "Connection") || header_is(line, name_len, "Proxy-Connection"))
+        {
+            info->close      = info->close || value_has(value, value_len, "close");
+            info->keep_alive = info->keep_alive || value_has(value, value_len, "keep-alive");
+            hop_by_hop       = 1;
+        }
+        else if(header_is(line, name_len, "Keep-Alive") || header_is(line, name_len, "Expect"))
+        {
+            // Expect is dropped because the body is streamed right behind the head
+            hop_by_hop = 1;
+        }
+
+        if(out && !hop_by_hop)
+        {
+            if(*out_len + line_len > cap)
+            {
+                return -1;
+            }
+            memcpy(out + *out_len, line, line_len);
+            *out_len += line_len;
+        }
+        line = eol;
+    }
+    return 0;
+}
+
+static int append(char *out, size_t cap, size_t *out_len, const char *fmt, const char *value)
+{
+    int n = snprintf(out + *out_len, cap - *out_len, fmt, value);
+    if(n < 0 || (size_t)n >= cap - *out_len)
+    {
+        return -1;
+    }
+    *out_len += (size_t)n;
+    return 0;
+}
+
+// response bytes to the client, each write that gets through re-arms its write deadline
+static int forward_write(int to, const char *buf, size_t len, const struct handler_hooks *hooks)
+{
+    if(http_write_all(to, buf, len) != 0)
+    {
+        return -1;
+    }
+    if(hooks && hooks->phase)
+    {
+        hooks->phase(to, TIMER_WRITE);
+    }
+    return 0;
+}
+
+static int forward_length(int from, int to, char *buf, size_t cap, size_t have, unsigned long long len, const struct handler_hooks *hooks)
+{
+    if(have > len)
+    {
+        have = (size_t)len;
+    }
+    if(forward_write(to, buf, have, hooks) != 0)
+    {
+        return -1;
+    }
+    len -= have;
+
+    while(len > 0)
+    {
+        ssize_t n = read(from, buf, len < cap ? (size_t)len : cap);
+        if(n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(n <= 0 || forward_write(to, buf, (size_t)n, hooks) != 0)
+        {
+            return -1;
+        }
+        len -= (unsigned long long)n;
+    }
+    return 0;
+}
+
+// pass the chunked body through untouched, decoding only to find where it ends
+static int forward_chunked(int from, int to, char *buf, size_t cap, size_t have, const struct handler_hooks *hooks)
+{
+    struct chunked c;
+    chunked_init(&c);
+
+    while(1)
+    {
+        size_t off = 0;
+
+        while(off < have && !chunked_done(&c))
+        {
+            const char *data;
+            size_t      data_len;
+            ssize_t     used = chunked_parse(&c, buf + off, have - off, &data, &data_len);
+            if(used < 0)
+            {
+                return -1;
+            }
+            off += (size_t)used;
+        }
+        if(forward_write(to, buf, off, hooks) != 0)
+        {
+            return -1;
+        }
+        if(chunked_done(&c))
+        {
+            return 0;
+        }
+
+        do
+        {
+            have = (size_t)read(from, buf, cap);
+        } while(have == (size_t)-1 && errno == EINTR);
+        if(have == 0 || have == (size_t)-1)
+        {
+            return -1;
+        }
+    }
+}
+
+static int forward_until_close(int from, int to, char *buf, size_t cap, size_t have, const struct handler_hooks *hooks)
+{
+    while(1)
+    {
+        ssize_t n;
+
+        if(forward_write(to, buf, have, hooks) != 0)
+        {
+            return -1;
+        }
+        n = read(from, buf, cap);
+        if(n < 0 && errno == EINTR)
+        {
+            n = 0;
+        }
+        else if(n == 0)
+        {
+            return 0;
+        }
+        else if(n < 0)
+        {
+            return -1;
+        }
+        have = (size_t)n;
+    }
+}
+
+static int upstream_down(struct upstream *up, uint64_t now)
+{
+    int down;
+    pthread_mutex_lock(&up->lock);
+    down = up->down_until_ms > now;
+    pthread_mutex_unlock(&up->lock);
+    return down;
+}
+
+// passive health check, enough consecutive failures take the upstream out for a while
+static void upstream_failed(struct upstream *up)
+{
+    pthread_mutex_lock(&up->lock);
+    if(++up->fails >= PROXY_MAX_FAILS)
+    {
+        up->down_until_ms = admission_now_ms() + PROXY_FAIL_TIMEOUT_MS;
+        up->fails         = 0;
+        fprintf(stderr, "Proxy: upstream %s marked down\n", up->name);
+    }
+    pthread_mutex_unlock(&up->lock);
+}
+
+static void upstream_ok(struct upstream *up)
+{
+    pthread_mutex_lock(&up->lock);
+    up->fails = 0;
+    pthread_mutex_unlock(&up->lock);
+}
+
+static struct upstream *proxy_pick(struct proxy_route *route, uint32_t client_hash, uint64_t tried)
+{
+    uint64_t now  = admission_now_ms();
+    int      pick = -1;
+
+    if(route->lb == PROXY_LB_HASH)
+    {
+        int lo = 0;
+        int hi = route->ring_size;
+
+        // first virtual node at or after the client hash, wrapping around
+        while(lo < hi)
+        {
+            int mid = (lo + hi) / 2;
+            if(route->ring[mid].hash < client_hash)
+            {
+                lo = mid + 1;
+            }
+            else
+            {
+                hi = mid;
+            }
+        }
+        for(int i = 0; i < route->ring_size && pick < 0; i++)
+        {
+            int idx = route->ring[(lo + i) % route->ring_size].upstream;
+            if(!(tried & (1ULL << idx)) && !upstream_down(&route->upstreams[idx], now))
+            {
+                pick = idx;
+            }
+        }
+    }
+    else if(route->lb == PROXY_LB_LEAST_CONN)
+    {
+        int least = 0;
+        for(int i = 0; i < route->count; i++)
+        {
+            int active = atomic_load(&route->upstreams[i].active);
+            if(!(tried & (1ULL << i)) && !upstream_down(&route->upstreams[i], now) && (pick < 0 || active < least))
+            {
+                pick  = i;
+                least = active;
+            }
+        }
+    }
+    else
+    {
+        unsigned int start = atomic_fetch_add(&route->next, 1);
+        for(int i = 0; i < route->count && pick < 0; i++)
+        {
+            int idx = (int)((start + (unsigned int)i) % (unsigned int)route->count);
+            if(!(tried & (1ULL << idx)) && !upstream_down(&route->upstreams[idx], now))
+            {
+                pick = idx;
+            }
+        }
+    }
+
+    // everything left is marked down, try one anyway rather than fail outright
+    for(int i = 0; i < route->count && pick < 0; i++)
+    {
+        if(!(tried & (1ULL << i)))
+        {
+            pick = i;
+        }
+    }
+    return pick < 0 ? NULL : &route->upstreams[pick];
+}
+
+static int upstream_connect(struct upstream *up)
+{
+    struct timeval timeout = {PROXY_TIMEOUT_MS / 1000, (PROXY_TIMEOUT_MS % 1000) * 1000};
+    int            opt     = 1;
+    int            fd      = socket(up->addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if(fd < 0)
+    {
+        perror("upstream_connect: socket\n");
+        return -1;
+    }
+
+    // SO_SNDTIMEO also bounds connect
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    if(up->addr.ss_family != AF_UNIX)
+    {
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+    }
+
+    if(connect(fd, (struct sockaddr *)&up->addr, up->addr_len) != 0)
+    {
+        fprintf(stderr, "Proxy: connect to %s failed: %s\n", up->name, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// reuse an idle keep-alive connection if one is still open, else connect
+static int upstream_get(struct upstream *up, int *reused)
+{
+    while(1)
+    {
+        int  fd = -1;
+        char probe;
+
+        pthread_mutex_lock(&up->lock);
+        if(up->idle_count > 0)
+        {
+            fd = up->idle[--up->idle_count];
+        }
+        pthread_mutex_unlock(&up->lock);
+
+        if(fd < 0)
+        {
+            *reused = 0;
+            return upstream_connect(up);
+        }
+
+        // an idle connection must have nothing to read, EOF means the upstream closed it
+        if(recv(fd, &probe, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            *reused = 1;
+            return fd;
+        }
+        close(fd);
+    }
+}
+
+static void upstream_put(struct upstream *up, int fd)
+{
+    pthread_mutex_lock(&up->lock);
+    if(up->idle_count < PROXY_POOL_SIZE)
+    {
+        up->idle[up->idle_count++] = fd;
+        fd                         = -1;
+    }
+    pthread_mutex_unlock(&up->lock);
+
+    if(fd >= 0)
+    {
+        close(fd);
+    }
+}
+
+static int request_header_is_hop(const char *name)
+{
+    // Expect is dropped because the body is streamed right behind the head
+    return strcasecmp(name, "Connection") == 0 || strcasecmp(name, "Proxy-Connection") == 0 || strcasecmp(name, "Keep-Alive") == 0 || strcasecmp(name, "Expect") == 0;
+}
+
+// request line upgraded to 1.1 so the upstream connection can be kept alive
+static int build_request_head(const struct http_request *req, const struct upstream *up, const char *ip, char *out, size_t cap, size_t *out_len)
+{
+    int has_host = 0;
+    int n        = snprintf(out, cap, "%s %s HTTP/1.1\r\n", req->method, req->target);
+
+    if(n < 0 || (size_t)n >= cap)
+    {
+        return -1;
+    }
+    *out_len = (size_t)n;
+
+    for(int i = 0; i < req->header_count; i++)
+    {
+        const struct http_header *header = &req->headers[i];
+
+        if(request_header_is_hop(header->name))
+        {
+            continue;
+        }
+        has_host = has_host || strcasecmp(header->name, "Host") == 0;
+        n        = snprintf(out + *out_len, cap - *out_len, "%s: %s\r\n", header->name, header->value);
+        if(n < 0 || (size_t)n >= cap - *out_len)
+        {
+            return -1;
+        }
+        *out_len += (size_t)n;
+    }
+
+    if(!has_host && append(out, cap, out_len, "Host: %s\r\n", up->name) != 0)
+    {
+        return -1;
+    }
+    if(append(out, cap, out_len, "X-Forwarded-For: %s\r\n", ip) != 0)
+    {
+        return -1;
+    }
+    return append(out, cap, out_len, "%s", "Connection: keep-alive\r\n\r\n");
+}
+
+// client body through its reader, so HTTP_BODY_MAX and the per-read TIMER_BODY
+// apply; a chunked body is framed again as one chunk per read
+static int forward_body(struct http_body *body, int to, char *buf, size_t cap)
+{
+    char   *data = buf + CHUNK_HEAD_MAX;
+    ssize_t n;
+
+    while((n = body->ops->read(body, data, cap - CHUNK_HEAD_MAX - 2)) > 0)
+    {
+        char   size_line[CHUNK_HEAD_MAX + 1];
+        size_t size_len = 0;
+
+        if(body->chunked)
+        {
+            size_len = (size_t)snprintf(size_line, sizeof(size_line), "%zx\r\n", (size_t)n);
+            memcpy(data - size_len, size_line, size_len);
+            memcpy(data + n, "\r\n", 2);
+            n += 2;
+        }
+        if(http_write_all(to, data - size_len, size_len + (size_t)n) != 0)
+        {
+            return -1;
+        }
+    }
+    if(n < 0)
+    {
+        return -1;
+    }
+    return body->chunked ? http_write_all(to, "0\r\n\r\n", 5) : 0;
+}
+
+// safe to send twice, RFC 9110 9.2.2
+static int method_idempotent(const char *method)
+{
+    static const char *const methods[] = {"GET", "HEAD", "OPTIONS", "TRACE", "PUT", "DELETE"};
+
+    for(size_t i = 0; i < sizeof(methods) / sizeof(methods[0]); i++)
+    {
+        if(strcmp(method, methods[i]) == 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int parse_status_line(const char *head, int *minor)
+{
+    if(strncmp(head, "HTTP/1.", 7) != 0 || head[8] != ' ')
+    {
+        return -1;
+    }
+    *minor = head[7] - '0';
+    return (int)strtol(head + 9, NULL, 10);
+}
+
+static void client_identity(int client_fd, char *ip, size_t ip_len, uint32_t *hash)
+{
+    struct sockaddr_storage addr;
+    socklen_t               addr_len = sizeof(addr);
+
+    strcpy(ip, "unknown");    // NOLINT(clang-analyzer-security.insecureAPI.strcpy)
+    *hash = 0;
+    if(getpeername(client_fd, (struct sockaddr *)&addr, &addr_len) != 0)
+    {
+        return;
+    }
+    if(addr.ss_family == AF_INET)
+    {
+        const struct sockaddr_in *in = (const struct sockaddr_in *)&addr;
+        inet_ntop(AF_INET, &in->sin_addr, ip, (socklen_t)ip_len);
+        *hash = proxy_hash(&in->sin_addr, sizeof(in->sin_addr));
+    }
+    else if(addr.ss_family == AF_INET6)
+    {
+        const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)&addr;
+
+        // IPv4 client of the dual-stack listener, forward and hash it as plain IPv4
+        if(IN6_IS_ADDR_V4MAPPED(&in6->sin6_addr))
+        {
+            inet_ntop(AF_INET, &in6->sin6_addr.s6_addr[12], ip, (socklen_t)ip_len);
+            *hash = proxy_hash(&in6->sin6_addr.s6_addr[12], sizeof(struct in_addr));
+            return;
+        }
+        inet_ntop(AF_INET6, &in6->sin6_addr, ip, (socklen_t)ip_len);
+        *hash = proxy_hash(&in6->sin6_addr, sizeof(in6->sin6_addr));
+    }
+}
+
+// stream the response of one upstream back, returns whether the upstream connection can be pooled
+static int proxy_respond(int client_fd, int upstream_fd, const char *method, char *buf, size_t have, ssize_t head_len, const struct handler_hooks *hooks)
+{
+    char                out[PROXY_HEAD_MAX + PROXY_HEAD_EXTRA];
+    size_t              out_len = 0;
+    struct message_info info;
+    const char         *eol;
+    int                 minor;
+    int                 status;
+    int                 reusable;
+    int                 result;
+
+    status = parse_status_line(buf, &minor);
+    eol    = memchr(buf, '\n', (size_t)head_len);
+    if(status < 0 || !eol)
+    {
+        proxy_error(client_fd, "502 Bad Gateway");
+        return 0;
+    }
+
+    // status line as is, hop-by-hop headers replaced, the client connection always closes
+    out_len = (size_t)(eol + 1 - buf);
+    memcpy(out, buf, out_len);
+    if(copy_headers(buf, (size_t)head_len, out, sizeof(out), &out_len, &info) != 0 || append(out, sizeof(out), &out_len, "%s", "Connection: close\r\n\r\n") != 0)
+    {
+        proxy_error(client_fd, "502 Bad Gateway");
+        return 0;
+    }
+
+    if(hooks && hooks->phase)
+    {
+        hooks->phase(client_fd, TIMER_WRITE);
+    }
+    if(http_write_all(client_fd, out, out_len) != 0)
+    {
+        return 0;
+    }
+    trace_current(TRACE_RESPONSE_HEAD);
+    trace_current_status(status);
+
+    have -= (size_t)head_len;
+    memmove(buf, buf + head_len, have);
+    reusable = !info.close && (minor >= 1 || info.keep_alive);
+
+    if(strcmp(method, "HEAD") == 0 || status == 204 || status == 304)
+    {
+        result = 0;
+    }
+    else if(info.chunked)
+    {
+        result = forward_chunked(upstream_fd, client_fd, buf, PROXY_BUFFER_SIZE, have, hooks);
+    }
+    else if(info.content_length >= 0)
+    {
+        result = forward_length(upstream_fd, client_fd, buf, PROXY_BUFFER_SIZE, have, (unsigned long long)info.content_length, hooks);
+    }
+    else
+    {
+        result   = forward_until_close(upstream_fd, client_fd, buf, PROXY_BUFFER_SIZE, have, hooks);
+        reusable = 0;
+    }
+    return result == 0 && reusable;
+}
+
+void proxy_serve(int client_fd, const struct http_request *req, struct proxy_route *route, const struct handler_hooks *hooks)
+{
+    char     buf[PROXY_BUFFER_SIZE];
+    char     ip[INET6_ADDRSTRLEN];
+    uint32_t client_hash;
+    uint64_t tried      = 0;
+    int      streamed   = 0;
+    int      has_body   = req->chunked || req->content_length > 0;
+    int      idempotent = method_idempotent(req->method);
+
+    client_identity(client_fd, ip, sizeof(ip), &client_hash);
+
+    // Expect is not forwarded, so answer it here before reading the body
+    if(has_body && http_body_continue(req->reader) != 0)
+    {
+        return;
+    }
+
+    while(!streamed)
+    {
+        struct upstream *up = proxy_pick(route, client_hash, tried);
+        size_t           out_len;
+        size_t           have;
+        ssize_t          rhead_len;
+        int              upstream_fd;
+        int              reused;
+        int              written;
+        int              sent;
+
+        if(!up)
+        {
+            break;
+        }
+
+        upstream_fd = upstream_get(up, &reused);
+        if(upstream_fd < 0)
+        {
+            upstream_failed(up);
+            tried |= 1ULL << (up - route->upstreams);
+            continue;
+        }
+        atomic_fetch_add(&up->active, 1);
+
+        written = build_request_head(req, up, ip, buf, sizeof(buf), &out_len) == 0;
+        sent    = written && http_write_all(upstream_fd, buf, out_len) == 0;
+
+        if(sent && has_body && !req->chunked && req->body_len >= (size_t)req->content_length)
+        {
+            // all of it came with the head and stays in req->body for another upstream
+            sent = http_write_all(upstream_fd, req->body, (size_t)req->content_length) == 0;
+        }
+        else if(sent && has_body)
+        {
+            // from here the client body is consumed, no retry on another upstream
+            streamed = 1;
+            sent     = forward_body(req->reader, upstream_fd, buf, sizeof(buf)) == 0;
+        }
+
+        if(req->reader->status)
+        {
+            // a bad or too large body is the client's fault, the upstream stays healthy
+            atomic_fetch_sub(&up->active, 1);
+            close(upstream_fd);
+            proxy_error(client_fd, req->reader->status);
+            return;
+        }
+
+        have      = 0;
+        rhead_len = sent ? read_head(upstream_fd, buf, sizeof(buf), &have) : -1;
+
+        // 100 Continue and friends come before the real response
+        while(rhead_len > 0 && strncmp(buf, "HTTP/1.", 7) == 0 && buf[9] == '1')
+        {
+            have -= (size_t)rhead_len;
+            memmove(buf, buf + rhead_len, have);
+            rhead_len = read_head(upstream_fd, buf, sizeof(buf), &have);
+        }
+
+        if(rhead_len < 0)
+        {
+            atomic_fetch_sub(&up->active, 1);
+            close(upstream_fd);
+            if(!(reused && have == 0))
+            {
+                upstream_failed(up);
+                tried |= 1ULL << (up - route->upstreams);
+            }
+            // the upstream may have acted on what it got, only a repeatable request is sent again
+            if(written && !idempotent)
+            {
+                break;
+            }
+            continue;    // a stale pooled connection is retried on a fresh one, a failed upstream on the next
+        }
+
+        upstream_ok(up);
+        if(proxy_respond(client_fd, upstream_fd, req->method, buf, have, rhead_len, hooks))
+        {
+            upstream_put(up, upstream_fd);
+        }
+        else
+        {
+            close(upstream_fd);
+        }
+        atomic_fetch_sub(&up->active, 1);
+        return;
+    }
+
+    proxy_error(client_fd, "502 Bad Gateway");
+}
+
+void proxy_cleanup(void)
+{
+    for(int i = 0; i < route_count; i++)
+    {
+        struct proxy_route *route = &routes[i];
+
+        for(int u = 0; u < route->count; u++)
+        {
+            for(int k = 0; k < route->upstreams[u].idle_count; k++)
+            {
+                close(route->upstreams[u].idle[k]);
+            }
+            pthread_mutex_destroy(&route->upstreams[u].lock);
+        }
+        free(route->upstreams);
+        free(route->ring);
+    }
+    free(routes);
+    routes      = NULL;
+    route_count = 0;
+}
@@ -0,0 +1,664 @@
+#include "../include/bench_util.h"
+#include "../include/capture.h"
+#include "../include/config.h"
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+// replays a capture against one server, or against two one after the other
+// and compares their latency per endpoint
+
+#define REPLAY_MAX_THREADS 1024
+#define REPLAY_TIMEOUT_S 30
+#define REPLAY_LATE_NS 1000000    // sent this much after its time counts as late
+#define REPLAY_KEY_WIDTH 40
+
+static const char connection_close[] = "Connection: close\r\n\r\n";
+
+struct replay_request
+{
+    const char *data;    // head then body
+    uint32_t    head_len;
+    uint32_t    length;
+    uint64_t    time_ns;
+    uint64_t    offset_ns;    // after the first request
+    uint32_t    flags;
+    const char *key;    // "METHOD /path" without the query
+    size_t      key_len;
+};
+
+struct replay_options
+{
+    const char *targets[2];
+    const char *path;
+    int         threads;
+    double      speed;    // 0 as fast as possible
+    int         top;
+    int         skip_truncated;
+    int         list;
+};
+
+// one run of the whole capture against one server
+struct replay_run
+{
+    const char      *name;
+    struct addrinfo *addr;
+    uint32_t        *latency_us;
+    int             *status;    // -1 when the exchange failed
+    double           elapsed;
+    uint64_t         late;
+    uint64_t         max_lag_ns;
+};
+
+struct replay_thread
+{
+    pthread_t                    thread;
+    struct replay_run           *run;
+    const struct replay_request *requests;
+    size_t                       count;
+    _Atomic size_t              *next;
+    uint64_t                     start_ns;
+    double                       speed;
+    uint64_t                     late;
+    uint64_t                     max_lag_ns;
+};
+
+// latency of one endpoint on both runs
+struct replay_endpoint
+{
+    const char *key;
+    size_t      key_len;
+    size_t      count;
+    uint32_t    p50[2];
+    uint32_t    p99[2];
+};
+
+static void sleep_until(uint64_t deadline_ns)
+{
+    struct timespec ts;
+
+    ts.tv_sec  = (time_t)(deadline_ns / 1000000000);
+    ts.tv_nsec = (long)(deadline_ns % 1000000000);
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+    {
+    }
+}
+
+// the captured head without its blank line, Connection: close, then the body
+static int replay_build(const struct replay_request *request, char **buf, size_t *cap, size_t *len)
+{
+    size_t head_len = request->head_len - 2;
+    size_t need     = request->length + sizeof(connection_close);
+
+    if(need > *cap)
+    {
+        char *grown = (char *)realloc(*buf, need);
+        if(!grown)
+        {
+            return -1;
+        }
+        *buf = grown;
+        *cap = need;
+    }
+    memcpy(*buf, request->data, head_len);
+    memcpy(*buf + head_len, connection_close, sizeof(connection_close) - 1);
+    memcpy(*buf + head_len + sizeof(connection_close) - 1, request->data + request->head_len, request->length - request->head_len);
+    *len = request->length - 2 + sizeof(connection_close) - 1;
+    return 0;
+}
+
+// one connection, one request, read until the server closes; returns the status code or -1
+static int replay_once(const struct addrinfo *addr, const char *request, size_t len)
+{
+    struct timeval timeout = {REPLAY_TIMEOUT_S, 0};
+    int            fd      = socket(addr->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int            status;
+
+    if(fd < 0)
+    {
+        return -1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    if(connect(fd, addr->ai_addr, addr->ai_addrlen) != 0 || bench_send_all(fd, request, len) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    status = bench_read_status(fd);
+    close(fd);
+    return status;
+}
+
+static void *replay_worker(void *arg)
+{
+    struct replay_thread *rt  = (struct replay_thread *)arg;
+    char                 *buf = NULL;
+    size_t                cap = 0;
+    size_t                len;
+
+    for(;;)
+    {
+        size_t   i = atomic_fetch_add_explicit(rt->next, 1, memory_order_relaxed);
+        uint64_t start;
+
+        if(i >= rt->count)
+        {
+            break;
+        }
+        if(replay_build(&rt->requests[i], &buf, &cap, &len) != 0)
+        {
+            rt->run->status[i] = -1;
+            continue;
+        }
+
+        // open loop: the request goes out at its time however slow the server is
+        if(rt->speed > 0)
+        {
+            uint64_t due = rt->start_ns + (uint64_t)((double)rt->requests[i].offset_ns / rt->speed);
+
+            sleep_until(due);
+            start = bench_now_ns();
+            if(start - due > REPLAY_LATE_NS)
+            {
+                rt->late++;
+            }
+            if(start - due > rt->max_lag_ns)
+            {
+                rt->max_lag_ns = start - due;
+            }
+        }
+        else
+        {
+            start = bench_now_ns();
+        }
+
+        rt->run->status[i]     = replay_once(rt->run->addr, buf, len);
+        rt->run->latency_us[i] = (uint32_t)((bench_now_ns() - start) / 1000);
+    }
+    free(buf);
+    return NULL;
+}
+
+static int replay_run(struct replay_run *run, const struct replay_request *requests, size_t count, const struct replay_options *opts)
+{
+    struct replay_thread *threads = (struct replay_thread *)calloc((size_t)opts->threads, sizeof(struct replay_thread));
+    _Atomic size_t        next    = 0;
+    uint64_t              start;
+    int                   started = 0;
+
+    if(!threads)
+    {
+        perror("replay_run: calloc");
+        return -1;
+    }
+
+    start = bench_now_ns();
+    for(int i = 0; i < opts->threads; i++)
+    {
+        threads[i].run      = run;
+        threads[i].requests = requests;
+        threads[i].count    = count;
+        threads[i].next     = &next;
+        threads[i].start_ns = start;
+        threads[i].speed    = opts->speed;
+        if(pthread_create(&threads[i].thread, NULL, replay_worker, &threads[i]) != 0)
+        {
+            perror("replay_run: pthread_create");
+            break;
+        }
+        started++;
+    }
+    for(int i = 0; i < started; i++)
+    {
+        pthread_join(threads[i].thread, NULL);
+        run->late += threads[i].late;
+        if(threads[i].max_lag_ns > run->max_lag_ns)
+        {
+            run->max_lag_ns = threads[i].max_lag_ns;
+        }
+    }
+    run->elapsed = (double)(bench_now_ns() - start) / 1e9;
+
+    free(threads);
+    return started > 0 ? 0 : -1;
+}
+
+// successful latencies of the given requests, sorted, returns how many
+static size_t run_latencies(const struct replay_run *run, const size_t *indices, size_t count, uint32_t *out)
+{
+    size_t n = 0;
+
+    for(size_t i = 0; i < count; i++)
+    {
+        if(run->status[indices[i]] >= 0)
+        {
+            out[n++] = run->latency_us[indices[i]];
+        }
+    }
+    qsort(out, n, sizeof(uint32_t), bench_compare_u32);
+    return n;
+}
+
+static int compare_time(const void *a, const void *b)
+{
+    const struct replay_request *x = (const struct replay_request *)a;
+    const struct replay_request *y = (const struct replay_request *)b;
+    return (x->time_ns > y->time_ns) - (x->time_ns < y->time_ns);
+}
+
+// qsort has no context argument
+static const struct replay_request *sort_requests = NULL;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+static int compare_key(const void *a, const void *b)
+{
+    const struct replay_request *x   = &sort_requests[*(const size_t *)a];
+    const struct replay_request *y   = &sort_requests[*(const size_t *)b];
+    size_t                       len = x->key_len < y->key_len ? x->key_len : y->key_len;
+    int                          cmp = memcmp(x->key, y->key, len);
+
+    if(cmp != 0)
+    {
+        return cmp;
+    }
+    return (x->key_len > y->key_len) - (x->key_len < y->key_len);
+}
+
+static int compare_count(const void *a, const void *b)
+{
+    const struct replay_endpoint *x = (const struct replay_endpoint *)a;
+    const struct replay_endpoint *y = (const struct replay_endpoint *)b;
+    return (x->count < y->count) - (x->count > y->count);
+}
+
+// "METHOD /path" out of the request line
+static void request_key(struct replay_request *request)
+{
+    const char *end  = request->data + request->head_len;
+    const char *scan = (const char *)memchr(request->data, ' ', request->head_len);
+
+    scan = scan ? scan + 1 : end;
+    while(scan < end && *scan != ' ' && *scan != '?' && *scan != '\r')
+    {
+        scan++;
+    }
+    request->key     = request->data;
+    request->key_len = (size_t)(scan - request->data);
+}
+
+// whole file in memory, records sorted by arrival
+static struct replay_request *load_capture(const struct replay_options *opts, char **data, size_t *count, size_t *truncated)
+{
+    struct stat                st;
+    struct capture_file_header header;
+    struct replay_request     *requests;
+    size_t                     off = sizeof(header);
+    FILE                      *file = fopen(opts->path, "rb");
+
+    *data      = NULL;
+    *count     = 0;
+    *truncated = 0;
+    if(!file || fstat(fileno(file), &st) != 0 || (size_t)st.st_size < sizeof(header))
+    {
+        fprintf(stderr, "replay: cannot read %s\n", opts->path);
+        if(file)
+        {
+            fclose(file);
+        }
+        return NULL;
+    }
+
+    *data    = (char *)malloc((size_t)st.st_size);
+    requests = (struct replay_request *)malloc((((size_t)st.st_size / sizeof(struct capture_record)) + 1) * sizeof(struct replay_request));
+    if(!*data || !requests || fread(*data, 1, (size_t)st.st_size, file) != (size_t)st.st_size)
+    {
+        fprintf(stderr, "replay: cannot load %s\n", opts->path);
+        fclose(file);
+        free(requests);
+        return NULL;
+    }
+    fclose(file);
+
+    memcpy(&header, *data, sizeof(header));
+    if(header.magic != CAPTURE_MAGIC || header.version != CAPTURE_VERSION)
+    {
+        fprintf(stderr, "replay: %s is not a capture file of this build\n", opts->path);
+        free(requests);
+        return NULL;
+    }
+
+    while(off + sizeof(struct capture_record) <= (size_t)st.st_size)
+    {
+        struct capture_record record;
+
+        memcpy(&record, *data + off, sizeof(record));
+        off += sizeof(record);
+        if(off + record.length > (size_t)st.st_size || record.head_len < 4 || record.head_len > record.length)
+        {
+            fprintf(stderr, "replay: %s ends in a partial record, ignored\n", opts->path);
+            break;
+        }
+        if(record.flags & CAPTURE_TRUNCATED)
+        {
+            (*truncated)++;
+        }
+        if(!(opts->skip_truncated && (record.flags & CAPTURE_TRUNCATED)))
+        {
+            struct replay_request *request = &requests[(*count)++];
+
+            request->data     = *data + off;
+            request->head_len = record.head_len;
+            request->length   = record.length;
+            request->time_ns  = record.time_ns;
+            request->flags    = record.flags;
+            request_key(request);
+        }
+        off += record.length;
+    }
+
+    // workers append in the order they finish, not the order requests arrived
+    qsort(requests, *count, sizeof(struct replay_request), compare_time);
+    for(size_t i = 0; i < *count; i++)
+    {
+        requests[i].offset_ns = requests[i].time_ns - requests[0].time_ns;
+    }
+    return requests;
+}
+
+static void json_string(const char *str, size_t len)
+{
+    putchar('"');
+    for(size_t i = 0; i < len; i++)
+    {
+        unsigned char ch = (unsigned char)str[i];
+        if(ch == '"' || ch == '\\')
+        {
+            printf("\\%c", ch);
+        }
+        else if(ch < 0x20)
+        {
+            printf("\\u%04x", ch);
+        }
+        else
+        {
+            putchar(ch);
+        }
+    }
+    putchar('"');
+}
+
+// the capture as JSON lines, for a look or for other tools
+static void list_capture(const struct replay_request *requests, size_t count)
+{
+    for(size_t i = 0; i < count; i++)
+    {
+        const struct replay_request *request = &requests[i];
+        const char                  *line    = (const char *)memchr(request->data, '\r', request->head_len);
+
+        printf("{\"time_ns\":%llu,\"offset_ms\":%.3f,\"request\":", (unsigned long long)request->time_ns, (double)request->offset_ns / 1e6);
+        json_string(request->data, line ? (size_t)(line - request->data) : 0);
+        printf(",\"endpoint\":");
+        json_string(request->key, request->key_len);
+        printf(",\"head_bytes\":%u,\"body_bytes\":%u,\"truncated\":%s}\n", request->head_len, request->length - request->head_len, (request->flags & CAPTURE_TRUNCATED) ? "true" : "false");
+    }
+}
+
+static void print_run(const char *label, const struct replay_run *run, size_t count, const size_t *all, uint32_t *scratch)
+{
+    size_t errors = 0;
+    size_t ok;
+
+    for(size_t i = 0; i < count; i++)
+    {
+        errors += run->status[i] < 0;
+    }
+    ok = run_latencies(run, all, count, scratch);
+    printf("%s %s: %zu requests in %.1f s (%.0f/s), errors %zu\n", label, run->name, count, run->elapsed, (double)count / run->elapsed, errors);
+    printf("  latency (us): p50 %u, p90 %u, p99 %u, p999 %u, max %u\n", bench_percentile(scratch, ok, 0.50), bench_percentile(scratch, ok, 0.90), bench_percentile(scratch, ok, 0.99), bench_percentile(scratch, ok, 0.999), ok ? scratch[ok - 1] : 0);
+    if(run->max_lag_ns > 0)
+    {
+        printf("  sent late: %llu, max lag %.1f ms%s\n", (unsigned long long)run->late, (double)run->max_lag_ns / 1e6, run->late ? ", raise -c to keep up" : "");
+    }
+}
+
+static void print_endpoints(const struct replay_run *runs, int run_count, const struct replay_request *requests, size_t count, const struct replay_options *opts)
+{
+    size_t                 *order     = (size_t *)malloc(count * sizeof(size_t));
+    uint32_t               *scratch   = (uint32_t *)malloc(count * sizeof(uint32_t));
+    struct replay_endpoint *endpoints = (struct replay_endpoint *)malloc(count * sizeof(struct replay_endpoint));
+    size_t                  endpoint_count = 0;
+
+    if(!order || !scratch || !endpoints)
+    {
+        perror("print_endpoints: malloc");
+        free(order);
+        free(scratch);
+        free(endpoints);
+        return;
+    }
+
+    for(size_t i = 0; i < count; i++)
+    {
+        order[i] = i;
+    }
+    print_run("A", &runs[0], count, order, scratch);
+    if(run_count > 1)
+    {
+        size_t differ = 0;
+
+        print_run("B", &runs[1], count, order, scratch);
+        for(size_t i = 0; i < count; i++)
+        {
+            differ += runs[0].status[i] != runs[1].status[i];
+        }
+        printf("status differs between A and B: %zu\n", differ);
+    }
+
+    // group requests of the same endpoint together
+    sort_requests = requests;
+    qsort(order, count, sizeof(size_t), compare_key);
+    for(size_t from = 0; from < count;)
+    {
+        struct replay_endpoint *endpoint = &endpoints[endpoint_count++];
+        size_t                  to       = from + 1;
+
+        while(to < count && compare_key(&order[from], &order[to]) == 0)
+        {
+            to++;
+        }
+        endpoint->key     = requests[order[from]].key;
+        endpoint->key_len = requests[order[from]].key_len;
+        endpoint->count   = to - from;
+        for(int r = 0; r < run_count; r++)
+        {
+            size_t ok = run_latencies(&runs[r], order + from, to - from, scratch);
+
+            endpoint->p50[r] = bench_percentile(scratch, ok, 0.50);
+            endpoint->p99[r] = bench_percentile(scratch, ok, 0.99);
+        }
+        from = to;
+    }
+    qsort(endpoints, endpoint_count, sizeof(struct replay_endpoint), compare_count);
+
+    printf("\n%-*s %8s %9s %9s", REPLAY_KEY_WIDTH, "endpoint", "count", "A p50", "A p99");
+    if(run_count > 1)
+    {
+        printf(" %9s %9s %8s %8s", "B p50", "B p99", "p50", "p99");
+    }
+    printf("\n");
+    for(size_t i = 0; i < endpoint_count && (opts->top <= 0 || i < (size_t)opts->top); i++)
+    {
+        const struct replay_endpoint *endpoint = &endpoints[i];
+        int                           width    = endpoint->key_len < REPLAY_KEY_WIDTH ? (int)endpoint->key_len : REPLAY_KEY_WIDTH;
+
+        printf("%-*.*s %8zu %9u %9u", REPLAY_KEY_WIDTH, width, endpoint->key, endpoint->count, endpoint->p50[0], endpoint->p99[0]);
+        if(run_count > 1)
+        {
+            printf(" %9u %9u %+7.1f%% %+7.1f%%", endpoint->p50[1], endpoint->p99[1], bench_change(endpoint->p50[0], endpoint->p50[1]), bench_change(endpoint->p99[0], endpoint->p99[1]));
+        }
+        printf("\n");
+    }
+    if(opts->top > 0 && endpoint_count > (size_t)opts->top)
+    {
+        printf("... %zu more endpoints, see -t\n", endpoint_count - (size_t)opts->top);
+    }
+
+    free(order);
+    free(scratch);
+    free(endpoints);
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-a host:port] [-b host:port] [-c connections] [-s speed] [-t top] [-x] [-l] [capture]\n", name);
+    fprintf(stderr, "  default capture %s, default -a localhost:8080\n", CAPTURE_PATH);
+    fprintf(stderr, "  -b replay again against a second server and compare per endpoint\n");
+    fprintf(stderr, "  -c concurrent connections (default 64)\n");
+    fprintf(stderr, "  -s 1 original rate (default), N for N times faster, 0 as fast as possible\n");
+    fprintf(stderr, "  -t endpoints shown, 0 for all (default 20)\n");
+    fprintf(stderr, "  -x skip requests whose body was not captured in full\n");
+    fprintf(stderr, "  -l print the capture as JSON lines instead\n");
+}
+
+static int parse_options(int argc, char *argv[], struct replay_options *opts)
+{
+    int opt;
+
+    opts->targets[0]     = "localhost:8080";
+    opts->targets[1]     = NULL;
+    opts->path           = CAPTURE_PATH;
+    opts->threads        = 64;
+    opts->speed          = 1.0;
+    opts->top            = 20;
+    opts->skip_truncated = 0;
+    opts->list           = 0;
+
+    while((opt = getopt(argc, argv, "a:b:c:s:t:xl")) != -1)
+    {
+        switch(opt)
+        {
+            case 'a':
+                opts->targets[0] = optarg;
+                break;
+            case 'b':
+                opts->targets[1] = optarg;
+                break;
+            case 'c':
+                opts->threads = atoi(optarg);
+                break;
+            case 's':
+                opts->speed = strtod(optarg, NULL);
+                break;
+            case 't':
+                opts->top = atoi(optarg);
+                break;
+            case 'x':
+                opts->skip_truncated = 1;
+                break;
+            case 'l':
+                opts->list = 1;
+                break;
+            default:
+                return -1;
+        }
+    }
+    if(optind < argc)
+    {
+        opts->path = argv[optind];
+    }
+    if(opts->threads < 1 || opts->threads > REPLAY_MAX_THREADS || opts->speed < 0)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    struct replay_options  opts;
+    struct replay_run      runs[2];
+    struct replay_request *requests;
+    char                  *data;
+    size_t                 count;
+    size_t                 truncated;
+    int                    run_count = 0;
+    int                    result    = EXIT_SUCCESS;
+
+    if(parse_options(argc, argv, &opts) != 0)
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    requests = load_capture(&opts, &data, &count, &truncated);
+    if(!requests)
+    {
+        free(data);
+        return EXIT_FAILURE;
+    }
+    if(opts.list)
+    {
+        list_capture(requests, count);
+        free(requests);
+        free(data);
+        return EXIT_SUCCESS;
+    }
+    if(count == 0)
+    {
+        fprintf(stderr, "replay: %s has no requests to replay\n", opts.path);
+        free(requests);
+        free(data);
+        return EXIT_FAILURE;
+    }
+    printf("%s: %zu requests over %.1f s, %zu with truncated bodies%s\n", opts.path, count, (double)requests[count - 1].offset_ns / 1e9, truncated, opts.skip_truncated ? " skipped" : "");
+    if(opts.speed > 0)
+    {
+        printf("  replayed at %gx speed over %.1f s on %d connections\n", opts.speed, (double)requests[count - 1].offset_ns / 1e9 / opts.speed, opts.threads);
+    }
+    else
+    {
+        printf("  replayed as fast as possible on %d connections\n", opts.threads);
+    }
+
+    memset(runs, 0, sizeof(runs));
+    for(int r = 0; r < 2 && opts.targets[r]; r++)
+    {
+        runs[r].name       = opts.targets[r];
+        runs[r].latency_us = (uint32_t *)calloc(count, sizeof(uint32_t));
+        runs[r].status     = (int *)calloc(count, sizeof(int));
+        run_count++;
+        if(!runs[r].latency_us || !runs[r].status || bench_resolve("replay", opts.targets[r], &runs[r].addr) != 0 || replay_run(&runs[r], requests, count, &opts) != 0)
+        {
+            result = EXIT_FAILURE;
+            break;
+        }
+    }
+    if(result == EXIT_SUCCESS)
+    {
+        print_endpoints(runs, run_count, requests, count, &opts);
+    }
+
+    for(int r = 0; r < run_count; r++)
+    {
+        free(runs[r].latency_us);
+        free(runs[r].status);
+        if(runs[r].addr)
+        {
+            freeaddrinfo(runs[r].addr);
+        }
+    }
+    free(requests);
+    free(data);
+    return result;
+}
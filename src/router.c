@@ -0,0 +1,261 @@
+#include "../include/router.h"
+#include "../include/config.h"
+#include "../include/library.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum route_method
+{
+    METHOD_ANY,
+    METHOD_GET,
+    METHOD_HEAD,
+    METHOD_POST,
+    METHOD_PUT,
+    METHOD_DELETE,
+    METHOD_PATCH,
+    METHOD_OPTIONS,
+    METHOD_COUNT
+};
+
+// edge labels point into the configured prefixes, nothing is copied
+struct radix_node
+{
+    const char        *label;
+    size_t             label_len;
+    struct radix_node *child;
+    struct radix_node *sibling;
+    struct route      *routes[METHOD_COUNT];
+};
+
+static const char *const method_names[METHOD_COUNT] = {"*", "GET", "HEAD", "POST", "PUT", "DELETE", "PATCH", "OPTIONS"};
+
+static const struct handler_route_config route_configs[]  = HANDLER_ROUTES;
+static const char *const                 subscribe_prefix = SUBSCRIBE_ROUTE;
+
+static struct radix_node *root   = NULL;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static struct route      *routes = NULL;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+static int method_index(const char *method)
+{
+    for(int i = 0; i < METHOD_COUNT; i++)
+    {
+        if(strcmp(method, method_names[i]) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static struct radix_node *radix_new(const char *label, size_t label_len)
+{
+    struct radix_node *node = (struct radix_node *)calloc(1, sizeof(struct radix_node));
+    if(!node)
+    {
+        perror("radix_new: calloc\n");
+        return NULL;
+    }
+    node->label     = label;
+    node->label_len = label_len;
+    return node;
+}
+
+static int radix_insert(const char *key, int method, struct route *route)
+{
+    struct radix_node *node = root;
+    size_t             len  = strlen(key);
+    size_t             pos  = 0;
+
+    while(pos < len)
+    {
+        struct radix_node **link = &node->child;
+        struct radix_node  *child;
+        size_t              common = 0;
+
+        while(*link && (*link)->label[0] != key[pos])
+        {
+            link = &(*link)->sibling;
+        }
+        child = *link;
+
+        if(!child)
+        {
+            child = radix_new(key + pos, len - pos);
+            if(!child)
+            {
+                return -1;
+            }
+            *link = child;
+            node  = child;
+            break;
+        }
+
+        while(common < child->label_len && pos + common < len && child->label[common] == key[pos + common])
+        {
+            common++;
+        }
+
+        // split the edge where the new key leaves it
+        if(common < child->label_len)
+        {
+            struct radix_node *mid = radix_new(child->label, common);
+            if(!mid)
+            {
+                return -1;
+            }
+            mid->sibling      = child->sibling;
+            mid->child        = child;
+            child->sibling    = NULL;
+            child->label     += common;
+            child->label_len -= common;
+            *link             = mid;
+            child             = mid;
+        }
+
+        node  = child;
+        pos  += common;
+    }
+
+    if(node->routes[method])
+    {
+        fprintf(stderr, "router: duplicate route %s %s, keeping the first\n", method_names[method], key);
+        return 0;
+    }
+    node->routes[method] = route;
+    return 0;
+}
+
+static struct route *radix_best(const struct radix_node *node, int method, struct route *best)
+{
+    if(method > 0 && node->routes[method])
+    {
+        return node->routes[method];
+    }
+    return node->routes[METHOD_ANY] ? node->routes[METHOD_ANY] : best;
+}
+
+const struct route *router_match(const char *method, const char *path)
+{
+    const struct radix_node *node  = root;
+    int                      index = method_index(method);
+    struct route            *best;
+
+    if(!root)
+    {
+        return NULL;
+    }
+
+    // unknown methods can still hit "*" routes
+    if(index < 0)
+    {
+        index = METHOD_ANY;
+    }
+
+    best = radix_best(node, index, NULL);
+    while(*path)
+    {
+        const struct radix_node *child = node->child;
+
+        while(child && child->label[0] != *path)
+        {
+            child = child->sibling;
+        }
+        if(!child || strncmp(path, child->label, child->label_len) != 0)
+        {
+            break;
+        }
+        path += child->label_len;
+        node  = child;
+        best  = radix_best(node, index, best);
+    }
+    return best;
+}
+
+int router_init(void)
+{
+    int                 handler_count = 0;
+    int                 proxy_count   = 0;
+    const char         *prefix;
+    struct proxy_route *proxy;
+
+    while(route_configs[handler_count].method)
+    {
+        handler_count++;
+    }
+    while(proxy_route_get(proxy_count, &prefix))
+    {
+        proxy_count++;
+    }
+
+    root   = radix_new("", 0);
+    routes = (struct route *)calloc((size_t)(handler_count + proxy_count + 1), sizeof(struct route));
+    if(!root || !routes)
+    {
+        router_cleanup();
+        return -1;
+    }
+
+    for(int i = 0; i < handler_count; i++)
+    {
+        int method = method_index(route_configs[i].method);
+
+        routes[i].type    = ROUTE_HANDLER;
+        routes[i].prefix  = route_configs[i].prefix;
+        routes[i].library = library_register(route_configs[i].library);
+        if(method < 0 || routes[i].library < 0 || radix_insert(routes[i].prefix, method, &routes[i]) != 0)
+        {
+            fprintf(stderr, "router_init: bad handler route %s %s\n", route_configs[i].method, route_configs[i].prefix);
+            router_cleanup();
+            return -1;
+        }
+    }
+
+    for(int i = 0; (proxy = proxy_route_get(i, &prefix)) != NULL; i++)
+    {
+        struct route *route = &routes[handler_count + i];
+
+        route->type   = ROUTE_PROXY;
+        route->prefix = prefix;
+        route->proxy  = proxy;
+        if(radix_insert(prefix, METHOD_ANY, route) != 0)
+        {
+            router_cleanup();
+            return -1;
+        }
+    }
+
+    // subscribers only ever GET, other methods fall through to the handlers
+    if(subscribe_prefix)
+    {
+        struct route *route = &routes[handler_count + proxy_count];
+
+        route->type   = ROUTE_SUBSCRIBE;
+        route->prefix = subscribe_prefix;
+        if(radix_insert(subscribe_prefix, METHOD_GET, route) != 0)
+        {
+            router_cleanup();
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void radix_free(struct radix_node *node)
+{
+    while(node)
+    {
+        struct radix_node *sibling = node->sibling;
+        radix_free(node->child);
+        free(node);
+        node = sibling;
+    }
+}
+
+void router_cleanup(void)
+{
+    radix_free(root);
+    free(routes);
+    root   = NULL;
+    routes = NULL;
+}
@@ -5,14 +5,30 @@
 #include <ifaddrs.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <stdio.h>
+#include <string.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
-static int server_socket(void)
+// dual-stack when the host has IPv6, IPv4 clients show up as mapped addresses
+static int server_socket(int *family)
 {
-    int fd  = socket(AF_INET, SOCK_STREAM, 0);    // NOLINT(android-cloexec-socket)
+    int fd  = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     int opt = 1;
+    int off = 0;
+
+    *family = AF_INET6;
+    if(fd >= 0 && setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off)) < 0)
+    {
+        close(fd);
+        fd = -1;
+    }
+    if(fd < 0)
+    {
+        *family = AF_INET;
+        fd      = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    }
     if(fd < 0)
     {
         perror("server_socket: socket\n");
@@ -28,16 +44,47 @@ static int server_socket(void)
     return fd;
 }
 
-static socklen_t server_addr(struct sockaddr_in *addr)
+// both are only hints, the server works without them
+static void server_tune(int fd)
+{
+    int defer    = SERVER_DEFER_ACCEPT;
+    int fastopen = SERVER_FASTOPEN_QUEUE;
+
+    // the connection is only handed to accept once the request has started to arrive
+    if(defer > 0 && setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer, sizeof(defer)) < 0)
+    {
+        perror("server_tune: TCP_DEFER_ACCEPT\n");
+    }
+    // the request can ride on the SYN of a returning client
+    if(fastopen > 0 && setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &fastopen, sizeof(fastopen)) < 0)
+    {
+        perror("server_tune: TCP_FASTOPEN\n");
+    }
+}
+
+static socklen_t server_addr(struct sockaddr_storage *addr, int family)
 {
-    addr->sin_family      = AF_INET;
-    addr->sin_addr.s_addr = INADDR_ANY;
-    addr->sin_port        = htons((in_port_t)PORT);
-    return sizeof(*addr);
+    memset(addr, 0, sizeof(*addr));
+    if(family == AF_INET6)
+    {
+        struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)addr;
+        in6->sin6_family         = AF_INET6;
+        in6->sin6_addr           = in6addr_any;
+        in6->sin6_port           = htons((in_port_t)PORT);
+        return sizeof(*in6);
+    }
+
+    {
+        struct sockaddr_in *in = (struct sockaddr_in *)addr;
+        in->sin_family         = AF_INET;
+        in->sin_addr.s_addr    = INADDR_ANY;
+        in->sin_port           = htons((in_port_t)PORT);
+        return sizeof(*in);
+    }
 }
 
 // cppcheck-suppress constParameterPointer
-static int server_bind(int fd, struct sockaddr_in *addr, socklen_t addr_len)
+static int server_bind(int fd, struct sockaddr_storage *addr, socklen_t addr_len)
 {
     int res = bind(fd, (struct sockaddr *)addr, addr_len);
     if(res != 0)
@@ -50,7 +97,7 @@ static int server_bind(int fd, struct sockaddr_in *addr, socklen_t addr_len)
 
 static int server_listen(int fd)
 {
-    int res = listen(fd, SOMAXCONN);
+    int res = listen(fd, SERVER_BACKLOG);
     if(res != 0)
     {
         perror("server_listen\n");
@@ -61,15 +108,17 @@ static int server_listen(int fd)
 
 int server_init(void)
 {
-    struct sockaddr_in addr;
-    socklen_t          addr_len;
+    struct sockaddr_storage addr;
+    socklen_t               addr_len;
+    int                     family;
 
-    int fd = server_socket();
+    int fd = server_socket(&family);
     if(fd < 0)
     {
         return -1;
     }
-    addr_len = server_addr(&addr);
+    server_tune(fd);
+    addr_len = server_addr(&addr, family);
     if(server_bind(fd, &addr, addr_len) != 0)
     {
         return -1;
@@ -78,7 +127,7 @@ int server_init(void)
     {
         return -1;
     }
-    printf("Server listening on port: %d\n", PORT);
+    printf("Server listening on port: %d (%s)\n", PORT, family == AF_INET6 ? "IPv6 dual-stack" : "IPv4");
     return fd;
 }
 
@@ -91,7 +140,7 @@ int server_run(int fd)
         return -1;
     }
 
-    printf("Server running with %d workers\n", WORKER_COUNT);
+    printf("Server running with %d workers x %d threads\n", WORKER_COUNT, WORKER_THREADS);
     printf("Handler library: %s\n", HANDLER_LIBRARY);
 
     while(1)
@@ -0,0 +1,97 @@
+#include "../include/stats.h"
+#include "../include/config.h"
+#include <inttypes.h>
+#include <stdio.h>
+#include <sys/mman.h>
+
+static struct worker_stats *stats = NULL;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+static const char *const phase_names[TIMER_PHASES] = {"header", "body", "write"};
+
+// pages only this worker maps, and its proportional share of everything, in KiB
+static int stats_memory(int pid, uint64_t *private_kb, uint64_t *pss_kb)
+{
+    char     path[64];
+    char     line[128];
+    uint64_t value;
+    FILE    *file;
+
+    snprintf(path, sizeof(path), "/proc/%d/smaps_rollup", pid);
+    file = fopen(path, "re");
+    if(!file)
+    {
+        return -1;
+    }
+
+    *private_kb = 0;
+    *pss_kb     = 0;
+    while(fgets(line, sizeof(line), file))
+    {
+        if(sscanf(line, "Private_Clean: %" SCNu64, &value) == 1 || sscanf(line, "Private_Dirty: %" SCNu64, &value) == 1)
+        {
+            *private_kb += value;
+        }
+        else if(sscanf(line, "Pss: %" SCNu64, &value) == 1)
+        {
+            *pss_kb = value;
+        }
+    }
+    fclose(file);
+    return 0;
+}
+
+int stats_init(void)
+{
+    void *mem = mmap(NULL, WORKER_COUNT * sizeof(struct worker_stats), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(mem == MAP_FAILED)
+    {
+        perror("stats_init: mmap\n");
+        return -1;
+    }
+    stats = (struct worker_stats *)mem;    // zero filled by mmap
+    return 0;
+}
+
+struct worker_stats *stats_worker(int worker_id)
+{
+    return &stats[worker_id];
+}
+
+void stats_print(void)
+{
+    uint64_t private_kb;
+    uint64_t pss_kb;
+
+    if(!stats)
+    {
+        return;
+    }
+
+    for(int i = 0; i < WORKER_COUNT; i++)
+    {
+        printf("Worker %d stats: accepted %" PRIu64 ", requests %" PRIu64 ", rate limited %" PRIu64 ", overloaded %" PRIu64, i, atomic_load(&stats[i].accepted), atomic_load(&stats[i].requests), atomic_load(&stats[i].rate_limited), atomic_load(&stats[i].overloaded));
+        for(int phase = 0; phase < TIMER_PHASES; phase++)
+        {
+            printf(", %s timeouts %" PRIu64, phase_names[phase], atomic_load(&stats[i].timeouts[phase]));
+        }
+        printf(", arena peak %" PRIu64 " bytes", atomic_load(&stats[i].arena_peak));
+        printf(", ready after %" PRIu64 " us, first request after %" PRIu64 " us", atomic_load(&stats[i].ready_us), atomic_load(&stats[i].first_request_us));
+        printf(", subscribers %" PRIu64 ", pushed %" PRIu64 ", push dropped %" PRIu64, atomic_load(&stats[i].subscribers), atomic_load(&stats[i].pushed), atomic_load(&stats[i].push_dropped));
+        printf(", file cache hits %" PRIu64 ", misses %" PRIu64, atomic_load(&stats[i].file_hits), atomic_load(&stats[i].file_misses));
+        if(stats_memory(atomic_load(&stats[i].pid), &private_kb, &pss_kb) == 0)
+        {
+            printf(", private %" PRIu64 " KiB, pss %" PRIu64 " KiB", private_kb, pss_kb);
+        }
+        printf("\n");
+    }
+    fflush(stdout);
+}
+
+void stats_cleanup(void)
+{
+    if(stats)
+    {
+        munmap(stats, WORKER_COUNT * sizeof(struct worker_stats));
+        stats = NULL;
+    }
+}
@@ -0,0 +1,733 @@
+#define _GNU_SOURCE    // POLLRDHUP
+
+#include "../include/bench_util.h"
+#include "../include/config.h"
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+// healthy clients measured once alone and once next to misbehaving ones, fails
+// when their tail latency or error rate crosses the limits
+
+#define STRESS_MAX_THREADS 1024
+#define STRESS_PAD 256                              // header bytes a slow sender adds, so it outlasts TIMEOUT_HEADER_MS
+#define STRESS_HOLD_MS (TIMEOUT_WRITE_MS + 1000)    // a non-reader keeps its connection this long
+#define STRESS_POST_LENGTH 1048576                  // announced by a disconnect that stops in the body
+#define STRESS_SHED_MAX_PCT 50                      // a baseline shed more than this measures admission control, not the server
+
+enum stress_fault
+{
+    STRESS_SLOW,          // sends its request one byte at a time
+    STRESS_NONREADER,     // asks for a large file and never reads it
+    STRESS_DISCONNECT,    // closes halfway through the head or the body
+    STRESS_RESET,         // sends a request and resets the connection
+    STRESS_KILL,          // SIGKILLs a worker process
+    STRESS_FAULTS
+};
+
+typedef void *(*stress_fn)(void *);
+
+static const char *const fault_names[STRESS_FAULTS] = {"slow senders", "non-readers", "disconnects", "resets", "workers killed"};
+
+struct stress_options
+{
+    const char *target;
+    const char *path;          // asked for by the healthy clients
+    const char *large_path;    // asked for by the non-readers
+    int         duration_s;    // per phase
+    int         clients;
+    int         faults[STRESS_FAULTS];    // threads per fault, STRESS_KILL is on or off
+    int         kill_ms;
+    pid_t       master;
+    int         byte_ms;       // between the bytes of a slow sender
+    int         timeout_ms;    // a healthy request slower than this is an error
+    int         baseline;
+    double      max_p99_ms;
+    double      max_p999_ms;
+    double      max_error_pct;
+};
+
+struct stress_thread
+{
+    pthread_t                    thread;
+    const struct stress_options *opts;
+    const struct addrinfo       *addr;
+    uint32_t                    *latency_us;    // healthy clients only
+    size_t                       count;
+    size_t                       cap;
+    uint64_t                     errors;
+    uint64_t                     shed;      // 429 or 503 from admission control, no latency kept
+    uint64_t                     faults;    // connections made or workers killed
+};
+
+struct stress_result
+{
+    size_t   requests;
+    uint64_t errors;
+    uint64_t shed;
+    double   elapsed;
+    uint32_t p50;
+    uint32_t p99;
+    uint32_t p999;
+    uint32_t max;
+    uint64_t faults[STRESS_FAULTS];
+};
+
+static _Atomic int running = 0;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+static void sleep_ms(int ms)
+{
+    struct timespec ts;
+
+    ts.tv_sec  = ms / 1000;
+    ts.tv_nsec = (long)(ms % 1000) * 1000000;
+    while(nanosleep(&ts, &ts) != 0 && errno == EINTR)
+    {
+    }
+}
+
+// sleeps up to ms, returns early once the phase is over
+static void nap(int ms)
+{
+    while(ms > 0 && atomic_load(&running))
+    {
+        sleep_ms(ms < 100 ? ms : 100);
+        ms -= 100;
+    }
+}
+
+// blocking socket whose connect, reads and writes give up after timeout_ms
+static int stress_connect(const struct addrinfo *addr, int timeout_ms, int rcvbuf)
+{
+    struct timeval timeout = {timeout_ms / 1000, (timeout_ms % 1000) * 1000};
+    int            fd      = socket(addr->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if(fd < 0)
+    {
+        return -1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    if(rcvbuf > 0)
+    {
+        // set before connect so the window the server sees stays small
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    }
+    if(connect(fd, addr->ai_addr, addr->ai_addrlen) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// one request on a fresh connection, read until the server closes; returns the status code or -1
+static int stress_exchange(const struct addrinfo *addr, const char *request, size_t len, int timeout_ms)
+{
+    int fd = stress_connect(addr, timeout_ms, 0);
+    int status;
+
+    if(fd < 0)
+    {
+        return -1;
+    }
+    if(bench_send_all(fd, request, len) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    status = bench_read_status(fd);
+    close(fd);
+    return status;
+}
+
+static int request_build(char *buf, size_t size, const char *method, const char *path, const char *extra)
+{
+    int len = snprintf(buf, size, "%s %s HTTP/1.1\r\nHost: stress\r\nUser-Agent: stress\r\n%sConnection: close\r\n\r\n", method, path, extra);
+
+    return len > 0 && (size_t)len < size ? len : -1;
+}
+
+static int samples_add(struct stress_thread *st, uint32_t latency_us)
+{
+    if(st->count == st->cap)
+    {
+        size_t    cap   = st->cap ? st->cap * 2 : 4096;
+        uint32_t *grown = (uint32_t *)realloc(st->latency_us, cap * sizeof(uint32_t));
+
+        if(!grown)
+        {
+            return -1;
+        }
+        st->latency_us = grown;
+        st->cap        = cap;
+    }
+    st->latency_us[st->count++] = latency_us;
+    return 0;
+}
+
+// closed loop, a failed or non 2xx/3xx exchange counts as an error with its latency kept,
+// a shed one is only counted
+static void *healthy_client(void *arg)
+{
+    struct stress_thread *st = (struct stress_thread *)arg;
+    char                  request[1024];
+    int                   len = request_build(request, sizeof(request), "GET", st->opts->path, "");
+
+    while(len > 0 && atomic_load(&running))
+    {
+        uint64_t start  = bench_now_ns();
+        int      status = stress_exchange(st->addr, request, (size_t)len, st->opts->timeout_ms);
+
+        if(status == 429 || status == 503)
+        {
+            st->shed++;
+            continue;
+        }
+        if(samples_add(st, (uint32_t)((bench_now_ns() - start) / 1000)) != 0)
+        {
+            break;
+        }
+        if(status < 200 || status >= 400)
+        {
+            st->errors++;
+        }
+    }
+    return NULL;
+}
+
+// slowloris: a byte every byte_ms, padded so the head takes longer than the server waits for it
+static void *slow_sender(void *arg)
+{
+    struct stress_thread *st = (struct stress_thread *)arg;
+    char                  pad[STRESS_PAD + 16];
+    char                  request[1024 + STRESS_PAD];
+    int                   len;
+
+    snprintf(pad, sizeof(pad), "X-Pad: %0*d\r\n", STRESS_PAD - 10, 0);
+    len = request_build(request, sizeof(request), "GET", st->opts->path, pad);
+    while(len > 0 && atomic_load(&running))
+    {
+        int fd = stress_connect(st->addr, st->opts->timeout_ms, 0);
+
+        if(fd < 0)
+        {
+            nap(10);
+            continue;
+        }
+        st->faults++;
+        for(int i = 0; i < len && atomic_load(&running); i++)
+        {
+            if(send(fd, request + i, 1, MSG_NOSIGNAL) != 1)
+            {
+                break;
+            }
+            nap(st->opts->byte_ms);
+        }
+        close(fd);
+    }
+    return NULL;
+}
+
+// keeps the server writing into a full window until it gives up or STRESS_HOLD_MS passes
+static void *non_reader(void *arg)
+{
+    struct stress_thread *st = (struct stress_thread *)arg;
+    char                  request[1024];
+    int                   len = request_build(request, sizeof(request), "GET", st->opts->large_path, "");
+
+    while(len > 0 && atomic_load(&running))
+    {
+        int           fd = stress_connect(st->addr, st->opts->timeout_ms, 4096);
+        struct pollfd pfd;
+        uint64_t      until;
+
+        if(fd < 0 || bench_send_all(fd, request, (size_t)len) != 0)
+        {
+            if(fd >= 0)
+            {
+                close(fd);
+            }
+            nap(10);
+            continue;
+        }
+        st->faults++;
+        pfd.fd     = fd;
+        pfd.events = POLLRDHUP;
+        until      = bench_now_ns() + ((uint64_t)STRESS_HOLD_MS * 1000000);
+        while(atomic_load(&running) && bench_now_ns() < until)
+        {
+            // a reset from the server ends the hold early, its FIN sits behind the unread data
+            if(poll(&pfd, 1, 100) > 0 && (pfd.revents & (POLLERR | POLLHUP | POLLRDHUP)))
+            {
+                break;
+            }
+        }
+        close(fd);
+    }
+    return NULL;
+}
+
+// stops in the middle of a head, or in the body of a POST that announced much more
+static void *disconnecter(void *arg)
+{
+    struct stress_thread *st = (struct stress_thread *)arg;
+    char                  head[1024];
+    char                  post[1024];
+    char                  length[128];
+    int                   head_len;
+    int                   post_len;
+
+    snprintf(length, sizeof(length), "Content-Type: application/x-www-form-urlencoded\r\nContent-Length: %d\r\n", STRESS_POST_LENGTH);
+    head_len = request_build(head, sizeof(head), "GET", st->opts->path, "");
+    post_len = request_build(post, sizeof(post), "POST", "/", length);
+    if(post_len > 0 && (size_t)post_len + 16 < sizeof(post))
+    {
+        memcpy(post + post_len, "stress=partial&", 15);
+        post_len += 15;
+    }
+    for(uint64_t i = 0; head_len > 0 && post_len > 0 && atomic_load(&running); i++)
+    {
+        int fd = stress_connect(st->addr, st->opts->timeout_ms, 0);
+
+        if(fd >= 0)
+        {
+            st->faults++;
+            if(i % 2 == 0)
+            {
+                bench_send_all(fd, head, (size_t)head_len / 2);
+            }
+            else
+            {
+                bench_send_all(fd, post, (size_t)post_len);
+            }
+            close(fd);
+        }
+        nap(5);
+    }
+    return NULL;
+}
+
+// a full request, then SO_LINGER 0 so close sends RST while the server is answering
+static void *resetter(void *arg)
+{
+    struct stress_thread *st     = (struct stress_thread *)arg;
+    struct linger         linger = {1, 0};
+    char                  request[1024];
+    int                   len = request_build(request, sizeof(request), "GET", st->opts->large_path, "");
+
+    while(len > 0 && atomic_load(&running))
+    {
+        int fd = stress_connect(st->addr, st->opts->timeout_ms, 0);
+
+        if(fd < 0)
+        {
+            nap(1);
+            continue;
+        }
+        st->faults++;
+        bench_send_all(fd, request, (size_t)len);
+        setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+        close(fd);
+    }
+    return NULL;
+}
+
+// processes whose parent is master, read from /proc/<pid>/stat
+static int find_workers(pid_t master, pid_t *pids, int max)
+{
+    DIR                 *proc = opendir("/proc");
+    const struct dirent *entry;
+    int                  count = 0;
+
+    if(!proc)
+    {
+        return 0;
+    }
+    while(count < max && (entry = readdir(proc)) != NULL)
+    {
+        char  path[300];
+        char  stat[512];
+        FILE *file;
+        char *end;
+        int   ppid;
+
+        if(!isdigit((unsigned char)entry->d_name[0]))
+        {
+            continue;
+        }
+        snprintf(path, sizeof(path), "/proc/%s/stat", entry->d_name);
+        file = fopen(path, "r");
+        if(!file)
+        {
+            continue;
+        }
+        // the command name may hold spaces and parentheses, the fields follow the last one
+        if(fgets(stat, sizeof(stat), file) && (end = strrchr(stat, ')')) != NULL && sscanf(end + 1, " %*c %d", &ppid) == 1 && ppid == master)
+        {
+            pids[count++] = (pid_t)atoi(entry->d_name);
+        }
+        fclose(file);
+    }
+    closedir(proc);
+    return count;
+}
+
+// a random worker of the master every kill_ms, worker_monitor is expected to fork a new one
+static void *worker_killer(void *arg)
+{
+    struct stress_thread *st   = (struct stress_thread *)arg;
+    unsigned int          seed = (unsigned int)bench_now_ns();
+
+    for(nap(st->opts->kill_ms); atomic_load(&running); nap(st->opts->kill_ms))
+    {
+        pid_t pids[64];
+        int   count = find_workers(st->opts->master, pids, 64);
+
+        if(count == 0)
+        {
+            fprintf(stderr, "stress: no worker of %d to kill\n", (int)st->opts->master);
+            continue;
+        }
+        if(kill(pids[rand_r(&seed) % (unsigned int)count], SIGKILL) == 0)
+        {
+            st->faults++;
+        }
+        else
+        {
+            perror("stress: kill");
+        }
+    }
+    return NULL;
+}
+
+static const stress_fn fault_threads[STRESS_FAULTS] = {slow_sender, non_reader, disconnecter, resetter, worker_killer};
+
+// runs the healthy clients for duration_s, next to the faults when with_faults is set
+static int stress_phase(const struct stress_options *opts, const struct addrinfo *addr, int with_faults, struct stress_result *result)
+{
+    struct stress_thread *threads;
+    uint32_t             *all;
+    int                   total   = opts->clients;
+    int                   started = 0;
+    int                   sorted  = 0;
+    uint64_t              start;
+
+    for(int f = 0; f < STRESS_FAULTS && with_faults; f++)
+    {
+        total += opts->faults[f];
+    }
+    threads = (struct stress_thread *)calloc((size_t)total, sizeof(struct stress_thread));
+    if(!threads)
+    {
+        perror("stress_phase: calloc");
+        return -1;
+    }
+
+    memset(result, 0, sizeof(*result));
+    atomic_store(&running, 1);
+    start = bench_now_ns();
+    for(int i = 0; i < total; i++)
+    {
+        stress_fn fn = healthy_client;
+        int       at = opts->clients;
+
+        for(int f = 0; f < STRESS_FAULTS && i >= at; f++)
+        {
+            fn  = fault_threads[f];
+            at += opts->faults[f];
+        }
+        threads[i].opts = opts;
+        threads[i].addr = addr;
+        if(pthread_create(&threads[i].thread, NULL, fn, &threads[i]) != 0)
+        {
+            perror("stress_phase: pthread_create");
+            break;
+        }
+        started++;
+    }
+    if(started == total)
+    {
+        sleep_ms(opts->duration_s * 1000);
+    }
+    atomic_store(&running, 0);
+
+    for(int i = 0; i < started; i++)
+    {
+        pthread_join(threads[i].thread, NULL);
+        result->requests += threads[i].count;
+        result->errors   += threads[i].errors;
+        result->shed     += threads[i].shed;
+    }
+    result->elapsed = (double)(bench_now_ns() - start) / 1e9;
+
+    // the same split as at start, thread i ran fault f when it is past the clients before it
+    for(int i = opts->clients, f = 0; i < started && f < STRESS_FAULTS; f++)
+    {
+        for(int n = 0; n < opts->faults[f] && i < started; n++, i++)
+        {
+            result->faults[f] += threads[i].faults;
+        }
+    }
+
+    all = (uint32_t *)malloc((result->requests ? result->requests : 1) * sizeof(uint32_t));
+    if(all)
+    {
+        size_t at = 0;
+
+        for(int i = 0; i < opts->clients && i < started; i++)
+        {
+            memcpy(all + at, threads[i].latency_us, threads[i].count * sizeof(uint32_t));
+            at += threads[i].count;
+        }
+        qsort(all, at, sizeof(uint32_t), bench_compare_u32);
+        result->p50  = bench_percentile(all, at, 0.50);
+        result->p99  = bench_percentile(all, at, 0.99);
+        result->p999 = bench_percentile(all, at, 0.999);
+        result->max  = at ? all[at - 1] : 0;
+        sorted       = 1;
+    }
+    for(int i = 0; i < started; i++)
+    {
+        free(threads[i].latency_us);
+    }
+    free(all);
+    free(threads);
+    return started == total && sorted ? 0 : -1;
+}
+
+static double error_pct(const struct stress_result *result)
+{
+    return result->requests ? 100.0 * (double)result->errors / (double)result->requests : 100.0;
+}
+
+static double shed_pct(const struct stress_result *result)
+{
+    uint64_t total = result->requests + result->shed;
+
+    return total ? 100.0 * (double)result->shed / (double)total : 0.0;
+}
+
+static void print_result(const char *label, const struct stress_result *result, int with_faults)
+{
+    printf("%s: %zu requests in %.1f s (%.0f/s), errors %llu (%.2f%%), shed %llu (%.2f%%)\n", label, result->requests, result->elapsed, (double)result->requests / result->elapsed, (unsigned long long)result->errors, error_pct(result), (unsigned long long)result->shed, shed_pct(result));
+    printf("  latency (us): p50 %u, p99 %u, p999 %u, max %u\n", result->p50, result->p99, result->p999, result->max);
+    if(with_faults)
+    {
+        printf("  faults:");
+        for(int f = 0; f < STRESS_FAULTS; f++)
+        {
+            printf("%s %s %llu", f ? "," : "", fault_names[f], (unsigned long long)result->faults[f]);
+        }
+        printf("\n");
+    }
+}
+
+// every limit is checked and reported, returns how many were exceeded
+static int check_limits(const struct stress_result *result, const struct stress_options *opts)
+{
+    int failed = 0;
+
+    if((double)result->p99 / 1000.0 > opts->max_p99_ms)
+    {
+        printf("FAIL: p99 %.1f ms above %.1f ms\n", (double)result->p99 / 1000.0, opts->max_p99_ms);
+        failed++;
+    }
+    if((double)result->p999 / 1000.0 > opts->max_p999_ms)
+    {
+        printf("FAIL: p999 %.1f ms above %.1f ms\n", (double)result->p999 / 1000.0, opts->max_p999_ms);
+        failed++;
+    }
+    if(error_pct(result) > opts->max_error_pct)
+    {
+        printf("FAIL: error rate %.2f%% above %.2f%%\n", error_pct(result), opts->max_error_pct);
+        failed++;
+    }
+    if(!failed)
+    {
+        printf("PASS: p99 %.1f ms, p999 %.1f ms, error rate %.2f%% within limits\n", (double)result->p99 / 1000.0, (double)result->p999 / 1000.0, error_pct(result));
+    }
+    return failed;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-a host:port] [-u path] [-g path] [-d seconds] [-c clients] [-s slow] [-n non_readers] [-x disconnects] [-r resets] [-k ms -m master_pid] [-b ms] [-w ms] [-B] [-p ms] [-P ms] [-e percent]\n", name);
+    fprintf(stderr, "  default -a localhost:8080, -u /public/index.html for the healthy clients, -g /public/darcy.png for the faults\n");
+    fprintf(stderr, "  -d seconds per phase, a baseline without faults and then one with them (default 10)\n");
+    fprintf(stderr, "  -c healthy clients, each a closed loop of one request per connection (default 16)\n");
+    fprintf(stderr, "  -s clients sending one byte every -b ms (default 8, 100 ms)\n");
+    fprintf(stderr, "  -n clients that never read the response to -g (default 8)\n");
+    fprintf(stderr, "  -x clients closing in the middle of a head or a body (default 4)\n");
+    fprintf(stderr, "  -r clients resetting the connection after the request (default 2)\n");
+    fprintf(stderr, "  -k SIGKILL a random child of -m every ms (default off)\n");
+    fprintf(stderr, "  -w healthy request timeout in ms, counted as an error (default 5000)\n");
+    fprintf(stderr, "  -B skip the baseline\n");
+    fprintf(stderr, "  -p, -P, -e limits on the faulted phase: p99 ms (default 200), p999 ms (default 1000), error percent (default 1)\n");
+    fprintf(stderr, "  exits with 1 when a limit is exceeded\n");
+}
+
+static int parse_options(int argc, char *argv[], struct stress_options *opts)
+{
+    int opt;
+
+    memset(opts, 0, sizeof(*opts));
+    opts->target                    = "localhost:8080";
+    opts->path                      = "/public/index.html";
+    opts->large_path                = "/public/darcy.png";
+    opts->duration_s                = 10;
+    opts->clients                   = 16;
+    opts->faults[STRESS_SLOW]       = 8;
+    opts->faults[STRESS_NONREADER]  = 8;
+    opts->faults[STRESS_DISCONNECT] = 4;
+    opts->faults[STRESS_RESET]      = 2;
+    opts->byte_ms                   = 100;
+    opts->timeout_ms                = 5000;
+    opts->baseline                  = 1;
+    opts->max_p99_ms                = 200;
+    opts->max_p999_ms               = 1000;
+    opts->max_error_pct             = 1;
+
+    while((opt = getopt(argc, argv, "a:u:g:d:c:s:n:x:r:k:m:b:w:Bp:P:e:")) != -1)
+    {
+        switch(opt)
+        {
+            case 'a':
+                opts->target = optarg;
+                break;
+            case 'u':
+                opts->path = optarg;
+                break;
+            case 'g':
+                opts->large_path = optarg;
+                break;
+            case 'd':
+                opts->duration_s = atoi(optarg);
+                break;
+            case 'c':
+                opts->clients = atoi(optarg);
+                break;
+            case 's':
+                opts->faults[STRESS_SLOW] = atoi(optarg);
+                break;
+            case 'n':
+                opts->faults[STRESS_NONREADER] = atoi(optarg);
+                break;
+            case 'x':
+                opts->faults[STRESS_DISCONNECT] = atoi(optarg);
+                break;
+            case 'r':
+                opts->faults[STRESS_RESET] = atoi(optarg);
+                break;
+            case 'k':
+                opts->kill_ms = atoi(optarg);
+                break;
+            case 'm':
+                opts->master = (pid_t)atoi(optarg);
+                break;
+            case 'b':
+                opts->byte_ms = atoi(optarg);
+                break;
+            case 'w':
+                opts->timeout_ms = atoi(optarg);
+                break;
+            case 'B':
+                opts->baseline = 0;
+                break;
+            case 'p':
+                opts->max_p99_ms = strtod(optarg, NULL);
+                break;
+            case 'P':
+                opts->max_p999_ms = strtod(optarg, NULL);
+                break;
+            case 'e':
+                opts->max_error_pct = strtod(optarg, NULL);
+                break;
+            default:
+                return -1;
+        }
+    }
+    if(opts->kill_ms > 0 && opts->master <= 0)
+    {
+        fprintf(stderr, "stress: -k needs the master pid in -m\n");
+        return -1;
+    }
+    opts->faults[STRESS_KILL] = opts->kill_ms > 0;
+    if(opts->duration_s < 1 || opts->clients < 1 || opts->byte_ms < 1 || opts->timeout_ms < 1)
+    {
+        return -1;
+    }
+    for(int f = 0, total = opts->clients; f < STRESS_FAULTS; f++)
+    {
+        total += opts->faults[f];
+        if(opts->faults[f] < 0 || total > STRESS_MAX_THREADS)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    struct stress_options opts;
+    struct stress_result  baseline;
+    struct stress_result  faulted;
+    struct addrinfo      *addr;
+    int                   failed;
+
+    if(parse_options(argc, argv, &opts) != 0)
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if(bench_resolve("stress", opts.target, &addr) != 0)
+    {
+        return EXIT_FAILURE;
+    }
+    printf("%s: %d healthy clients on %s, %d s per phase\n", opts.target, opts.clients, opts.path, opts.duration_s);
+
+    if(opts.baseline)
+    {
+        if(stress_phase(&opts, addr, 0, &baseline) != 0)
+        {
+            freeaddrinfo(addr);
+            return EXIT_FAILURE;
+        }
+        print_result("baseline", &baseline, 0);
+        if(shed_pct(&baseline) > STRESS_SHED_MAX_PCT)
+        {
+            fprintf(stderr, "stress: %.0f%% of the baseline got 429 or 503, raise ADMISSION_RATE and ADMISSION_BURST or lower -c\n", shed_pct(&baseline));
+            freeaddrinfo(addr);
+            return EXIT_FAILURE;
+        }
+    }
+    if(stress_phase(&opts, addr, 1, &faulted) != 0)
+    {
+        freeaddrinfo(addr);
+        return EXIT_FAILURE;
+    }
+    print_result("faulted", &faulted, 1);
+    if(opts.baseline)
+    {
+        printf("  against baseline: p99 %+.1f%%, p999 %+.1f%%, error rate %+.2f points\n", bench_change(baseline.p99, faulted.p99), bench_change(baseline.p999, faulted.p999), error_pct(&faulted) - error_pct(&baseline));
+    }
+
+    failed = check_limits(&faulted, &opts);
+    freeaddrinfo(addr);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,929 @@
+#include "../include/subscribe.h"
+#include "../include/admission.h"
+#include "../include/broadcast.h"
+#include "../include/config.h"
+#include "../include/stats.h"
+#include "../include/trace.h"
+#include <errno.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define SUBSCRIBE_BATCH 65536                    // bytes of frames gathered per send
+#define SUBSCRIBE_EVENTS 64                      // epoll events per wakeup
+#define SUBSCRIBE_SWEEP_MS 1000                  // heartbeat and stall checks
+#define SUBSCRIBE_KEY_MAX 64                     // Sec-WebSocket-Key, 24 when well formed
+#define SSE_FRAME_MAX(len) (32 + ((len) * 7))    // "id: N\ndata: " and every line break becoming "\ndata: "
+#define WS_FRAME_HEAD_MAX 10
+#define DROPPED_FRAME_MAX 64    // event: dropped, or the same notice as a WebSocket text frame
+#define WS_CONTROL_MAX 125
+#define WS_INPUT_MAX (14 + WS_CONTROL_MAX)    // longest client frame head plus a control payload
+#define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+#define SHA1_DIGEST 20
+
+enum ws_opcode
+{
+    WS_CONTINUATION = 0x0,
+    WS_TEXT         = 0x1,
+    WS_BINARY       = 0x2,
+    WS_CLOSE        = 0x8,
+    WS_PING         = 0x9,
+    WS_PONG         = 0xA,
+};
+
+struct subscriber
+{
+    int                fd;
+    int                websocket;
+    int                closing;
+    uint64_t           cursor;                 // sequence number of the next message to send
+    uint64_t           unannounced;            // messages skipped that the client was not told about yet
+    char              *pending;                // rest of a batch the socket did not take
+    size_t             pending_len;
+    size_t             pending_off;
+    uint64_t           blocked_ms;             // when pending was stashed
+    uint64_t           active_ms;              // last time anything was sent
+    unsigned char      input[WS_INPUT_MAX];    // partial client frame
+    size_t             input_len;
+    uint64_t           input_skip;             // payload left of an ignored data frame
+    struct subscriber *next;
+};
+
+static pthread_t            subscribe_thread;                             // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static pthread_mutex_t      subscribe_lock = PTHREAD_MUTEX_INITIALIZER;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static struct subscriber   *subscribers    = NULL;                        // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static struct worker_stats *stats          = NULL;                        // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static int                  epoll_fd       = -1;                          // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static int                  worker         = -1;                          // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static atomic_int           running        = 0;                           // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static atomic_int           count          = 0;                           // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+static uint32_t sha1_rotl(uint32_t x, int n)
+{
+    return (x << n) | (x >> (32 - n));
+}
+
+static void sha1_block(uint32_t h[5], const unsigned char *p)
+{
+    uint32_t w[80];
+    uint32_t a = h[0];
+    uint32_t b = h[1];
+    uint32_t c = h[2];
+    uint32_t d = h[3];
+    uint32_t e = h[4];
+
+    for(int i = 0; i < 16; i++)
+    {
+        w[i] = ((uint32_t)p[4 * i] << 24) | ((uint32_t)p[(4 * i) + 1] << 16) | ((uint32_t)p[(4 * i) + 2] << 8) | (uint32_t)p[(4 * i) + 3];
+    }
+    for(int i = 16; i < 80; i++)
+    {
+        w[i] = sha1_rotl(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+    }
+
+    for(int i = 0; i < 80; i++)
+    {
+        uint32_t f;
+        uint32_t k;
+        uint32_t t;
+
+        if(i < 20)
+        {
+            f = (b & c) | (~b & d);
+            k = 0x5A827999;
+        }
+        else if(i < 40)
+        {
+            f = b ^ c ^ d;
+            k = 0x6ED9EBA1;
+        }
+        else if(i < 60)
+        {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8F1BBCDC;
+        }
+        else
+        {
+            f = b ^ c ^ d;
+            k = 0xCA62C1D6;
+        }
+        t = sha1_rotl(a, 5) + f + e + k + w[i];
+        e = d;
+        d = c;
+        c = sha1_rotl(b, 30);
+        b = a;
+        a = t;
+    }
+
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+}
+
+// only ever hashes a WebSocket key, not worth a crypto library
+static void sha1(const unsigned char *data, size_t len, unsigned char digest[SHA1_DIGEST])
+{
+    uint32_t      h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+    unsigned char block[64];
+    uint64_t      bits = (uint64_t)len * 8;
+    size_t        off  = 0;
+    size_t        rest;
+
+    for(; len - off >= sizeof(block); off += sizeof(block))
+    {
+        sha1_block(h, data + off);
+    }
+
+    rest = len - off;
+    memset(block, 0, sizeof(block));
+    memcpy(block, data + off, rest);
+    block[rest] = 0x80;
+    if(rest >= 56)
+    {
+        sha1_block(h, block);
+        memset(block, 0, sizeof(block));
+    }
+    for(int i = 0; i < 8; i++)
+    {
+        block[63 - i] = (unsigned char)(bits >> (8 * i));
+    }
+    sha1_block(h, block);
+
+    for(int i = 0; i < 5; i++)
+    {
+        digest[4 * i]       = (unsigned char)(h[i] >> 24);
+        digest[(4 * i) + 1] = (unsigned char)(h[i] >> 16);
+        digest[(4 * i) + 2] = (unsigned char)(h[i] >> 8);
+        digest[(4 * i) + 3] = (unsigned char)h[i];
+    }
+}
+
+// out needs 4 * ((len + 2) / 3) + 1 bytes
+static void base64_encode(const unsigned char *in, size_t len, char *out)
+{
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    size_t            i;
+
+    for(i = 0; i + 2 < len; i += 3)
+    {
+        uint32_t v = ((uint32_t)in[i] << 16) | ((uint32_t)in[i + 1] << 8) | in[i + 2];
+        *out++     = alphabet[(v >> 18) & 63];
+        *out++     = alphabet[(v >> 12) & 63];
+        *out++     = alphabet[(v >> 6) & 63];
+        *out++     = alphabet[v & 63];
+    }
+    if(i < len)
+    {
+        uint32_t v = ((uint32_t)in[i] << 16) | (i + 1 < len ? (uint32_t)in[i + 1] << 8 : 0);
+        *out++     = alphabet[(v >> 18) & 63];
+        *out++     = alphabet[(v >> 12) & 63];
+        *out++     = i + 1 < len ? alphabet[(v >> 6) & 63] : '=';
+        *out++     = '=';
+    }
+    *out = '\0';
+}
+
+// text frames must carry UTF-8, anything else goes out as binary
+static int utf8_valid(const unsigned char *s, size_t len)
+{
+    size_t i = 0;
+
+    while(i < len)
+    {
+        unsigned char c = s[i];
+        size_t        n;
+        uint32_t      cp;
+
+        if(c < 0x80)
+        {
+            i++;
+            continue;
+        }
+        if((c & 0xE0) == 0xC0)
+        {
+            n  = 1;
+            cp = c & 0x1FU;
+        }
+        else if((c & 0xF0) == 0xE0)
+        {
+            n  = 2;
+            cp = c & 0x0FU;
+        }
+        else if((c & 0xF8) == 0xF0)
+        {
+            n  = 3;
+            cp = c & 0x07U;
+        }
+        else
+        {
+            return 0;
+        }
+        if(len - i <= n)
+        {
+            return 0;
+        }
+        for(size_t j = 1; j <= n; j++)
+        {
+            if((s[i + j] & 0xC0) != 0x80)
+            {
+                return 0;
+            }
+            cp = (cp << 6) | (s[i + j] & 0x3FU);
+        }
+        // overlong, surrogate or past the last code point
+        if((n == 1 && cp < 0x80) || (n == 2 && cp < 0x800) || (n == 3 && cp < 0x10000) || cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF))
+        {
+            return 0;
+        }
+        i += n + 1;
+    }
+    return 1;
+}
+
+static int subscribe_websocket_head(int client_fd, const struct http_request *req, struct http_response *res)
+{
+    const char   *key        = http_header(req, "Sec-WebSocket-Key");
+    const char   *version    = http_header(req, "Sec-WebSocket-Version");
+    const char   *connection = http_header(req, "Connection");
+    char          input[SUBSCRIBE_KEY_MAX + sizeof(WS_GUID)];
+    unsigned char digest[SHA1_DIGEST];
+    char          accept_key[((SHA1_DIGEST + 2) / 3 * 4) + 1];
+    char          head[256];
+    int           len;
+
+    if(!connection || !http_has_token(connection, "upgrade") || !key || strlen(key) > SUBSCRIBE_KEY_MAX || strcmp(req->method, "GET") != 0)
+    {
+        http_response_error(res, "400 Bad Request");
+        return -1;
+    }
+    if(!version || strcmp(version, "13") != 0)
+    {
+        res->ops->header(res, "Sec-WebSocket-Version", "13");
+        http_response_error(res, "426 Upgrade Required");
+        return -1;
+    }
+
+    len = snprintf(input, sizeof(input), "%s%s", key, WS_GUID);
+    sha1((const unsigned char *)input, (size_t)len, digest);
+    base64_encode(digest, sizeof(digest), accept_key);
+
+    // the writer only speaks HTTP/1.0, the upgrade needs 1.1 and no Content-Type
+    len          = snprintf(head, sizeof(head), "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: %s\r\n\r\n", accept_key);
+    res->started = 1;
+    if(http_write_all(client_fd, head, (size_t)len) != 0)
+    {
+        res->failed = 1;
+        return -1;
+    }
+    trace_current(TRACE_RESPONSE_HEAD);
+    trace_current_status(101);
+    return 0;
+}
+
+struct subscriber *subscribe_accept(int client_fd, const struct http_request *req, struct http_response *res)
+{
+    struct subscriber *sub;
+    const char        *upgrade   = http_header(req, "Upgrade");
+    const char        *last_id   = http_header(req, "Last-Event-ID");
+    int                websocket = upgrade && http_has_token(upgrade, "websocket");
+    uint64_t           head;
+    int                one       = 1;
+
+    if(atomic_fetch_add(&count, 1) >= SUBSCRIBE_MAX || !atomic_load(&running))
+    {
+        atomic_fetch_sub(&count, 1);
+        http_response_error(res, "503 Service Unavailable");
+        return NULL;
+    }
+
+    sub = (struct subscriber *)calloc(1, sizeof(struct subscriber));
+    if(!sub)
+    {
+        atomic_fetch_sub(&count, 1);
+        http_response_error(res, "500 Internal Server Error");
+        return NULL;
+    }
+
+    if(websocket)
+    {
+        if(subscribe_websocket_head(client_fd, req, res) != 0)
+        {
+            atomic_fetch_sub(&count, 1);
+            free(sub);
+            return NULL;
+        }
+    }
+    else
+    {
+        res->ops->header(res, "Cache-Control", "no-cache");
+        if(res->ops->begin(res, "200 OK", "text/event-stream", -1) != 0)
+        {
+            atomic_fetch_sub(&count, 1);
+            free(sub);
+            return NULL;
+        }
+    }
+
+    // a reconnecting EventSource resumes after the last id it saw, the lag policy caps how far back
+    head        = broadcast_head();
+    sub->cursor = head;
+    if(!websocket && last_id)
+    {
+        char              *end;
+        unsigned long long id = strtoull(last_id, &end, 10);
+        if(end != last_id && *end == '\0' && id < head)
+        {
+            sub->cursor = id + 1;
+        }
+    }
+
+    // frames are small and each one should leave at once
+    setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    sub->fd        = client_fd;
+    sub->websocket = websocket;
+    sub->active_ms = admission_now_ms();
+    return sub;
+}
+
+static void subscriber_watch(struct subscriber *sub, uint32_t events)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events   = events;
+    ev.data.ptr = sub;
+    if(epoll_ctl(epoll_fd, EPOLL_CTL_MOD, sub->fd, &ev) != 0)
+    {
+        sub->closing = 1;
+    }
+}
+
+// non-blocking, whatever the socket does not take waits in pending until EPOLLOUT
+static void subscriber_send(struct subscriber *sub, const void *data, size_t len, uint64_t now)
+{
+    ssize_t sent = send(sub->fd, data, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+    if(sent < 0)
+    {
+        if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        {
+            sub->closing = 1;
+            return;
+        }
+        sent = 0;
+    }
+    if(sent > 0)
+    {
+        sub->active_ms = now;
+    }
+    if((size_t)sent == len)
+    {
+        return;
+    }
+
+    sub->pending = (char *)malloc(len - (size_t)sent);
+    if(!sub->pending)
+    {
+        sub->closing = 1;
+        return;
+    }
+    memcpy(sub->pending, (const char *)data + sent, len - (size_t)sent);
+    sub->pending_len = len - (size_t)sent;
+    sub->pending_off = 0;
+    sub->blocked_ms  = now;
+    subscriber_watch(sub, EPOLLIN | EPOLLRDHUP | EPOLLOUT);
+}
+
+// returns 0 once nothing is left
+static int subscriber_drain(struct subscriber *sub, uint64_t now)
+{
+    ssize_t sent;
+
+    if(!sub->pending)
+    {
+        return 0;
+    }
+    sent = send(sub->fd, sub->pending + sub->pending_off, sub->pending_len - sub->pending_off, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if(sent < 0)
+    {
+        if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        {
+            sub->closing = 1;
+        }
+        return -1;
+    }
+    sub->active_ms = now;
+    sub->pending_off += (size_t)sent;
+    if(sub->pending_off < sub->pending_len)
+    {
+        return -1;
+    }
+
+    free(sub->pending);
+    sub->pending    = NULL;
+    sub->blocked_ms = 0;
+    subscriber_watch(sub, EPOLLIN | EPOLLRDHUP);
+    return 0;
+}
+
+static size_t sse_frame(char *out, uint64_t seq, const char *msg, size_t len)
+{
+    char *p = out + sprintf(out, "id: %" PRIu64 "\ndata: ", seq);
+
+    // a line break would end the data field early, each line gets its own
+    for(size_t i = 0; i < len; i++)
+    {
+        if(msg[i] == '\r' || msg[i] == '\n')
+        {
+            if(msg[i] == '\r' && i + 1 < len && msg[i + 1] == '\n')
+            {
+                i++;
+            }
+            memcpy(p, "\ndata: ", 7);
+            p += 7;
+        }
+        else
+        {
+            *p++ = msg[i];
+        }
+    }
+    memcpy(p, "\n\n", 2);
+    return (size_t)(p + 2 - out);
+}
+
+static size_t ws_frame_head(unsigned char *out, int opcode, uint64_t len)
+{
+    out[0] = (unsigned char)(0x80 | opcode);    // FIN, server frames are never masked
+    if(len < 126)
+    {
+        out[1] = (unsigned char)len;
+        return 2;
+    }
+    if(len <= UINT16_MAX)
+    {
+        out[1] = 126;
+        out[2] = (unsigned char)(len >> 8);
+        out[3] = (unsigned char)len;
+        return 4;
+    }
+    out[1] = 127;
+    for(int i = 0; i < 8; i++)
+    {
+        out[2 + i] = (unsigned char)(len >> (8 * (7 - i)));
+    }
+    return WS_FRAME_HEAD_MAX;
+}
+
+// how many messages the client will never see, at the point in the stream where they were lost
+static size_t dropped_frame(char *out, int websocket, uint64_t count)
+{
+    size_t len;
+
+    if(!websocket)
+    {
+        return (size_t)sprintf(out, "event: dropped\ndata: %" PRIu64 "\n\n", count);
+    }
+    // short enough for the 2 byte frame head
+    len = (size_t)sprintf(out + 2, "{\"dropped\":%" PRIu64 "}", count);
+    return ws_frame_head((unsigned char *)out, WS_TEXT, len) + len;
+}
+
+// everything published since the cursor, batched into as few sends as the socket allows
+static void subscriber_flush(struct subscriber *sub, uint64_t now)
+{
+    static _Thread_local char batch[SUBSCRIBE_BATCH];
+    char                      msg[BROADCAST_MESSAGE_MAX];
+    uint64_t                  head;
+    uint64_t                  pushed  = 0;
+    uint64_t                  dropped = 0;
+    size_t                    len     = 0;
+
+    if(sub->closing || subscriber_drain(sub, now) != 0)
+    {
+        return;
+    }
+
+    head = broadcast_head();
+    if(head - sub->cursor > SUBSCRIBE_LAG_MAX)
+    {
+        dropped           = head - sub->cursor;
+        sub->cursor       = head;
+        sub->unannounced += dropped;
+        if(SUBSCRIBE_ON_LAG == SUBSCRIBE_CLOSE)
+        {
+            sub->closing = 1;
+        }
+    }
+
+    while(!sub->closing && !sub->pending)
+    {
+        while(sub->cursor < head)
+        {
+            size_t msg_len;
+            int    result = broadcast_read(sub->cursor, msg, &msg_len);
+
+            if(result == BROADCAST_PENDING)
+            {
+                break;    // still being written, its publish wakes us again
+            }
+            if(result == BROADCAST_GONE)
+            {
+                dropped++;
+                sub->unannounced++;
+                sub->cursor++;
+                continue;
+            }
+            if(len + DROPPED_FRAME_MAX + (sub->websocket ? WS_FRAME_HEAD_MAX + msg_len : SSE_FRAME_MAX(msg_len)) > sizeof(batch))
+            {
+                break;
+            }
+            if(sub->unannounced > 0)
+            {
+                len += dropped_frame(batch + len, sub->websocket, sub->unannounced);
+                sub->unannounced = 0;
+            }
+
+            if(sub->websocket)
+            {
+                int opcode = utf8_valid((const unsigned char *)msg, msg_len) ? WS_TEXT : WS_BINARY;
+                len += ws_frame_head((unsigned char *)batch + len, opcode, msg_len);
+                memcpy(batch + len, msg, msg_len);
+                len += msg_len;
+            }
+            else
+            {
+                len += sse_frame(batch + len, sub->cursor, msg, msg_len);
+            }
+            sub->cursor++;
+            pushed++;
+        }
+        // a gap with nothing after it yet
+        if(sub->unannounced > 0 && len + DROPPED_FRAME_MAX <= sizeof(batch))
+        {
+            len += dropped_frame(batch + len, sub->websocket, sub->unannounced);
+            sub->unannounced = 0;
+        }
+        if(len == 0)
+        {
+            break;
+        }
+        subscriber_send(sub, batch, len, now);
+        len = 0;
+    }
+
+    atomic_fetch_add_explicit(&stats->pushed, pushed, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stats->push_dropped, dropped, memory_order_relaxed);
+}
+
+// control frames from the client, data frames are read past
+static void subscriber_ws_frames(struct subscriber *sub, uint64_t now)
+{
+    size_t off = 0;
+
+    while(off < sub->input_len)
+    {
+        const unsigned char *p     = sub->input + off;
+        size_t               avail = sub->input_len - off;
+        size_t               head;
+        uint64_t             len;
+        int                  opcode;
+        unsigned char        reply[2 + WS_CONTROL_MAX];
+
+        if(sub->input_skip > 0)
+        {
+            size_t skip = avail < sub->input_skip ? avail : (size_t)sub->input_skip;
+            sub->input_skip -= skip;
+            off += skip;
+            continue;
+        }
+        if(avail < 2)
+        {
+            break;
+        }
+        // clients must mask, a bare frame is a protocol error
+        if(!(p[1] & 0x80))
+        {
+            sub->closing = 1;
+            return;
+        }
+        opcode = p[0] & 0x0F;
+        len    = p[1] & 0x7FU;
+        head   = 2;
+        if(len == 126)
+        {
+            head = 4;
+        }
+        else if(len == 127)
+        {
+            head = 10;
+        }
+        if(avail < head + 4)
+        {
+            break;
+        }
+        if(head == 4)
+        {
+            len = ((uint64_t)p[2] << 8) | p[3];
+        }
+        else if(head == 10)
+        {
+            len = 0;
+            for(int i = 0; i < 8; i++)
+            {
+                len = (len << 8) | p[2 + i];
+            }
+        }
+        head += 4;
+
+        if(opcode == WS_CONTINUATION || opcode == WS_TEXT || opcode == WS_BINARY)
+        {
+            sub->input_skip = len;
+            off += head;
+            continue;
+        }
+        if(len > WS_CONTROL_MAX)
+        {
+            sub->closing = 1;
+            return;
+        }
+        if(avail < head + len)
+        {
+            break;
+        }
+
+        for(size_t i = 0; i < len; i++)
+        {
+            reply[2 + i] = p[head + i] ^ p[head - 4 + (i % 4)];
+        }
+        if(opcode == WS_CLOSE)
+        {
+            // echo the status code back, then the connection is done
+            size_t code = len >= 2 ? 2 : 0;
+            ws_frame_head(reply, WS_CLOSE, code);
+            if(!sub->pending)
+            {
+                send(sub->fd, reply, 2 + code, MSG_DONTWAIT | MSG_NOSIGNAL);
+            }
+            sub->closing = 1;
+            return;
+        }
+        if(opcode == WS_PING && !sub->pending)
+        {
+            ws_frame_head(reply, WS_PONG, len);
+            subscriber_send(sub, reply, 2 + len, now);
+        }
+        off += head + len;
+    }
+
+    memmove(sub->input, sub->input + off, sub->input_len - off);
+    sub->input_len -= off;
+}
+
+static void subscriber_input(struct subscriber *sub, uint64_t now)
+{
+    char discard[512];
+
+    while(!sub->closing)
+    {
+        ssize_t n;
+
+        if(sub->websocket)
+        {
+            n = recv(sub->fd, sub->input + sub->input_len, sizeof(sub->input) - sub->input_len, MSG_DONTWAIT);
+        }
+        else
+        {
+            n = recv(sub->fd, discard, sizeof(discard), MSG_DONTWAIT);    // an event stream has nothing to say
+        }
+
+        if(n == 0)
+        {
+            sub->closing = 1;
+        }
+        else if(n < 0)
+        {
+            if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            {
+                sub->closing = 1;
+            }
+            return;
+        }
+        else if(sub->websocket)
+        {
+            sub->input_len += (size_t)n;
+            subscriber_ws_frames(sub, now);
+        }
+    }
+}
+
+// heartbeats keep proxies from timing out idle streams, a client that stops reading is let go
+static void subscriber_sweep(struct subscriber *sub, uint64_t now)
+{
+    static const char sse_heartbeat[] = ":\n\n";
+    static const char ws_heartbeat[]  = {(char)(0x80 | WS_PING), 0};
+
+    if(sub->pending)
+    {
+        if(now - sub->blocked_ms >= SUBSCRIBE_STALL_MS)
+        {
+            sub->closing = 1;
+        }
+        return;
+    }
+    if(now - sub->active_ms >= SUBSCRIBE_HEARTBEAT_MS)
+    {
+        if(sub->websocket)
+        {
+            subscriber_send(sub, ws_heartbeat, sizeof(ws_heartbeat), now);
+        }
+        else
+        {
+            subscriber_send(sub, sse_heartbeat, sizeof(sse_heartbeat) - 1, now);
+        }
+        sub->active_ms = now;
+    }
+}
+
+static void subscriber_free(struct subscriber *sub)
+{
+    close(sub->fd);    // drops it from the epoll set too
+    free(sub->pending);
+    free(sub);
+    atomic_fetch_sub(&count, 1);
+    atomic_fetch_sub_explicit(&stats->subscribers, 1, memory_order_relaxed);
+}
+
+void subscribe_add(struct subscriber *sub)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events   = EPOLLIN | EPOLLRDHUP;
+    ev.data.ptr = sub;
+
+    atomic_fetch_add_explicit(&stats->subscribers, 1, memory_order_relaxed);
+    pthread_mutex_lock(&subscribe_lock);
+    if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sub->fd, &ev) != 0)
+    {
+        perror("subscribe_add: epoll_ctl\n");
+        pthread_mutex_unlock(&subscribe_lock);
+        subscriber_free(sub);
+        return;
+    }
+    sub->next   = subscribers;
+    subscribers = sub;
+    pthread_mutex_unlock(&subscribe_lock);
+
+    // a resumed stream has a backlog to send before the next publish
+    if(sub->cursor < broadcast_head())
+    {
+        broadcast_wake(worker);
+    }
+}
+
+static void *subscribe_run(void *arg)
+{
+    struct epoll_event events[SUBSCRIBE_EVENTS];
+    uint64_t           last_sweep = admission_now_ms();
+
+    (void)arg;
+    while(atomic_load(&running))
+    {
+        int      n         = epoll_wait(epoll_fd, events, SUBSCRIBE_EVENTS, SUBSCRIBE_SWEEP_MS);
+        int      published = 0;
+        uint64_t now       = admission_now_ms();
+
+        if(n < 0 && errno != EINTR)
+        {
+            perror("subscribe_run: epoll_wait\n");
+            break;
+        }
+
+        pthread_mutex_lock(&subscribe_lock);
+        for(int i = 0; i < n; i++)
+        {
+            struct subscriber *sub = (struct subscriber *)events[i].data.ptr;
+
+            if(!sub)
+            {
+                // rearmed before reading so a publish during the flush signals again
+                broadcast_rearm(worker);
+                published = 1;
+                continue;
+            }
+            if(events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+            {
+                subscriber_input(sub, now);
+            }
+            if(events[i].events & EPOLLOUT)
+            {
+                subscriber_flush(sub, now);
+            }
+        }
+
+        for(struct subscriber *sub = subscribers; published && sub; sub = sub->next)
+        {
+            subscriber_flush(sub, now);
+        }
+        if(now - last_sweep >= SUBSCRIBE_SWEEP_MS)
+        {
+            for(struct subscriber *sub = subscribers; sub; sub = sub->next)
+            {
+                subscriber_sweep(sub, now);
+            }
+            last_sweep = now;
+        }
+
+        // freed only here so no event of this batch points at a freed subscriber
+        for(struct subscriber **link = &subscribers; *link;)
+        {
+            struct subscriber *sub = *link;
+            if(sub->closing)
+            {
+                *link = sub->next;
+                subscriber_free(sub);
+            }
+            else
+            {
+                link = &sub->next;
+            }
+        }
+        pthread_mutex_unlock(&subscribe_lock);
+    }
+    return NULL;
+}
+
+int subscribe_start(int worker_id)
+{
+    const char        *route = SUBSCRIBE_ROUTE;
+    struct epoll_event ev;
+
+    if(!route)
+    {
+        return 0;
+    }
+
+    worker = worker_id;
+    stats  = stats_worker(worker_id);
+    atomic_store(&stats->subscribers, 0);
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if(epoll_fd < 0)
+    {
+        perror("subscribe_start: epoll_create1\n");
+        return -1;
+    }
+
+    // data.ptr NULL marks the broadcast eventfd
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    if(broadcast_fd(worker_id) < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, broadcast_fd(worker_id), &ev) != 0)
+    {
+        perror("subscribe_start: epoll_ctl\n");
+        close(epoll_fd);
+        epoll_fd = -1;
+        return -1;
+    }
+    broadcast_rearm(worker_id);
+
+    atomic_store(&running, 1);
+    if(pthread_create(&subscribe_thread, NULL, subscribe_run, NULL) != 0)
+    {
+        fprintf(stderr, "subscribe_start: pthread_create failed\n");
+        atomic_store(&running, 0);
+        close(epoll_fd);
+        epoll_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+void subscribe_stop(void)
+{
+    if(!atomic_load(&running))
+    {
+        return;
+    }
+    atomic_store(&running, 0);
+    broadcast_wake(worker);
+    pthread_join(subscribe_thread, NULL);
+
+    while(subscribers)
+    {
+        struct subscriber *sub = subscribers;
+        subscribers            = sub->next;
+        subscriber_free(sub);
+    }
+    close(epoll_fd);
+    epoll_fd = -1;
+}
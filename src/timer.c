@@ -0,0 +1,156 @@
+#include "../include/timer.h"
+#include "../include/config.h"
+#include <stddef.h>
+#include <time.h>
+
+#define SLOT_MASK ((uint64_t)TIMER_SLOTS - 1)
+
+uint64_t timer_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000) + ((uint64_t)ts.tv_nsec / 1000000);
+}
+
+static void list_init(struct timer *head)
+{
+    head->next = head;
+    head->prev = head;
+}
+
+static void list_add(struct timer *head, struct timer *t)
+{
+    t->prev          = head->prev;
+    t->next          = head;
+    head->prev->next = t;
+    head->prev       = t;
+}
+
+static void list_del(struct timer *t)
+{
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next       = NULL;
+    t->prev       = NULL;
+}
+
+// pick the level whose span covers the delta, like the classic kernel wheel
+static void wheel_insert(struct timer_wheel *wheel, struct timer *t)
+{
+    uint64_t delta = t->expires - wheel->tick;
+    int      level = 0;
+
+    if(t->expires <= wheel->tick)
+    {
+        t->expires = wheel->tick + 1;
+        delta      = 1;
+    }
+
+    while(level < TIMER_LEVELS - 1 && delta >= ((uint64_t)1 << (TIMER_SLOT_BITS * (level + 1))))
+    {
+        level++;
+    }
+
+    if(delta >= ((uint64_t)1 << (TIMER_SLOT_BITS * TIMER_LEVELS)))
+    {
+        // past the top level, clamp to the furthest slot
+        t->expires = wheel->tick + ((uint64_t)1 << (TIMER_SLOT_BITS * TIMER_LEVELS)) - 1;
+    }
+
+    list_add(&wheel->slots[level][(t->expires >> (TIMER_SLOT_BITS * level)) & SLOT_MASK], t);
+}
+
+// move the timers of an upper slot down now that they are within its span
+static void wheel_cascade(struct timer_wheel *wheel, int level)
+{
+    struct timer *head = &wheel->slots[level][(wheel->tick >> (TIMER_SLOT_BITS * level)) & SLOT_MASK];
+
+    while(head->next != head)
+    {
+        struct timer *t = head->next;
+        list_del(t);
+        wheel_insert(wheel, t);
+    }
+}
+
+void timer_wheel_init(struct timer_wheel *wheel, timer_expire_fn expire)
+{
+    pthread_mutex_init(&wheel->lock, NULL);
+    wheel->tick     = 0;
+    wheel->start_ms = timer_now_ms();
+    wheel->expire   = expire;
+
+    for(int level = 0; level < TIMER_LEVELS; level++)
+    {
+        for(int slot = 0; slot < TIMER_SLOTS; slot++)
+        {
+            list_init(&wheel->slots[level][slot]);
+        }
+    }
+}
+
+void timer_init(struct timer *t, int fd)
+{
+    t->next    = NULL;
+    t->prev    = NULL;
+    t->expires = 0;
+    t->fd      = fd;
+    t->phase   = TIMER_HEADER;
+}
+
+void timer_arm(struct timer_wheel *wheel, struct timer *t, int phase, uint64_t timeout_ms)
+{
+    uint64_t ticks = (timeout_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+
+    pthread_mutex_lock(&wheel->lock);
+    if(t->next)
+    {
+        list_del(t);
+    }
+    t->phase   = phase;
+    t->expires = wheel->tick + ticks;
+    wheel_insert(wheel, t);
+    pthread_mutex_unlock(&wheel->lock);
+}
+
+void timer_cancel(struct timer_wheel *wheel, struct timer *t)
+{
+    pthread_mutex_lock(&wheel->lock);
+    if(t->next)
+    {
+        list_del(t);
+    }
+    pthread_mutex_unlock(&wheel->lock);
+}
+
+void timer_advance(struct timer_wheel *wheel)
+{
+    uint64_t target = (timer_now_ms() - wheel->start_ms) / TIMER_TICK_MS;
+
+    pthread_mutex_lock(&wheel->lock);
+    while(wheel->tick < target)
+    {
+        struct timer *head;
+
+        wheel->tick++;
+
+        // a lower level wrapped, pull the next slot of the level above down
+        for(int level = 1; level < TIMER_LEVELS; level++)
+        {
+            if((wheel->tick & (((uint64_t)1 << (TIMER_SLOT_BITS * level)) - 1)) != 0)
+            {
+                break;
+            }
+            wheel_cascade(wheel, level);
+        }
+
+        head = &wheel->slots[0][wheel->tick & SLOT_MASK];
+        while(head->next != head)
+        {
+            struct timer *t = head->next;
+            list_del(t);
+            wheel->expire(t);
+        }
+    }
+    pthread_mutex_unlock(&wheel->lock);
+}
@@ -0,0 +1,163 @@
+#include "../include/trace.h"
+#include "../include/config.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RING_BYTES (sizeof(struct trace_ring) + (TRACE_RING_SIZE * sizeof(struct trace_slot)))
+#define TRACE_FILE_SIZE (sizeof(struct trace_header) + (WORKER_COUNT * RING_BYTES))
+#define TRACE_EVERY (TRACE_SAMPLE_RATE > 0 ? TRACE_SAMPLE_RATE : 1)    // 0 is caught by trace_init
+
+static unsigned char *trace_map = NULL;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+static _Thread_local struct trace_record *current_record = NULL;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static _Thread_local uint32_t             sample_count   = 0;       // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+uint64_t trace_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000) + (uint64_t)ts.tv_nsec;
+}
+
+int trace_init(void)
+{
+    struct trace_header *header;
+    int                  fd;
+
+    if(TRACE_SAMPLE_RATE == 0)
+    {
+        return 0;
+    }
+
+    // a file rather than anonymous memory so trace dump can map it from outside
+    fd = open(TRACE_SHM_PATH, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP);
+    if(fd < 0)
+    {
+        perror("trace_init: open\n");
+        return -1;
+    }
+    if(ftruncate(fd, (off_t)TRACE_FILE_SIZE) != 0)
+    {
+        perror("trace_init: ftruncate\n");
+        close(fd);
+        return -1;
+    }
+
+    trace_map = (unsigned char *)mmap(NULL, TRACE_FILE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(trace_map == MAP_FAILED)
+    {
+        perror("trace_init: mmap\n");
+        trace_map = NULL;
+        return -1;
+    }
+
+    // zero filled by ftruncate
+    header              = (struct trace_header *)trace_map;
+    header->version     = TRACE_VERSION;
+    header->workers     = WORKER_COUNT;
+    header->ring_size   = TRACE_RING_SIZE;
+    header->ring_bytes  = (uint32_t)RING_BYTES;
+    header->record_size = sizeof(struct trace_record);
+    header->magic       = TRACE_MAGIC;
+    return 0;
+}
+
+void trace_begin(struct trace_record *rec, uint64_t start_ns)
+{
+    rec->sampled = trace_map && ++sample_count % TRACE_EVERY == 0;
+    if(!rec->sampled)
+    {
+        return;
+    }
+    memset(rec->marks, 0, sizeof(rec->marks));
+    rec->start_ns  = start_ns;
+    rec->thread    = 0;
+    rec->status    = 0;
+    rec->method[0] = '\0';
+    rec->path[0]   = '\0';
+}
+
+void trace_mark(struct trace_record *rec, int point)
+{
+    uint64_t elapsed_us;
+
+    if(!rec || !rec->sampled || point < 0 || point >= TRACE_POINTS)
+    {
+        return;
+    }
+
+    elapsed_us        = (trace_now_ns() - rec->start_ns) / 1000;
+    rec->marks[point] = elapsed_us < UINT32_MAX ? (uint32_t)elapsed_us + 1 : UINT32_MAX;
+    if(point == TRACE_DEQUEUED)
+    {
+        rec->thread = (uint32_t)syscall(SYS_gettid);
+    }
+}
+
+void trace_request(struct trace_record *rec, const char *method, const char *path)
+{
+    if(!rec->sampled)
+    {
+        return;
+    }
+    snprintf(rec->method, sizeof(rec->method), "%s", method);
+    snprintf(rec->path, sizeof(rec->path), "%s", path);
+}
+
+void trace_commit(int worker_id, const struct trace_record *rec)
+{
+    struct trace_ring *ring;
+    struct trace_slot *slot;
+    uint32_t           seq;
+
+    if(!rec->sampled || !trace_map)
+    {
+        return;
+    }
+
+    ring = (struct trace_ring *)(trace_map + sizeof(struct trace_header) + ((size_t)worker_id * RING_BYTES));
+    slot = &ring->slots[atomic_fetch_add_explicit(&ring->head, 1, memory_order_relaxed) % TRACE_RING_SIZE];
+
+    // pool threads of a worker share the ring, the odd count marks the slot busy
+    seq = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+    atomic_store_explicit(&slot->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    memcpy(&slot->record, rec, sizeof(*rec));
+    atomic_store_explicit(&slot->seq, seq + 2, memory_order_release);
+}
+
+void trace_set_current(struct trace_record *rec)
+{
+    current_record = rec;
+}
+
+void trace_current(int point)
+{
+    // one probe for every point reached below the worker, the point is its argument
+    TRACE_PROBE(point, point);
+    trace_mark(current_record, point);
+}
+
+void trace_current_status(int status)
+{
+    if(current_record && current_record->sampled)
+    {
+        current_record->status = (uint16_t)status;
+    }
+}
+
+void trace_cleanup(void)
+{
+    if(trace_map)
+    {
+        munmap(trace_map, TRACE_FILE_SIZE);
+        trace_map = NULL;
+    }
+}
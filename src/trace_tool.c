@@ -0,0 +1,267 @@
+#include "../include/config.h"
+#include "../include/trace.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// trace dump: sampled requests from the shared rings as Chrome trace-event
+// JSON (chrome://tracing, ui.perfetto.dev) or folded stacks for flamegraph.pl
+
+static const char *const point_names[TRACE_POINTS] = {"accept", "queue", "read head", "route", "dispatch", "stat", "open", "read body", "dbm_open", "dbm_store", "write head", "handler", "close"};
+
+struct dump_options
+{
+    const char *path;
+    int         folded;
+    int         worker;    // -1 for all
+    uint32_t    min_us;
+};
+
+struct span
+{
+    int      point;
+    uint32_t end_us;
+};
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s dump [-f] [-s min_us] [-w worker] [file]\n", name);
+    fprintf(stderr, "  default file %s, output is Chrome trace-event JSON\n", TRACE_SHM_PATH);
+    fprintf(stderr, "  -f folded stacks for flamegraph.pl instead\n");
+    fprintf(stderr, "  -s only requests that took at least min_us microseconds\n");
+    fprintf(stderr, "  -w only one worker\n");
+}
+
+static void json_string(const char *str)
+{
+    putchar('"');
+    for(; *str; str++)
+    {
+        unsigned char ch = (unsigned char)*str;
+        if(ch == '"' || ch == '\\')
+        {
+            printf("\\%c", ch);
+        }
+        else if(ch < 0x20)
+        {
+            printf("\\u%04x", ch);
+        }
+        else
+        {
+            putchar(ch);
+        }
+    }
+    putchar('"');
+}
+
+// folded stack frames cannot hold ';' or spaces
+static void folded_frame(const char *str)
+{
+    for(; *str; str++)
+    {
+        putchar((*str == ';' || *str == ' ') ? '_' : *str);
+    }
+}
+
+// reached points in time order, each span ends at its point
+static int record_spans(const struct trace_record *rec, struct span *spans)
+{
+    int count = 0;
+
+    for(int point = 0; point < TRACE_POINTS; point++)
+    {
+        int at;
+
+        if(rec->marks[point] == 0)
+        {
+            continue;
+        }
+        at = count++;
+        while(at > 0 && spans[at - 1].end_us > rec->marks[point] - 1)
+        {
+            spans[at] = spans[at - 1];
+            at--;
+        }
+        spans[at].point  = point;
+        spans[at].end_us = rec->marks[point] - 1;
+    }
+    return count;
+}
+
+static void dump_record(const struct dump_options *opts, int worker, const struct trace_record *rec, int *first)
+{
+    struct span spans[TRACE_POINTS];
+    int         count = record_spans(rec, spans);
+    uint64_t    start = rec->start_ns / 1000;
+    uint32_t    prev  = 0;
+    uint32_t    total;
+    char        name[TRACE_METHOD_MAX + TRACE_PATH_MAX + 16];
+
+    if(count == 0)
+    {
+        return;
+    }
+    total = spans[count - 1].end_us;
+    if(total < opts->min_us)
+    {
+        return;
+    }
+    snprintf(name, sizeof(name), "%.*s %.*s %u", TRACE_METHOD_MAX, rec->method[0] ? rec->method : "-", TRACE_PATH_MAX, rec->path, rec->status);
+
+    for(int i = 0; i < count; i++)
+    {
+        uint32_t dur = spans[i].end_us - prev;
+
+        if(opts->folded)
+        {
+            if(dur > 0)
+            {
+                printf("worker_%d;", worker);
+                folded_frame(name);
+                putchar(';');
+                folded_frame(point_names[spans[i].point]);
+                printf(" %u\n", dur);
+            }
+        }
+        else
+        {
+            if(i == 0)
+            {
+                // the whole request, the phases nest under it
+                printf("%s\n{\"name\":", *first ? "" : ",");
+                json_string(name);
+                printf(",\"cat\":\"request\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%u,\"pid\":%d,\"tid\":%u}", (unsigned long long)start, total, worker, rec->thread);
+                *first = 0;
+            }
+            printf(",\n{\"name\":\"%s\",\"cat\":\"phase\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%u,\"pid\":%d,\"tid\":%u}", point_names[spans[i].point], (unsigned long long)(start + prev), dur, worker, rec->thread);
+        }
+        prev = spans[i].end_us;
+    }
+}
+
+static int dump(const struct dump_options *opts)
+{
+    struct stat                st;
+    const unsigned char       *map;
+    const struct trace_header *header;
+    int                        first = 1;
+    int                        fd    = open(opts->path, O_RDONLY | O_CLOEXEC);
+
+    if(fd < 0 || fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct trace_header))
+    {
+        fprintf(stderr, "trace: cannot read %s, is TRACE_SAMPLE_RATE set and the server started?\n", opts->path);
+        if(fd >= 0)
+        {
+            close(fd);
+        }
+        return -1;
+    }
+    map = (const unsigned char *)mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED)
+    {
+        perror("trace: mmap");
+        return -1;
+    }
+
+    header = (const struct trace_header *)map;
+    if(header->magic != TRACE_MAGIC || header->version != TRACE_VERSION || header->record_size != sizeof(struct trace_record) || sizeof(struct trace_header) + ((size_t)header->workers * header->ring_bytes) > (size_t)st.st_size)
+    {
+        fprintf(stderr, "trace: %s is not a trace file of this build\n", opts->path);
+        munmap((void *)map, (size_t)st.st_size);
+        return -1;
+    }
+
+    if(!opts->folded)
+    {
+        printf("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    }
+
+    for(uint32_t worker = 0; worker < header->workers; worker++)
+    {
+        const struct trace_ring *ring = (const struct trace_ring *)(map + sizeof(struct trace_header) + ((size_t)worker * header->ring_bytes));
+        uint64_t                 head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        uint64_t                 from = head > header->ring_size ? head - header->ring_size : 0;
+
+        if(opts->worker >= 0 && (uint32_t)opts->worker != worker)
+        {
+            continue;
+        }
+
+        // oldest first, slots being rewritten right now are skipped
+        for(uint64_t i = from; i < head; i++)
+        {
+            const struct trace_slot *slot = &ring->slots[i % header->ring_size];
+            struct trace_record      rec;
+            uint32_t                 before = atomic_load_explicit(&slot->seq, memory_order_acquire);
+
+            if(before == 0 || (before & 1) != 0)
+            {
+                continue;
+            }
+            memcpy(&rec, &slot->record, sizeof(rec));
+            atomic_thread_fence(memory_order_acquire);
+            if(atomic_load_explicit(&slot->seq, memory_order_relaxed) != before)
+            {
+                continue;
+            }
+            rec.method[TRACE_METHOD_MAX - 1] = '\0';
+            rec.path[TRACE_PATH_MAX - 1]     = '\0';
+            dump_record(opts, (int)worker, &rec, &first);
+        }
+    }
+
+    if(!opts->folded)
+    {
+        printf("\n]}\n");
+    }
+    munmap((void *)map, (size_t)st.st_size);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    struct dump_options opts;
+    int                 opt;
+
+    if(argc < 2 || strcmp(argv[1], "dump") != 0)
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    opts.path   = TRACE_SHM_PATH;
+    opts.folded = 0;
+    opts.worker = -1;
+    opts.min_us = 0;
+
+    optind = 2;
+    while((opt = getopt(argc, argv, "fs:w:")) != -1)
+    {
+        switch(opt)
+        {
+            case 'f':
+                opts.folded = 1;
+                break;
+            case 's':
+                opts.min_us = (uint32_t)strtoul(optarg, NULL, 10);
+                break;
+            case 'w':
+                opts.worker = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if(optind < argc)
+    {
+        opts.path = argv[optind];
+    }
+
+    return dump(&opts) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -1,14 +1,33 @@
+#define _GNU_SOURCE    // accept4
+
 #include "../include/worker.h"
+#include "../include/admission.h"
+#include "../include/arena.h"
+#include "../include/broadcast.h"
+#include "../include/capture.h"
 #include "../include/config.h"
-#include <arpa/inet.h>
-#include <dlfcn.h>    // dynlib
+#include "../include/conn.h"
+#include "../include/filecache.h"
+#include "../include/handler.h"
+#include "../include/http.h"
+#include "../include/library.h"
+#include "../include/pool.h"
+#include "../include/proxy.h"
+#include "../include/router.h"
+#include "../include/stats.h"
+#include "../include/subscribe.h"
+#include "../include/timer.h"
+#include "../include/trace.h"
 #include <errno.h>
 #include <netinet/in.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/stat.h>
+#include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/wait.h>    // waitpid
 #include <time.h>
@@ -18,6 +37,7 @@
 static int                   server_fd   = -1;      // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
 static pid_t                *worker_pids = NULL;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
 static volatile sig_atomic_t exit_flag   = 0;       // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static volatile sig_atomic_t stats_flag  = 0;       // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
 
 static void worker_inner_signal_handler(int sig)
 {
@@ -43,107 +63,372 @@ static void setup_worker_inner_signal_handler(void)
 
     sigaction(SIGINT, &sa, NULL);
     sigaction(SIGTERM, &sa, NULL);
+    signal(SIGUSR1, SIG_IGN);    // stats dumps are for the master
 }
 
-_Noreturn static void worker_process(int worker_id)
+static void worker_stats_signal_handler(int sig)
 {
-    struct stat lib_stat;
-    time_t      lib_mtime = 0;
-    setup_worker_inner_signal_handler();
+    if(sig == SIGUSR1)
+    {
+        stats_flag = 1;
+    }
+}
 
-    printf("Worker %d (PID %d) started\n", worker_id, getpid());
+static void setup_worker_stats_signal_handler(void)
+{
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+
+#if defined(__clang__)
+    #pragma clang diagnostic push
+    #pragma clang diagnostic ignored "-Wdisabled-macro-expansion"
+#endif
+    sa.sa_handler = worker_stats_signal_handler;
+#if defined(__clang__)
+    #pragma clang diagnostic pop
+#endif
+
+    sigaction(SIGUSR1, &sa, NULL);
+}
 
-    if(stat(HANDLER_LIBRARY, &lib_stat) == 0)
+static int                  worker_index = -1;      // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static struct worker_stats *stats        = NULL;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static struct conn_table    conns;                  // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static struct timer_wheel   wheel;                  // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static struct arena_pool    arenas;                 // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static uint64_t             fork_ns      = 0;       // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+static _Thread_local struct conn *current_conn = NULL;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+static const uint64_t phase_timeouts[TIMER_PHASES] = {TIMEOUT_HEADER_MS, TIMEOUT_BODY_MS, TIMEOUT_WRITE_MS};
+
+// wheel is locked, the serving thread still owns the fd so only shut it down
+static void worker_timer_expired(struct timer *t)
+{
+    atomic_fetch_add_explicit(&stats->timeouts[t->phase], 1, memory_order_relaxed);
+    shutdown(t->fd, SHUT_RDWR);
+}
+
+// handler hook, called on the pool thread serving the connection
+static void worker_conn_phase(int client_fd, int phase)
+{
+    struct conn *conn = current_conn;
+
+    if(conn && conn->fd == client_fd && phase >= 0 && phase < TIMER_PHASES)
     {
-        lib_mtime = lib_stat.st_mtime;
+        timer_arm(&wheel, &conn->timer, phase, phase_timeouts[phase]);
     }
+}
 
-    while(!exit_flag)
+static const struct handler_hooks worker_hooks = {worker_conn_phase, trace_current, broadcast_publish, file_cache_open, file_cache_release};
+
+// parse once, then hand the request to whatever the router picked
+static void worker_dispatch(struct conn *conn, struct arena *arena)
+{
+    struct http_request  req;
+    struct http_body     body;
+    struct http_response res;
+    struct capture       capture;
+    const struct route  *route;
+    int                  result;
+
+    http_response_init(&res, conn->fd, arena, worker_conn_phase);
+
+    result = http_read_request(conn->fd, arena, &req);
+    if(result != HTTP_READ_OK)
     {
-        struct sockaddr_in client_addr;
-        socklen_t          client_addr_len = sizeof(client_addr);
-        fd_set             read_fds;    // using select to wait for connections with timeout
-        struct timeval     timeout;
-        int                select_result;
-        int                client_fd;
-        char               client_ip[INET_ADDRSTRLEN];
-        void              *handler_lib      = NULL;
-        void (*handler_func)(int client_fd) = NULL;
-        void (*init_handler_func)(void)     = NULL;
+        // nothing arrived, closed by the client or by the header timeout
+        if(result == HTTP_READ_BAD)
+        {
+            http_response_error(&res, "400 Bad Request");
+        }
+        else if(result == HTTP_READ_TOO_LARGE)
+        {
+            http_response_error(&res, "431 Request Header Fields Too Large");
+        }
+        return;
+    }
 
-        FD_ZERO(&read_fds);
-        FD_SET(server_fd, &read_fds);
-        timeout.tv_sec  = 1;    // 1s timeout to check exit flag
-        timeout.tv_usec = 0;
+    TRACE_POINT(&conn->trace, TRACE_HEAD_READ, head_read, conn->fd);
+    trace_request(&conn->trace, req.method, req.path);
 
-        select_result = select(server_fd + 1, &read_fds, NULL, NULL, &timeout);
+    // the head is in, from here the client only has to send the body and drain the response
+    http_body_init(&body, &req, conn->fd, worker_conn_phase);
+    capture_begin(&capture, &body, arena);
+    worker_conn_phase(conn->fd, body.done ? TIMER_WRITE : TIMER_BODY);
+    atomic_fetch_add_explicit(&stats->requests, 1, memory_order_relaxed);
 
-        if(select_result <= 0)
+    route = router_match(req.method, req.path);
+    TRACE_POINT(&conn->trace, TRACE_ROUTED, routed, conn->fd);
+    if(req.content_length > HTTP_BODY_MAX)
+    {
+        // refused before a 100 Continue lets the client send it
+        http_response_error(&res, "413 Payload Too Large");
+    }
+    else if(!route)
+    {
+        http_response_error(&res, "404 Not Found");
+    }
+    else if(route->type == ROUTE_PROXY)
+    {
+        TRACE_POINT(&conn->trace, TRACE_DISPATCH, dispatch, conn->fd);
+        proxy_serve(conn->fd, &req, route->proxy, &worker_hooks);
+        TRACE_POINT(&conn->trace, TRACE_DISPATCHED, dispatched, conn->fd);
+    }
+    else if(route->type == ROUTE_SUBSCRIBE)
+    {
+        struct subscriber *sub;
+
+        TRACE_POINT(&conn->trace, TRACE_DISPATCH, dispatch, conn->fd);
+        sub = subscribe_accept(conn->fd, &req, &res);
+        TRACE_POINT(&conn->trace, TRACE_DISPATCHED, dispatched, conn->fd);
+        if(sub)
         {
-            if(select_result < 0 && errno != EINTR)
-            {
-                perror("worker_process: select\n");
-            }
-            continue;
+            // the subscriber thread owns the socket from here, without a deadline
+            timer_cancel(&wheel, &conn->timer);
+            subscribe_add(sub);
+            conn->fd = -1;
         }
+    }
+    else
+    {
+        handler_fn handle = library_acquire(route->library);
+        TRACE_POINT(&conn->trace, TRACE_DISPATCH, dispatch, conn->fd);
+        if(handle)
+        {
+            handle(&req, &res);
+        }
+        library_release(route->library);
+        TRACE_POINT(&conn->trace, TRACE_DISPATCHED, dispatched, conn->fd);
 
-        client_fd = accept(server_fd, (struct sockaddr *)&client_addr, &client_addr_len);
-        if(client_fd < 0)
+        // a handler that gives up on a bad body leaves the answer to the reader
+        if(!res.started)
         {
-            if(errno == EINTR)
-            {
-                continue;    // interrupt sig, try again
-            }
-            perror("worker_process: accept\n");
-            continue;
+            http_response_error(&res, body.status ? body.status : "500 Internal Server Error");
         }
+    }
+
+    // after the response so the client does not wait on the log
+    capture_commit(&capture, &req, &body);
+}
+
+// runs on a pool thread
+static void worker_serve(void *arg)
+{
+    struct conn       *conn = (struct conn *)arg;
+    uint64_t           now  = admission_now_ms();
+    struct arena      *arena;
+    struct arena_stats arena_stats;
+
+    TRACE_POINT(&conn->trace, TRACE_DEQUEUED, dequeued, conn->fd);
+    admission_queue_delay(now - conn->accepted_ms, now);
+
+    // no general purpose allocation on the request path once the pool is warm
+    arena = arena_pool_acquire(&arenas);
+    if(arena)
+    {
+        current_conn = conn;
+        trace_set_current(&conn->trace);
+        worker_dispatch(conn, arena);
+        trace_set_current(NULL);
+        current_conn = NULL;
+
+        arena_pool_release(&arenas, arena);
+        arena_pool_stats(&arenas, &arena_stats);
+        atomic_store_explicit(&stats->arena_peak, arena_stats.peak, memory_order_relaxed);
+    }
+
+    // how long a fresh worker took to be useful, warm-up in the master shows here
+    if(atomic_load_explicit(&stats->first_request_us, memory_order_relaxed) == 0)
+    {
+        uint64_t expected = 0;
+        atomic_compare_exchange_strong(&stats->first_request_us, &expected, ((trace_now_ns() - fork_ns) / 1000) + 1);
+    }
+
+    // cancel before close so an expiry can never hit a reused fd
+    timer_cancel(&wheel, &conn->timer);
+    if(conn->fd >= 0)
+    {
+        close(conn->fd);
+    }
+    TRACE_POINT(&conn->trace, TRACE_CLOSED, closed, conn->fd);
+    trace_commit(worker_index, &conn->trace);
+    conn_release(&conns, conn);
+    admission_done();
+}
 
-        inet_ntop(AF_INET, &(client_addr.sin_addr), client_ip, INET_ADDRSTRLEN);
-        printf("Worker %d: Accepted connection from %s:%d\n", worker_id, client_ip, ntohs(client_addr.sin_port));
+// admission, deadline and hand-off to the pool for one accepted connection
+static void worker_admit(struct pool *pool, int client_fd, const struct sockaddr *client_addr, uint64_t now, uint64_t wake_ns)
+{
+    struct conn *conn;
+    int          admission;
+
+    atomic_fetch_add_explicit(&stats->accepted, 1, memory_order_relaxed);
+
+    // shed before spending anything else on the connection
+    admission = admission_check(client_addr, now);
+    if(admission != ADMISSION_ADMIT)
+    {
+        atomic_fetch_add_explicit(admission == ADMISSION_RATE_LIMITED ? &stats->rate_limited : &stats->overloaded, 1, memory_order_relaxed);
+        admission_reject(client_fd, admission);
+        close(client_fd);
+        return;
+    }
+
+    conn = conn_acquire(&conns, client_fd);
+    if(!conn)
+    {
+        fprintf(stderr, "Worker %d: Connection table full, dropping connection\n", worker_index);
+        admission_reject(client_fd, ADMISSION_OVERLOADED);
+        close(client_fd);
+        admission_done();
+        return;
+    }
+    conn->accepted_ms = now;
+    trace_begin(&conn->trace, wake_ns);
+    TRACE_POINT(&conn->trace, TRACE_ACCEPTED, accepted, client_fd);
+
+    // the request head must arrive before this fires, queued time included
+    timer_arm(&wheel, &conn->timer, TIMER_HEADER, TIMEOUT_HEADER_MS);
+
+    if(pool_submit(pool, worker_serve, conn) != 0)
+    {
+        fprintf(stderr, "Worker %d: Request queue full, dropping connection\n", worker_index);
+        timer_cancel(&wheel, &conn->timer);
+        admission_reject(client_fd, ADMISSION_OVERLOADED);
+        close(client_fd);
+        conn_release(&conns, conn);
+        admission_done();
+    }
+}
+
+// drain the backlog, the listener is non-blocking so an empty queue or a
+// connection taken by another worker ends the batch
+static void worker_accept_batch(struct pool *pool)
+{
+    uint64_t now     = admission_now_ms();
+    uint64_t wake_ns = trace_now_ns();
+
+    for(int i = 0; i < WORKER_ACCEPT_BATCH && !exit_flag; i++)
+    {
+        struct sockaddr_storage client_addr;
+        socklen_t               client_addr_len = sizeof(client_addr);
 
-        // check handler lib for updates
-        if(stat(HANDLER_LIBRARY, &lib_stat) == 0)
+        // client sockets stay blocking, pool threads serve them with blocking I/O under the timer wheel
+        int client_fd = accept4(server_fd, (struct sockaddr *)&client_addr, &client_addr_len, SOCK_CLOEXEC);
+        if(client_fd < 0)
         {
-            if(lib_stat.st_mtime > lib_mtime)
+            if(errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;    // interrupt sig or a client that gave up, try again
+            }
+            if(errno != EAGAIN && errno != EWOULDBLOCK)
             {
-                lib_mtime = lib_stat.st_mtime;
-                printf("Worker %d: Detected updated handler library\n", worker_id);
+                perror("worker_accept_batch: accept4\n");
             }
+            return;
         }
 
-        // load handler lib
-        handler_lib = dlopen(HANDLER_LIBRARY, RTLD_NOW);
-        if(!handler_lib)
-        {
-            fprintf(stderr, "Worker %d: Failed to load handler library: %s\n", worker_id, dlerror());
-            close(client_fd);
-            continue;
-        }
+        worker_admit(pool, client_fd, (struct sockaddr *)&client_addr, now, wake_ns);
+    }
+}
+
+_Noreturn static void worker_process(int worker_id)
+{
+    struct pool *pool;
+    char         tag[32];
+    setup_worker_inner_signal_handler();
+
+    worker_index = worker_id;
+    stats        = stats_worker(worker_id);
+    atomic_store(&stats->pid, getpid());
+    atomic_store(&stats->ready_us, 0);
+    atomic_store(&stats->first_request_us, 0);
+    admission_set_worker(worker_id);
+    printf("Worker %d (PID %d) started\n", worker_id, getpid());
+
+    snprintf(tag, sizeof(tag), "Worker %d", worker_id);
+    timer_wheel_init(&wheel, worker_timer_expired);
+    arena_pool_init(&arenas);
+    if(conn_table_init(&conns, WORKER_MAX_CONNS) != 0)
+    {
+        exit(EXIT_FAILURE);
+    }
+    // routes, upstreams and libraries come ready from the master, this only picks up a library updated since
+    library_load_all(&worker_hooks, tag);
 
-        // link handler func
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wpedantic"
-        init_handler_func = (void (*)(void))dlsym(handler_lib, "init_handler");
-        handler_func      = (void (*)(int))dlsym(handler_lib, "handle_request");
-#pragma GCC diagnostic pop
-        if(!handler_func)
+    pool = pool_create(WORKER_THREADS);
+    if(!pool)
+    {
+        fprintf(stderr, "Worker %d: Failed to start thread pool\n", worker_id);
+        exit(EXIT_FAILURE);
+    }
+    if(library_check_start() != 0)
+    {
+        fprintf(stderr, "Worker %d: Failed to start library check thread\n", worker_id);
+        exit(EXIT_FAILURE);
+    }
+    if(subscribe_start(worker_id) != 0)
+    {
+        fprintf(stderr, "Worker %d: Failed to start subscriber thread\n", worker_id);
+        exit(EXIT_FAILURE);
+    }
+    if(file_cache_init(worker_id) != 0)
+    {
+        fprintf(stderr, "Worker %d: File cache off, every request opens its file\n", worker_id);
+    }
+    atomic_store(&stats->ready_us, (trace_now_ns() - fork_ns) / 1000);
+
+    // this thread only accepts, the pool does the blocking work
+    while(!exit_flag)
+    {
+        fd_set         read_fds;    // using select to wait for connections with timeout
+        struct timeval timeout;
+        int            select_result;
+        int            watch_fd = file_cache_fd();
+
+        FD_ZERO(&read_fds);
+        FD_SET(server_fd, &read_fds);
+        if(watch_fd >= 0)
         {
-            fprintf(stderr, "Worker %d: Failed to resolve handler function: %s\n", worker_id, dlerror());
-            dlclose(handler_lib);
-            close(client_fd);
-            continue;
+            FD_SET(watch_fd, &read_fds);    // docroot changes drop cached files before the next request
         }
+        timeout.tv_sec  = 0;    // wake every tick to run the timer wheel and check exit flag
+        timeout.tv_usec = TIMER_TICK_MS * 1000;
 
-        init_handler_func();
+        select_result = select((watch_fd > server_fd ? watch_fd : server_fd) + 1, &read_fds, NULL, NULL, &timeout);
 
-        handler_func(client_fd);
+        timer_advance(&wheel);
 
-        printf("Worker %d: processed client request\n", worker_id);
+        if(select_result <= 0)
+        {
+            if(select_result < 0 && errno != EINTR)
+            {
+                perror("worker_process: select\n");
+            }
+            continue;
+        }
 
-        dlclose(handler_lib);
-        close(client_fd);
+        if(watch_fd >= 0 && FD_ISSET(watch_fd, &read_fds))
+        {
+            file_cache_poll();
+        }
+        if(FD_ISSET(server_fd, &read_fds))
+        {
+            worker_accept_batch(pool);
+        }
     }
 
+    library_check_stop();
+    pool_destroy(pool);
+    subscribe_stop();
+    file_cache_cleanup();
+    conn_table_destroy(&conns);
+    router_cleanup();
+    proxy_cleanup();
+    library_cleanup();
+    arena_pool_destroy(&arenas);
+
     printf("Worker %d (PID %d) shutting down\n", worker_id, getpid());
 
     exit(0);
@@ -167,8 +452,12 @@ static void *worker_monitor(void)
                 {
                     pid_t new_pid;
                     printf("Worker %d (PID %d) terminated, restarting...\n", i, pid);
+                    admission_worker_exited(i);
 
-                    // restart worker process
+                    // restart worker process, with the current library already loaded
+                    library_check();
+                    fflush(stdout);
+                    fork_ns = trace_now_ns();
                     new_pid = fork();
                     if(new_pid == 0)    // child
                     {
@@ -190,6 +479,12 @@ static void *worker_monitor(void)
         // cppcheck-suppress knownConditionTrueFalse
         else if(pid == 0 || (pid < 0 && errno == ECHILD))
         {
+            if(stats_flag)
+            {
+                stats_flag = 0;
+                stats_print();
+            }
+
             // no children terminated, sleep
             struct timespec t = {0, WORKER_SLEEP};
             nanosleep(&t, NULL);
@@ -213,10 +508,29 @@ int worker_init(int fd)
         return -1;
     }
 
+    // shared with the workers, dumped on SIGUSR1
+    if(stats_init() != 0 || admission_init() != 0 || trace_init() != 0 || capture_init() != 0 || broadcast_init() != 0)
+    {
+        return -1;
+    }
+    setup_worker_stats_signal_handler();
+
+    // warm up once here, the workers inherit the resolved upstreams, the route
+    // tree, the loaded handler and everything its init built, copy-on-write
+    if(proxy_init() != 0 || router_init() != 0)
+    {
+        return -1;
+    }
+    library_load_all(&worker_hooks, "Master");
+    fflush(stdout);    // or every worker repeats what is still buffered
+
     // fork worker processes
     for(int i = 0; i < WORKER_COUNT; i++)
     {
-        pid_t pid = fork();
+        pid_t pid;
+
+        fork_ns = trace_now_ns();
+        pid     = fork();
         if(pid < 0)
         {
             perror("worker_init: fork\n");
@@ -296,6 +610,16 @@ void worker_cleanup(void)
 
     free(worker_pids);
     worker_pids = NULL;
+
+    stats_print();
+    stats_cleanup();
+    admission_cleanup();
+    trace_cleanup();
+    capture_cleanup();
+    broadcast_cleanup();
+    library_cleanup();
+    router_cleanup();
+    proxy_cleanup();
 }
 
 void worker_signal_handler(int sig)